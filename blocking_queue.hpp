@@ -0,0 +1,73 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include <boost/utility.hpp>
+
+using namespace std;
+
+// Bounded multi-producer multi-consumer queue.
+// Producers block while it's full, consumers block while it's empty,
+// after close() consumers get what's left and then pop() returns false.
+template <typename T>
+class Blocking_queue : boost::noncopyable
+{
+    private:
+        mutex lock;
+        condition_variable not_empty, not_full;
+        deque<T> items;
+        size_t capacity;
+        bool closed;
+
+    public:
+        Blocking_queue (size_t capacity)
+        {
+            this->capacity=capacity;
+            closed=false;
+        };
+
+        void push (T t)
+        {
+            unique_lock<mutex> l(lock);
+            while (items.size()>=capacity)
+                not_full.wait (l);
+            items.push_back (t);
+            not_empty.notify_one();
+        };
+
+        bool pop (T & out)
+        {
+            unique_lock<mutex> l(lock);
+            while (items.empty() && !closed)
+                not_empty.wait (l);
+            if (items.empty())
+                return false;
+            out=items.front();
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        };
+
+        // like pop(), but doesn't wait: false if there is nothing right now
+        bool try_pop (T & out)
+        {
+            lock_guard<mutex> l(lock);
+            if (items.empty())
+                return false;
+            out=items.front();
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        };
+
+        void close()
+        {
+            lock_guard<mutex> l(lock);
+            closed=true;
+            not_empty.notify_all();
+        };
+};
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -2,11 +2,14 @@
 
 #include <stdio.h>
 #include <assert.h>
-#include <io.h>
 #include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
 
 #include <string>
 #include <list>
+#include <vector>
 #include <memory>
 #include <set>
 #include <map>
@@ -15,471 +18,890 @@
 #include <fstream>
 #include <algorithm>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 #include <boost/utility.hpp>
 #include <boost/variant.hpp>
 #include <boost/range/adaptor/map.hpp>
 #include <boost/range/adaptors.hpp>
-#include <boost/flyweight.hpp>
 
 #include "utils.hpp"
 #include "sha512.h"
+#include "fast_hash.h"
+#include "sha512_mb.hpp"
+#include "hash_engine.hpp"
+#include "work_stealing.hpp"
+#include "external.hpp"
+#ifndef _WIN32
+#include "hash_cache.hpp"
+#include "hash_db.hpp"
+#endif
 
 using namespace std;
-using namespace std::tr1::placeholders;
+using namespace std::placeholders;
 using namespace boost::adaptors;
 
-class Node;
-typedef set<Node*> Node_group;
-FileSize be_sure_all_Nodes_have_same_size_and_return_it(const Node_group & n);
-wostream& operator<< (wostream &out, const Node &in); // FIXME: make if friend
-wostream& operator<< (wostream &out, const Node_group &in);
+class Tree;
+class Tree_scanner;
+
+typedef uint32_t Node_id;
+#define NO_NODE ((Node_id)-1)
+typedef vector<Node_id> Node_group;
+FileSize be_sure_all_Nodes_have_same_size_and_return_it(const Tree & t, const Node_group & n);
+void dump_node (wostream &out, const Tree & t, Node_id n);
+void dump_node_group (wostream &out, const Tree & t, const Node_group & in);
+
+typedef Digest Partial_hash;
+typedef Digest Full_hash;
+typedef Digest Dir_group_id;
 
-typedef string Partial_hash;
-typedef string Full_hash;
-typedef string Dir_group_id;
+#define NO_DIGEST ((uint32_t)-1)
 
-class Node : boost::noncopyable
+// candidates of a stage, grouped by key (size or digest): flat (key, node) pairs instead of
+// map<Key, Node_group>, so there is one allocation instead of two per node, and sorting is cache-friendly.
+// after sort_keyed_nodes(), nodes with equal keys are neighbours, ordered by Node_id
+template <typename Key> using Keyed_nodes=vector<pair<Key, Node_id>>;
+
+// LSD radix sort, byte by byte. bytes equal in all keys (high bytes of sizes, mostly) are skipped.
+// it's stable, and nodes are added in Node_id order, so that order is kept within each group
+void sort_keyed_nodes (Keyed_nodes<FileSize> & v)
 {
-    public:
-        Partial_hash memoized_partial_hash; // hash level 2, (SHA512 of first and last 512 bytes) - may be empty
-        Full_hash memoized_full_hash; // hash level 3, may be empty
-        Node* parent; // do you really need it? change to bool?
-        boost::flyweight<wstring> dir_name; // full path
-        boost::flyweight<wstring> file_name; // in case of files
-        FileSize size; // always here
-        bool is_dir:1; // false - file, true - dir
-        bool size_unique:1;
-        bool partial_hash_unique:1;
-        bool full_hash_unique:1;
-        bool already_dumped:1;
-        Node_group children; // (for dir only)
-
-        bool generate_partial_hash();
-        bool generate_full_hash();
-
-        Node::Node(Node* parent, wstring dir_name, wstring file_name, bool is_dir)
-        {
-            assert (dir_name[dir_name.size()-1]=='\\');
-            this->parent=parent;
-            this->dir_name=dir_name;
-            this->file_name=file_name;
-            this->is_dir=is_dir;
-            size=0; // yet
-            size_unique=partial_hash_unique=full_hash_unique=false;
-            already_dumped=false;
-        };
+    Keyed_nodes<FileSize> tmp (v.size());
+    for (int shift=0; shift<64 && v.size()>1; shift+=8)
+    {
+        size_t count[256]={0};
+        for (auto &e : v)
+            count[(e.first >> shift) & 0xff]++;
+        if (count[(v[0].first >> shift) & 0xff]==v.size())
+            continue;
 
-        wstring get_name() const
+        size_t pos=0;
+        for (int i=0; i<256; i++)
         {
-            if (is_dir)
-                return dir_name;
-            else
-                return wstring(dir_name) + wstring(file_name);
+            size_t c=count[i];
+            count[i]=pos;
+            pos+=c;
         };
+        for (auto &e : v)
+            tmp[count[(e.first >> shift) & 0xff]++]=e;
+        v.swap (tmp);
+    };
+};
 
-        bool collect_info();
-        FileSize get_size() const { return size; };
+// digests are random and compared with one memcmp(), comparison sort is good enough for them
+void sort_keyed_nodes (Keyed_nodes<Digest> & v)
+{
+    sort (v.begin(), v.end());
+};
 
-        bool get_partial_hash(Partial_hash & out)
+// f(first, last) is called for each run [first, last) of equal keys in sorted v
+template <typename Key, typename F> void for_each_run (const Keyed_nodes<Key> & v, F f)
+{
+    size_t last;
+    for (size_t first=0; first<v.size(); first=last)
+    {
+        for (last=first+1; last<v.size() && v[last].first==v[first].first; last++)
+            ;
+        f (first, last);
+    };
+};
+
+// All nodes of the file tree live in one arena, as parallel arrays indexed by Node_id,
+// so there is no per-node heap allocation, and stages are linear scans over arrays.
+// Node 0 is root. Children of each directory are stored contiguously, and always after their parent,
+// so bottom-up work (directory sizes and hashes) is one backward pass.
+// Digests are in a side table: only nodes which were hashed have them.
+// Only own name of each node is stored, full paths are made from parent chain when needed.
+// Stages don't walk the whole tree: they work on the list of candidates, which shrinks after each one.
+class Tree : boost::noncopyable
+{
+    public:
+        enum
         {
-            if (memoized_partial_hash.size()==0)
-                if (generate_partial_hash()==false)
-                    return false;
-            assert (memoized_partial_hash.size()!=0);
-            out=memoized_partial_hash;
-            return true;
+            IS_DIR=1, // false - file, true - dir
+            SIZE_UNIQUE=2,
+            PARTIAL_HASH_UNIQUE=4,
+            FULL_HASH_UNIQUE=8,
+            ALREADY_DUMPED=16,
+            COLLECTED=32, // directory was read successfully (set in stage 1)
+            CUT=64, // children of this directory are not to be reported
+            HIDDEN=128 // directory we failed to read, or one of parents is CUT
         };
 
-        Partial_hash get_partial_hash()
+        vector<FileSize> size; // always here
+        vector<uint64_t> inode; // 0 if unknown
+        vector<Node_id> parent; // NO_NODE for root
+        vector<Node_id> first_child; // (for dir only) children are [first_child, first_child+children)
+        vector<uint32_t> children;
+        vector<uint8_t> flags;
+        // names of all nodes, back to back: name of node n is [name_start[n], name_start[n+1]).
+        // top level directories have full path (as given, ending with PATH_SEPARATOR) as their name
+        Name names;
+        vector<uint64_t> name_start;
+        // hard links: one physical file is read only once, through the first of its names.
+        // other names have link_of pointing to it and take hashes from it, and are reported along with it
+        vector<Node_id> link_of;
+        map<Node_id, vector<Node_id>> other_links;
+
+        vector<uint32_t> partial_hash_slot; // hash level 2, (SHA512 of first and last 512 bytes) - may be NO_DIGEST
+        vector<uint32_t> full_hash_slot; // hash level 3, may be NO_DIGEST
+        vector<Digest> digests;
+
+        // nodes still in the running, in Node_id order. it starts with all present nodes after stage 1,
+        // and each stage drops the nodes it found unique, so the next one doesn't even look at them
+        vector<Node_id> candidates;
+
+        mutex lock; // taken while nodes are added by stage 1 threads
+
+        Tree()
         {
-            if (memoized_partial_hash.size()==0)
-                if (generate_partial_hash()==false)
-                {
-                    assert (0);
-                };
-            assert (memoized_partial_hash.size()!=0);
-            return memoized_partial_hash;
+            name_start.push_back (0);
+            add (NO_NODE, Name(), true, 0, 0);
         };
 
-       bool get_full_hash(Full_hash & out)
+        size_t count() const { return size.size(); };
+        bool is (Node_id n, uint8_t flag) const { return (flags[n] & flag)!=0; };
+        void set (Node_id n, uint8_t flag) { flags[n]|=flag; };
+        bool is_dir (Node_id n) const { return is (n, IS_DIR); };
+        // root and directories dropped from the tree are not taken into account anywhere
+        bool present (Node_id n) const { return n!=0 && !is (n, HIDDEN); };
+
+        Node_id add (Node_id parent, const Name & name, bool is_dir, FileSize size, uint64_t inode)
         {
-            if (memoized_full_hash.size()==0)
-                if (generate_full_hash()==false)
-                    return false;
-            assert (memoized_full_hash.size()!=0);
-            out=memoized_full_hash;
-            return true;
+            this->size.push_back (size);
+            this->inode.push_back (inode);
+            this->parent.push_back (parent);
+            first_child.push_back (0);
+            children.push_back (0);
+            flags.push_back (is_dir ? IS_DIR : COLLECTED);
+            names.append (name);
+            name_start.push_back (names.size());
+            link_of.push_back (NO_NODE);
+            partial_hash_slot.push_back (NO_DIGEST);
+            full_hash_slot.push_back (NO_DIGEST);
+            return (Node_id)(count()-1);
         };
 
-        Full_hash get_full_hash()
+        wstring get_own_name (Node_id n) const
         {
-            if (memoized_full_hash.size()==0)
-                if (generate_full_hash()==false)
-                {
-                    assert(0);
-                };
-            assert (memoized_full_hash.size()!=0);
-            return memoized_full_hash;
+            return from_name (names.data()+name_start[n], name_start[n+1]-name_start[n]);
         };
- 
-        bool is_partial_hash_present() const
+
+        // full path: own names of all parents, starting from top level directory.
+        // names of directories end with PATH_SEPARATOR
+        wstring get_name (Node_id n) const
+        {
+            vector<Node_id> chain;
+            for ( ; n!=0; n=parent[n])
+                chain.push_back (n);
+
+            wstring rt;
+            for (auto i=chain.rbegin(); i!=chain.rend(); i++)
+            {
+                rt+=get_own_name (*i);
+                if (is_dir (*i) && parent[*i]!=0) // top level ones have it already
+                    rt+=PATH_SEPARATOR;
+            };
+            return rt;
+        };
+
+        // directory itself, or directory where file is
+        wstring get_dir_name (Node_id n) const
         {
-            return memoized_partial_hash.size()>0;
+            return get_name (is_dir (n) ? n : parent[n]);
         };
 
-        bool is_full_hash_present() const
+        // for reporting: other hard links to this file are listed right after its name
+        wstring get_name_with_links (Node_id n) const
         {
-            return memoized_full_hash.size()>0;
+            wstring rt=get_name (n);
+            auto i=other_links.find (n);
+            if (i!=other_links.end())
+                for (auto &l : i->second)
+                    rt=rt + L"\n    (hard link) " + get_name (l);
+            return rt;
         };
 
-        // adding all nodes... there are no unique nodes yet
-        void add_all_children (map<FileSize, Node_group> & out)
+        template <typename F> void for_each_child (Node_id n, F f) const
         {
-            if (parent!=NULL) // isn't root node?
-                out[size].insert(this);
-            if (is_dir)
-                for_each(children.begin(), children.end(), bind(&Node::add_all_children, _1, ref(out)));
+            for (Node_id c=first_child[n]; c<first_child[n]+children[n]; c++)
+                if (!is (c, HIDDEN))
+                    f (c);
         };
 
-        // partial hashing occuring here
-        // adding only nodes having size_unique=false, key of 'out' is partial hash
-        void add_children_for_stage2 (map<Partial_hash, Node_group> & out)
+        // drop directories we failed to read, and sum up sizes bottom-up
+        void finish_scan()
         {
-            if (!size_unique && parent!=NULL)
+            for (Node_id n=1; n<count(); n++)
             {
-                if (generate_partial_hash())
-                    out[get_partial_hash()].insert(this);
+                if (is_dir (n) && !is (n, COLLECTED))
+                    set (n, HIDDEN);
+                if (present (n))
+                    candidates.push_back (n);
             };
 
-            if (is_dir)
-                for_each(children.begin(), children.end(), bind(&Node::add_children_for_stage2, _1, ref(out)));
+            for (Node_id n=count()-1; n>0; n--)
+                if (present (n))
+                    size[parent[n]]+=size[n];
         };
 
-        // the stage3 is where full hashing occured
-        // add all nodes except...
-        // ignore nodes with size_unique=true OR partial_hash_unique=true
-        // key of 'out' is full hash
-        void add_children_for_stage3 (map<Full_hash, Node_group> & out)
+        // called after CUT flags are set
+        void hide_children_of_cut_dirs()
         {
-            if (!size_unique && !partial_hash_unique && parent!=NULL)
-            {
-                if (generate_full_hash())
-                    out[get_full_hash()].insert(this);
-            };
+            for (Node_id n=1; n<count(); n++)
+                if (is (parent[n], CUT) || is (parent[n], HIDDEN))
+                    set (n, HIDDEN);
+            drop_candidates (HIDDEN);
+        };
 
-            if (is_dir)
-                for_each(children.begin(), children.end(), bind(&Node::add_children_for_stage3, _1, ref(out)));
+        // compact candidates in place, order is kept
+        void drop_candidates (uint8_t flag)
+        {
+            candidates.erase (remove_if (candidates.begin(), candidates.end(), [&](Node_id n) { return is (n, flag) || !present (n); }),
+                    candidates.end());
         };
 
-        void add_all_nonunique_full_hashed_children_only_files (map<Full_hash, Node_group> & out)
+        void set_digest (vector<uint32_t> & slots, Node_id n, const Digest & d)
         {
-            if (!size_unique && !partial_hash_unique && !full_hash_unique && parent!=NULL && !is_dir)
-            {
-                if (generate_full_hash())
-                    out[get_full_hash()].insert(this);
-            };
+            slots[n]=digests.size();
+            digests.push_back (d);
+        };
+
+        bool has_partial_hash (Node_id n) const { return partial_hash_slot[n]!=NO_DIGEST; };
+        bool has_full_hash (Node_id n) const { return full_hash_slot[n]!=NO_DIGEST; };
+        const Partial_hash & get_partial_hash (Node_id n) const { assert (has_partial_hash (n)); return digests[partial_hash_slot[n]]; };
+        const Full_hash & get_full_hash (Node_id n) const { assert (has_full_hash (n)); return digests[full_hash_slot[n]]; };
 
-            if (is_dir)
-                for_each(children.begin(), children.end(), bind(&Node::add_all_nonunique_full_hashed_children_only_files, _1, ref(out)));
+        bool generate_partial_hash (Node_id n);
+        bool generate_full_hash (Node_id n);
+        void generate_dir_hashes (vector<uint32_t> & slots, bool (Tree::*generate)(Node_id));
+
+        // files to be hashed in stage 2 and 3, all at once (of hard links, only the first name is read)
+        void add_files_to_read (vector<Node_id> & out) const
+        {
+            for (auto &n : candidates)
+                if (!is_dir (n) && link_of[n]==NO_NODE)
+                    out.push_back (n);
         };
 
-        void add_all_nonunique_full_hashed_children (map<Full_hash, Node_group> & out)
+        // adding all nodes... there are no unique nodes yet
+        void add_all_children (Keyed_nodes<FileSize> & out) const
         {
-            if (!size_unique && !partial_hash_unique && !full_hash_unique && parent!=NULL)
-            {
-                if (generate_full_hash())
-                    out[get_full_hash()].insert(this);
-            };
+            for (auto &n : candidates)
+                out.push_back (make_pair (size[n], n));
+        };
 
-            if (is_dir)
-                for_each(children.begin(), children.end(), bind(&Node::add_all_nonunique_full_hashed_children, _1, ref(out)));
+        // candidates are nodes having size_unique=false now, key of 'out' is partial hash
+        // (files and directories are hashed by this moment, but failed files are tried again)
+        void add_children_for_stage2 (Keyed_nodes<Partial_hash> & out)
+        {
+            for (auto &n : candidates)
+                if (generate_partial_hash (n))
+                    out.push_back (make_pair (get_partial_hash (n), n));
         };
-};
 
-struct is_Node_group_have_size_1
-{
-    bool operator()( Node_group n ) const { return n.size()==1; }
+        // the stage3 is where full hashing occured
+        // candidates are nodes with size_unique=false AND partial_hash_unique=false now
+        // key of 'out' is full hash
+        void add_children_for_stage3 (Keyed_nodes<Full_hash> & out)
+        {
+            for (auto &n : candidates)
+                if (generate_full_hash (n))
+                    out.push_back (make_pair (get_full_hash (n), n));
+        };
+
+        // nodes with full_hash_unique=true are dropped from candidates by now
+        void add_all_nonunique_full_hashed_children_only_files (map<Full_hash, Node_group> & out)
+        {
+            for (auto &n : candidates)
+                if (!is_dir (n) && generate_full_hash (n))
+                    out[get_full_hash (n)].push_back (n);
+        };
+
+        void add_all_nonunique_full_hashed_children (map<Full_hash, Node_group> & out)
+        {
+            for (auto &n : candidates)
+                if (generate_full_hash (n))
+                    out[get_full_hash (n)].push_back (n);
+        };
 };
 
 struct is_Node_group_dont_have_size_1
 {
-    bool operator()( Node_group n ) const { return n.size()!=1; }
+    bool operator()( const Node_group & n ) const { return n.size()!=1; }
 };
 
-FileSize set_of_Nodes_sum_size(const Node_group & group);
+FileSize set_of_Nodes_sum_size(const Tree & t, const Node_group & group);
 struct is_Node_group_size_not_zero
 {
-    bool operator()( Node_group n ) const { return set_of_Nodes_sum_size(n)!=0; }
+    const Tree & t;
+    is_Node_group_size_not_zero (const Tree & t) : t(t) {};
+    bool operator()( const Node_group & n ) const { return set_of_Nodes_sum_size(t, n)!=0; }
 };
 
 struct is_Node_group_type_dir
 {
-    bool operator()( Node_group n ) const 
-    { 
-        bool rt_is_dir=(*n.begin())->is_dir;
+    const Tree & t;
+    is_Node_group_type_dir (const Tree & t) : t(t) {};
+    bool operator()( const Node_group & n ) const
+    {
+        bool rt_is_dir=t.is_dir (*n.begin());
         // just to be sure
         for (auto &node : n)
         {
-            if (rt_is_dir != node->is_dir)
+            if (rt_is_dir != t.is_dir (node))
             {
                 wcout << WFUNCTION << L"() not all nodes in Node_group has same is_dir" << endl;
-                wcout << n;
+                dump_node_group (wcout, t, n);
                 exit(0);
             };
         };
-        return rt_is_dir; 
+        return rt_is_dir;
     }
 };
 
-map<FileSize, set<Node_group>> _add_all_nonunique_full_hashed_children (Node* root)
+map<FileSize, set<Node_group>> _add_all_nonunique_full_hashed_children (Tree & t)
 {
     map<FileSize, set<Node_group>> rt;
 
     map<Full_hash, Node_group> tmp;
-    root->add_all_nonunique_full_hashed_children (tmp);
+    t.add_all_nonunique_full_hashed_children (tmp);
 
     // do not add 1-sized node groups. these "orphaned" nodes may be here after fuzzy directory comparisons
     for(auto &node_group : tmp | map_values | filtered(is_Node_group_dont_have_size_1()))
     {
-        FileSize common_size=be_sure_all_Nodes_have_same_size_and_return_it (node_group);
+        FileSize common_size=be_sure_all_Nodes_have_same_size_and_return_it (t, node_group);
         rt[common_size].insert (node_group);
     };
     return rt;
 };
 
-FileSize be_sure_all_Nodes_have_same_size_and_return_it(const Node_group & n)
+FileSize be_sure_all_Nodes_have_same_size_and_return_it(const Tree & t, const Node_group & n)
 {
     assert (n.size()>0);
-    FileSize rt=(*n.begin())->size;
-    if (any_of(n.cbegin(), n.cend(), [&](Node* n){ return n->size!=rt; }))
+    FileSize rt=t.size[*n.begin()];
+    if (any_of(n.cbegin(), n.cend(), [&](Node_id n){ return t.size[n]!=rt; }))
         {
             wcerr << WFUNCTION << " check failed. all nodes:" << endl;
-            wcerr << n;
+            dump_node_group (wcerr, t, n);
             exit(0);
         };
     return rt;
 };
 
-wostream& operator<< (wostream &out, const Node &in)
+void dump_node (wostream &out, const Tree & t, Node_id n)
 {
-    out << "Node. size=" << in.size << " ";
+    out << "Node. size=" << t.size[n] << " ";
 
-    if (in.is_dir)
-        out << "directory. dir_name=" << in.dir_name;
+    if (t.is_dir (n))
+        out << "directory. dir_name=" << t.get_dir_name (n);
     else
-        out << "file. dir_name=" << in.dir_name << " file_name=" << in.file_name;
-    
-    out << " size_unique=" << in.size_unique << " partial_hash_unique=" << in.partial_hash_unique << 
-        " full_hash_unique=" << in.full_hash_unique;
+        out << "file. dir_name=" << t.get_dir_name (n) << " file_name=" << t.get_own_name (n);
+
+    out << " size_unique=" << t.is (n, Tree::SIZE_UNIQUE) << " partial_hash_unique=" << t.is (n, Tree::PARTIAL_HASH_UNIQUE) <<
+        " full_hash_unique=" << t.is (n, Tree::FULL_HASH_UNIQUE);
 
-    if (in.is_partial_hash_present())
+    if (t.has_partial_hash (n))
     {
-        out << " memoized_partial_hash=" << in.memoized_partial_hash.c_str();
+        out << " memoized_partial_hash=" << digest_to_hex (t.get_partial_hash (n)).c_str();
     };
 
-    if (in.is_full_hash_present())
+    if (t.has_full_hash (n))
     {
-        out << " memoized_full_hash=" << in.memoized_full_hash.c_str();
+        out << " memoized_full_hash=" << digest_to_hex (t.get_full_hash (n)).c_str();
     };
-    
-    out << endl;
 
-    return out;
+    out << endl;
 };
 
-bool Node::generate_partial_hash()
+bool Tree::generate_partial_hash (Node_id n)
 {
-    if (memoized_partial_hash.size()>0)
+    if (has_partial_hash (n))
         return true;
 
-    if (is_dir)
-    {
-        // can't do set here (there can be multiple files with same content)
-        // can't do multiset here (transform() wouldn't work)
-        list<Partial_hash> hashes;
+    if (is_dir (n))
+        return false; // see generate_dir_hashes()
 
-        // can partial hash be generated for each children?
-        if (all_of (children.cbegin(), children.cend(), [](Node *n) -> bool { return n->generate_partial_hash(); }))
-        {
-            hashes.insert (hashes.begin(), children.size(), "");
-            transform(children.begin(), children.end(), hashes.begin(), [](Node* n) -> Partial_hash { return n->get_partial_hash(); });
-
-            multiset<Partial_hash> sorted_hashes;
-            sorted_hashes.insert (hashes.begin(), hashes.end());
-            // here we use the fact multiset<Partial_hash> is already sorted...
-            memoized_partial_hash=SHA512_process (sorted_hashes);
-        }
-        else
-            return false;
-    }
-    else
+    if (link_of[n]!=NO_NODE)
     {
-        if (size_unique)
+        if (generate_partial_hash (link_of[n])==false)
             return false;
-
-        set_current_dir (dir_name);
-        return (partial_SHA512_of_file (file_name, memoized_partial_hash));
+        partial_hash_slot[n]=partial_hash_slot[link_of[n]];
+        return true;
     };
+
+    if (is (n, SIZE_UNIQUE))
+        return false;
+
+    Dir_handle dir;
+    Partial_hash h;
+    if (get_dir_handle (get_dir_name (n), dir)==false || partial_SHA512_of_file (dir, get_own_name (n), h)==false)
+        return false;
+    set_digest (partial_hash_slot, n, h);
     return true;
 };
 
-bool Node::generate_full_hash()
+bool Tree::generate_full_hash (Node_id n)
 {
-    if (memoized_full_hash.size()>0)
+    if (has_full_hash (n))
         return true;
 
-    if (is_dir)
-    {
-        // can't do set here (there can be multiple files with same content)
-        // can't do multiset here (transform() wouldn't work)
-        list<Full_hash> hashes;
-
-        // can partial hash be generated for each children?
-        if (all_of (children.cbegin(), children.cend(), [](Node *n) -> bool { return n->generate_full_hash(); }))
-        {
-            hashes.insert (hashes.begin(), children.size(), "");
-            transform(children.begin(), children.end(), hashes.begin(), [](Node* n) -> Full_hash { return n->get_full_hash(); });
+    if (is_dir (n))
+        return false; // see generate_dir_hashes()
 
-            multiset<Full_hash> sorted_hashes;
-            sorted_hashes.insert (hashes.begin(), hashes.end());
-            // here we use the fact multiset<Full_hash> is already sorted...
-            memoized_full_hash=SHA512_process (sorted_hashes);
-        }
-        else
-            return false;
-    }
-    else
+    if (link_of[n]!=NO_NODE)
     {
-        if (size_unique || partial_hash_unique)
+        if (generate_full_hash (link_of[n])==false)
             return false;
-
-        set_current_dir (dir_name);
-        return SHA512_of_file (file_name, memoized_full_hash);
+        full_hash_slot[n]=full_hash_slot[link_of[n]];
+        return true;
     };
+
+    if (is (n, SIZE_UNIQUE) || is (n, PARTIAL_HASH_UNIQUE) || is (n, FULL_HASH_UNIQUE)) // last one is set by compare_files() only
+        return false;
+
+    Dir_handle dir;
+    Full_hash h;
+    if (get_dir_handle (get_dir_name (n), dir)==false || SHA512_of_file (dir, get_own_name (n), h)==false)
+        return false;
+    set_digest (full_hash_slot, n, h);
     return true;
 };
 
-bool Node::collect_info()
+// hash of directory is hash of sorted hashes of its children, so children go first: backward pass.
+// directory gets no hash if any of its children can't be hashed (unique size, for example).
+// only candidates are hashed: directory dropped by previous stage can't be equal to anything anyway
+void Tree::generate_dir_hashes (vector<uint32_t> & slots, bool (Tree::*generate)(Node_id))
 {
-    if (is_dir==false)
+    for (auto i=candidates.rbegin(); i!=candidates.rend(); i++)
     {
-        set_current_dir (dir_name);
-        return get_file_size (file_name, size);
-    }
-    else
-    {
-        WIN32_FIND_DATA ff;
-        HANDLE hfile;
+        Node_id n=*i;
+        if (!is_dir (n) || slots[n]!=NO_DIGEST)
+            continue;
 
-        if (set_current_dir (dir_name)==false)
-            return false;
+        // can hash be generated for each children?
+        bool all=true;
+        for_each_child (n, [&](Node_id c) { all=all && (this->*generate)(c); });
+        if (all==false)
+            continue;
+
+        // can't do set here (there can be multiple files with same content)
+        multiset<Digest> sorted_hashes;
+        for_each_child (n, [&](Node_id c) { sorted_hashes.insert (digests[slots[c]]); });
+        // here we use the fact multiset<Digest> is already sorted...
+        set_digest (slots, n, SHA512_process (sorted_hashes));
+    };
+};
+
+struct Hard_link
+{
+    uint64_t dev, inode;
+    Node_id node;
+};
+
+struct Scan_task
+{
+    Node_id dir;
+    wstring path; // full, ending with PATH_SEPARATOR
+    Dir_handle handle;
+    bool opened; // handle was opened relative to parent directory while queuing this task
+};
 
-        if ((hfile=FindFirstFile (L"*", &ff))==INVALID_HANDLE_VALUE)
+// stage 1: all directories are scanned on all available cores.
+// directory handles of queued subdirectories are opened relative to their parent right away,
+// but only as long as there are not too many of them (each one is a file descriptor on POSIX),
+// the rest are opened by full path when their turn comes.
+class Tree_scanner : boost::noncopyable
+{
+    private:
+        Tree & tree;
+        Work_stealing_pool<Scan_task> pool;
+        atomic<size_t> queued_handles;
+        static const size_t max_queued_handles=256;
+        vector<vector<Hard_link>> hard_links; // for each worker
+
+        // names of the same file are sorted, so the first one (in path order) represents all of them
+        void collapse_hard_links()
         {
-            wcerr << L"FindFirstFile() failed" << endl;
-            return false;
+            vector<Hard_link> all;
+            for (auto &v : hard_links)
+                all.insert (all.end(), v.begin(), v.end());
+
+            sort (all.begin(), all.end(), [&](const Hard_link & a, const Hard_link & b)
+            {
+                if (a.dev!=b.dev)
+                    return a.dev<b.dev;
+                return a.inode<b.inode;
+            });
+
+            for (size_t i=0; i<all.size(); )
+            {
+                size_t j=i+1;
+                while (j<all.size() && all[j].dev==all[i].dev && all[j].inode==all[i].inode)
+                    j++;
+
+                // full names are made only for names of the same file
+                vector<pair<wstring, Node_id>> names;
+                for (size_t k=i; k<j; k++)
+                    names.push_back (make_pair (tree.get_name (all[k].node), all[k].node));
+                sort (names.begin(), names.end());
+
+                for (size_t k=1; k<names.size(); k++)
+                {
+                    tree.link_of[names[k].second]=names[0].second;
+                    tree.other_links[names[0].second].push_back (names[k].second);
+                };
+                i=j;
+            };
         };
 
-        do
+        // read one directory. all its entries are added to the tree at once (so they are contiguous),
+        // subdirectories are queued, so any idle thread may pick them up.
+        // if directory can't be read, it's not COLLECTED and will be dropped
+        void collect_info (size_t worker, const Scan_task & t)
         {
-            DWORD att=ff.dwFileAttributes;
-            bool is_dir;
-            wstring new_name;
+            static thread_local vector<Dir_entry> entries;
+            entries.clear();
+            if (enumerate_dir (t.handle, [&](const Dir_entry & e) { entries.push_back (e); })==false)
+                return;
+
+            // names are made before taking the lock
+            static thread_local vector<Name> names;
+            names.clear();
+            for (auto &e : entries)
+                names.push_back (to_name (e.name));
+
+            Node_id first;
+            {
+                lock_guard<mutex> l(tree.lock);
+                first=tree.count();
+                for (size_t i=0; i<entries.size(); i++)
+                {
+                    const Dir_entry & e=entries[i];
+                    tree.add (t.dir, names[i], e.is_dir, e.is_dir ? 0 : e.size, e.inode);
+                };
+                tree.first_child[t.dir]=first;
+                tree.children[t.dir]=entries.size();
+                tree.set (t.dir, Tree::COLLECTED);
+            };
 
-            if (att & FILE_ATTRIBUTE_REPARSE_POINT) // do not follow symlinks
-                continue;
+            uint64_t dev;
+            bool dev_known=false; // asked only if there are hard links here
 
-            Node* n;
+            for (size_t i=0; i<entries.size(); i++)
+            {
+                const Dir_entry & e=entries[i];
+                if (e.is_dir)
+                    queue_subdir (worker, first+i, t.path + e.name + PATH_SEPARATOR, t.handle, e.name);
+                else if (e.links>1 && (dev_known || (dev_known=get_dir_device (t.handle, dev))))
+                {
+                    Hard_link l;
+                    l.dev=dev;
+                    l.inode=e.inode;
+                    l.node=first+i;
+                    hard_links[worker].push_back (l);
+                };
+            };
+        };
 
-            if (att & FILE_ATTRIBUTE_DIRECTORY) 
-            { // it's dir
-                if (ff.cFileName[0]=='.') // skip subdirectories links
-                    continue;
+        void scan (size_t worker, Scan_task t)
+        {
+            if (t.opened)
+                queued_handles--;
+            else if (open_dir (t.path, t.handle)==false)
+                return; // not COLLECTED, so this directory will be dropped
 
-                is_dir=true;
-                n=new Node (this, wstring(dir_name) + wstring(ff.cFileName) + wstring(L"\\"), L"", is_dir); 
-            }
-            else
-            { // it is file
-                is_dir=false;
-                n=new Node (this, wstring(dir_name), wstring(ff.cFileName), is_dir);
+            collect_info (worker, t);
+            close_dir (t.handle);
+        };
+
+        void queue_subdir (size_t worker, Node_id n, const wstring & path, const Dir_handle & parent, const wstring & name)
+        {
+            Scan_task t;
+            t.dir=n;
+            t.path=path;
+            t.opened=false;
+            if (queued_handles<max_queued_handles && open_subdir (parent, name, t.handle))
+            {
+                t.opened=true;
+                queued_handles++;
             };
+            pool.push (worker, t);
+        };
+
+    public:
+        Tree_scanner (Tree & tree) : tree(tree), pool (thread::hardware_concurrency()), hard_links (pool.threads())
+        {
+            queued_handles=0;
+        };
 
-            if (n->collect_info())
+        void run (const set<wstring> & dirs)
+        {
+            tree.first_child[0]=tree.count();
+            tree.children[0]=dirs.size();
+            tree.set (0, Tree::COLLECTED);
+
+            size_t worker=0;
+            for (auto &dir : dirs)
             {
-                children.insert (n);
-                size+=n->get_size();
+                Scan_task t;
+                t.path=dir;
+                t.dir=tree.add (0, to_name (dir), true, 0, 0);
+                t.opened=false;
+                pool.push (worker++ % pool.threads(), t);
             };
-        } 
-        while (FindNextFile (hfile, &ff)!=0);
 
-        FindClose (hfile);
-        return true;
-    };
+            pool.run (bind (&Tree_scanner::scan, this, _1, _2));
+
+            tree.finish_scan();
+            collapse_hard_links();
+        };
 };
 
-FileSize set_of_Nodes_sum_size(const Node_group & group)
+FileSize set_of_Nodes_sum_size(const Tree & t, const Node_group & group)
 {
     FileSize rt=0;
 
-    for_each (group.begin(), group.end(), [&](Node *n) { rt=rt+n->size; });
+    for_each (group.begin(), group.end(), [&](Node_id n) { rt=rt+t.size[n]; });
     return rt;
 };
 
-void mark_nodes_having_unique_sizes (Node* root)
+// nodes whose keys no other node has get the flag
+template <typename Key> void mark_nodes_with_unique_keys (Tree & t, Keyed_nodes<Key> & nodes, uint8_t flag)
 {
-    map<FileSize, Node_group> stage1;
-    root->add_all_children (stage1);
+    sort_keyed_nodes (nodes);
+    for_each_run (nodes, [&](size_t first, size_t last)
+    {
+        if (last-first==1)
+            t.set (nodes[first].second, flag);
+    });
+};
 
-    for(auto &node_group : stage1 | map_values | filtered(is_Node_group_have_size_1()))
-        (*node_group.begin())->size_unique=true;
+void mark_nodes_having_unique_sizes (Tree & t)
+{
+    Keyed_nodes<FileSize> stage1;
+    t.add_all_children (stage1);
+    mark_nodes_with_unique_keys (t, stage1, Tree::SIZE_UNIQUE);
+    t.drop_candidates (Tree::SIZE_UNIQUE);
 };
 
-void mark_nodes_having_unique_partial_hashes (Node* root)
+// full names of files of one batch, made from the tree only for the time it runs
+struct Hash_job_names
 {
-    map<Partial_hash, Node_group> stage2; 
-    root->add_children_for_stage2 (stage2);
-    
-    for(auto &node_group : stage2 | map_values | filtered(is_Node_group_have_size_1()))
-        (*node_group.begin())->partial_hash_unique=true;
+    map<Node_id, wstring> dirs; // one string per directory, as batch functions tell directories apart by address
+    vector<wstring> files;
+};
+
+// jobs for batch hashing functions. digest slots for them are allocated by callers beforehand,
+// so done() callbacks (running in several threads) only write, each to its own slot
+static vector<Hash_job> make_hash_jobs (Tree & t, const vector<Node_id> & files, Hash_job_names & names)
+{
+    vector<Hash_job> jobs (files.size());
+    names.files.resize (files.size());
+    for (size_t i=0; i<files.size(); i++)
+    {
+        Node_id dir=t.parent[files[i]];
+        auto d=names.dirs.find (dir);
+        if (d==names.dirs.end())
+            d=names.dirs.insert (make_pair (dir, t.get_name (dir))).first;
+        names.files[i]=t.get_own_name (files[i]);
+
+        jobs[i].dir_name=&d->second;
+        jobs[i].file_name=&names.files[i];
+        jobs[i].size=t.size[files[i]];
+        jobs[i].inode=t.inode[files[i]];
+    };
+    return jobs;
+};
+
+// read samples (heads, tails, and some blocks of big files) of all stage 2 files in one batch, so the I/O can be overlapped
+void generate_partial_hashes_for_files (Tree & t)
+{
+    vector<Node_id> files;
+    t.add_files_to_read (files);
+
+    Hash_job_names names;
+    vector<Hash_job> jobs=make_hash_jobs (t, files, names);
+    size_t first_slot=t.digests.size();
+    t.digests.resize (first_slot+files.size());
+
+    // may be called from several threads at once, but each one writes to its own slot
+    partial_SHA512_of_files (jobs, [&](size_t job, bool ok, const Digest & hash)
+    {
+        if (ok)
+        {
+            t.digests[first_slot+job]=hash;
+            t.partial_hash_slot[files[job]]=first_slot+job;
+        };
+    });
+
+    // big files of the same size and sampled hash are sampled again at more places (see partial_hash_samples()).
+    // all files of a group must have both digests, or none is replaced: equal files must get the same level.
+    // sizes having a failed file are skipped, it will be hashed again at level 1 (see add_children_for_stage2())
+    vector<pair<pair<FileSize, Digest>, size_t>> keyed;
+    set<FileSize> failed;
+    for (size_t i=0; i<files.size(); i++)
+        if (jobs[i].size>=PARTIAL_SAMPLED_MIN)
+        {
+            if (t.has_partial_hash (files[i]))
+                keyed.push_back (make_pair (make_pair (jobs[i].size, t.get_partial_hash (files[i])), i));
+            else
+                failed.insert (jobs[i].size);
+        };
+    sort (keyed.begin(), keyed.end());
+
+    vector<vector<size_t>> groups;
+    vector<Hash_job> jobs2;
+    vector<size_t> file_of; // index in files of each one of jobs2
+    size_t last;
+    for (size_t first=0; first<keyed.size(); first=last)
+    {
+        for (last=first+1; last<keyed.size() && keyed[last].first==keyed[first].first; last++)
+            ;
+        if (last-first<2 || failed.count (keyed[first].first.first))
+            continue;
+        groups.push_back (vector<size_t>());
+        for (size_t i=first; i<last; i++)
+        {
+            groups.back().push_back (jobs2.size());
+            jobs2.push_back (jobs[keyed[i].second]);
+            file_of.push_back (keyed[i].second);
+        };
+    };
+    if (jobs2.empty())
+        return;
+
+    vector<Digest> level2 (jobs2.size());
+    vector<uint8_t> level2_ok (jobs2.size(), 0);
+    partial_SHA512_of_files (jobs2, [&](size_t job, bool ok, const Digest & hash)
+    {
+        if (ok)
+        {
+            level2[job]=hash;
+            level2_ok[job]=1;
+        };
+    }, 2);
+
+    for (auto &g : groups)
+    {
+        bool all_ok=true;
+        for (auto &j : g)
+            all_ok=all_ok && level2_ok[j];
+        if (all_ok)
+            for (auto &j : g)
+                t.digests[t.partial_hash_slot[files[file_of[j]]]]=level2[j];
+    };
 };
 
-void mark_nodes_with_unique_full_hashes (Node* root)
+void mark_nodes_having_unique_partial_hashes (Tree & t)
 {
-    map<Full_hash, Node_group> stage3;
-    root->add_children_for_stage3 (stage3);
+    generate_partial_hashes_for_files (t);
+    t.generate_dir_hashes (t.partial_hash_slot, &Tree::generate_partial_hash);
 
-    for (auto &node_group : stage3 | map_values | filtered(is_Node_group_have_size_1()))
-        (*node_group.begin())->full_hash_unique=true;
+    Keyed_nodes<Partial_hash> stage2;
+    t.add_children_for_stage2 (stage2);
+    mark_nodes_with_unique_keys (t, stage2, Tree::PARTIAL_HASH_UNIQUE);
+    t.drop_candidates (Tree::PARTIAL_HASH_UNIQUE);
 };
 
-void cut_children_for_non_unique_dirs (Node* root)
+// stage 3 files are compared in lockstep within groups of same size and partial hash (see compare_files()),
+// so files which differ early are not read to the end. files found unlike any other are unique right away
+void generate_full_hashes_for_files (Tree & t)
 {
-    map<Full_hash, Node_group> stage3;
-    root->add_children_for_stage3 (stage3);
+    vector<Node_id> files;
+    t.add_files_to_read (files);
+
+    Hash_job_names names;
+    vector<Hash_job> jobs=make_hash_jobs (t, files, names);
+    size_t first_slot=t.digests.size();
+    t.digests.resize (first_slot+files.size());
+
+    // files without partial hash (failed to read) are left for generate_full_hash()
+    vector<pair<pair<FileSize, Digest>, size_t>> keyed;
+    for (size_t i=0; i<files.size(); i++)
+        if (t.has_partial_hash (files[i]))
+            keyed.push_back (make_pair (make_pair (t.size[files[i]], t.get_partial_hash (files[i])), i));
+    sort (keyed.begin(), keyed.end());
+
+    vector<vector<size_t>> groups;
+    size_t last;
+    for (size_t first=0; first<keyed.size(); first=last)
+    {
+        vector<size_t> group;
+        for (last=first; last<keyed.size() && keyed[last].first==keyed[first].first; last++)
+            group.push_back (keyed[last].second);
+        groups.push_back (group);
+    };
 
-    for(auto &node_group : stage3 | map_values | 
-            filtered(is_Node_group_dont_have_size_1()) | 
-            filtered(is_Node_group_size_not_zero()) | // should be evaluated before next filtered()
-            filtered(is_Node_group_type_dir()))
+    // done() may be called from several threads at once, but each one writes to its own slot
+    compare_files (jobs, groups, [&](size_t job, bool ok, const Digest & hash)
     {
-        // * cut unneeded (directory type) nodes for keys with more than only 1 value 
+        if (ok)
+        {
+            t.digests[first_slot+job]=hash;
+            t.full_hash_slot[files[job]]=first_slot+job;
+        };
+    },
+    [&](size_t job)
+    {
+        // file unlike any other may still make its hard links' directories equal
+        if (t.other_links.count (files[job]))
+            return false;
+        t.set (files[job], Tree::FULL_HASH_UNIQUE);
+        return true;
+    });
+};
+
+void mark_nodes_with_unique_full_hashes (Tree & t)
+{
+    generate_full_hashes_for_files (t);
+    t.generate_dir_hashes (t.full_hash_slot, &Tree::generate_full_hash);
+
+    Keyed_nodes<Full_hash> stage3;
+    t.add_children_for_stage3 (stage3);
+    mark_nodes_with_unique_keys (t, stage3, Tree::FULL_HASH_UNIQUE);
+    t.drop_candidates (Tree::FULL_HASH_UNIQUE);
+};
+
+void cut_children_for_non_unique_dirs (Tree & t)
+{
+    Keyed_nodes<Full_hash> stage3;
+    t.add_children_for_stage3 (stage3);
+    sort_keyed_nodes (stage3);
+
+    for_each_run (stage3, [&](size_t first, size_t last)
+    {
+        if (last-first==1)
+            return;
+
+        Node_group node_group;
+        for (size_t i=first; i<last; i++)
+            node_group.push_back (stage3[i].second);
+
+        // size should be checked before type
+        if (is_Node_group_size_not_zero(t)(node_group)==false || is_Node_group_type_dir(t)(node_group)==false)
+            return;
+
+        // * cut unneeded (directory type) nodes for keys with more than only 1 value
         // (e.g. nodes to be dumped)
-        // we just remove children at each node here!
-        for_each (node_group.begin(), node_group.end(), [](Node *n) { n->children.clear(); });
-    };
+        // we just hide children of each node here!
+        for_each (node_group.begin(), node_group.end(), [&](Node_id n) { t.set (n, Tree::CUT); });
+    });
+    t.hide_children_of_cut_dirs();
 };
 
-wostream& operator<< (wostream &out, const Node_group &in)
+void dump_node_group (wostream &out, const Tree & t, const Node_group &in)
 {
     out << "Node_group:" << endl;
     for (auto i=in.begin(); i!=in.end(); i++)
-        out << *(*i) << endl;
+        dump_node (out, t, *i);
     out << "*** end ***" << endl;
-    return out;
 };
 
 wstring set_to_string (const set<wstring> & in, wstring sep)
@@ -561,10 +983,10 @@ class Result
         };
 };
 
-void work_on_fuzzy_equal_dirs (Node *root, map<FileSize, set<Result*>> & results) 
+void work_on_fuzzy_equal_dirs (Tree & t, map<FileSize, set<Result*>> & results) 
 {
     map<Full_hash, Node_group> groups_of_similar_files;
-    root->add_all_nonunique_full_hashed_children_only_files (groups_of_similar_files);
+    t.add_all_nonunique_full_hashed_children_only_files (groups_of_similar_files);
 
     map<Dir_group_id, set<wstring>> dir_groups_files, dir_groups_names;
     map<Dir_group_id, FileSize> group_size;
@@ -578,9 +1000,9 @@ void work_on_fuzzy_equal_dirs (Node *root, map<FileSize, set<Result*>> & results
         // here we work with ONE file laying in different directories
         for (auto &node : node_group)
         {
-            directories.insert (node->dir_name);
-            files.insert (node->file_name);
-            links.insert (node);
+            directories.insert (t.get_dir_name (node));
+            files.insert (t.get_own_name (node));
+            links.push_back (node);
         };
         
         if (directories.size()==1) // this mean, some similar files withine ONE directory, do not report
@@ -590,8 +1012,8 @@ void work_on_fuzzy_equal_dirs (Node *root, map<FileSize, set<Result*>> & results
         dir_groups_files[dir_group].insert (files.begin(), files.end());
         
         dir_groups_names[dir_group].insert (directories.begin(), directories.end());
-        dir_groups_links[dir_group].insert (links.begin(), links.end());
-        group_size[dir_group]+=set_of_Nodes_sum_size(node_group);
+        dir_groups_links[dir_group].insert (dir_groups_links[dir_group].end(), links.begin(), links.end());
+        group_size[dir_group]+=set_of_Nodes_sum_size(t, node_group);
     };
     
     for (auto &group : dir_groups_files)
@@ -603,7 +1025,7 @@ void work_on_fuzzy_equal_dirs (Node *root, map<FileSize, set<Result*>> & results
         if (files.size()>2 && group_size[dir_group_id]>0)
         {
             for (auto &node : dir_groups_links[dir_group_id])
-                node->already_dumped=true;
+                t.set (node, Tree::ALREADY_DUMPED);
             FileSize v_group_size=group_size[dir_group_id];
             Result_fuzzy_equal_dirs* n=new Result_fuzzy_equal_dirs(dir_groups_names[dir_group_id], files, v_group_size);
             results[v_group_size].insert (new Result (n));
@@ -611,76 +1033,84 @@ void work_on_fuzzy_equal_dirs (Node *root, map<FileSize, set<Result*>> & results
     };
 };
 
-void add_exact_results (map<FileSize, set<Node_group>> & stage4, map<FileSize, set<Result*>> & results) 
+void add_exact_results (Tree & t, map<FileSize, set<Node_group>> & stage4, map<FileSize, set<Result*>> & results) 
 {
     for (auto &node_groups : stage4 | map_values)
         for (auto &node_group : node_groups)
         {
-            Node* first_node=*(node_group.begin());
+            Node_id first_node=*(node_group.begin());
 
             set<wstring> full_dirfilenames;
 
             for (auto &node : node_group)
-                if (node->already_dumped==false)
-                    full_dirfilenames.insert(node->get_name());
+            {
+                if (t.is (node, Tree::ALREADY_DUMPED))
+                    continue;
+                if (t.link_of[node]!=NO_NODE && find (node_group.begin(), node_group.end(), t.link_of[node])!=node_group.end()) // listed with its first name
+                    continue;
+                full_dirfilenames.insert(t.get_name_with_links (node));
+            };
 
-            if (full_dirfilenames.size()>1 && first_node->size>0)
-                results[first_node->size].insert (new Result(new Result_equal_files_dirs (first_node->is_dir, first_node->size, full_dirfilenames)));
+            if (full_dirfilenames.size()>1 && t.size[first_node]>0)
+                results[t.size[first_node]].insert (new Result(new Result_equal_files_dirs (t.is_dir (first_node), t.size[first_node], full_dirfilenames)));
         };
 };
 
 #include <boost/filesystem.hpp>
 #include <boost/serialization/serialization.hpp>
 
-#include <boost/archive/add_facet.hpp>
 #include <boost/archive/detail/utf8_codecvt_facet.hpp>
 
 void do_all(set<wstring> dirs)
 {
     const string result_filename="ddff_results.txt";
     locale old_loc;
-    locale* utf8_locale = boost::archive::add_facet(
-            old_loc, new boost::archive::detail::utf8_codecvt_facet);
+    // add_facet() is gone from newer Boost versions, and it was just a workaround for old compilers anyway
+    locale* utf8_locale = new locale(old_loc, new boost::archive::detail::utf8_codecvt_facet);
    
-    wstring dir_at_start=get_current_dir();
-    Node* root=new Node(NULL, L"\\", L"", true);
+    if (options.max_memory!=0)
+    {
+        // out-of-core mode writes results as it finds them
+        wofstream fout;
+        fout.open (result_filename, ios::out);
+        fout.imbue(*utf8_locale);
+        fout << "* results:" << endl;
+        do_all_external (dirs, fout);
+        wcout << L"Results saved into " << result_filename.c_str() << " file" << endl;
+        return;
+    };
+
+    Tree* tree=new Tree;
  
     wcout << L"starting with these directories:" << endl;
     wcout << set_to_string (dirs, L"\n");
 
     wcout << L"(Stage 1/3) Scanning file tree" << endl;
-    for (auto &dir : dirs)
-    {
-        Node* node=new Node(root, dir, L"", true);
-        node->collect_info();
-        root->children.insert (node);
-    };
+    Tree_scanner(*tree).run (dirs);
 
     // stage 1: remove all (file) nodes having unique file sizes
-    mark_nodes_having_unique_sizes (root);
+    mark_nodes_having_unique_sizes (*tree);
 
     wcout << L"(Stage 2/3) Computing partial filehashes" << endl;
 
     // stage 2: remove all file/directory nodes having unique partial hashes
-    mark_nodes_having_unique_partial_hashes (root);
+    mark_nodes_having_unique_partial_hashes (*tree);
 
     wcout << L"(Stage 3/3) Computing full filehashes" << endl;
 
     // stage 3: remove all file/directory nodes having unique full hashes
-    mark_nodes_with_unique_full_hashes (root);
+    mark_nodes_with_unique_full_hashes (*tree);
 
-    cut_children_for_non_unique_dirs (root);
+    cut_children_for_non_unique_dirs (*tree);
 
     map<FileSize, set<Result*>> results; // implicitly sorted map!
 
-    work_on_fuzzy_equal_dirs (root, results);
+    work_on_fuzzy_equal_dirs (*tree, results);
 
     map<FileSize, set<Node_group>> stage4; // size-sorted nodes
-    stage4=_add_all_nonunique_full_hashed_children (root);
-    add_exact_results (stage4, results);
+    stage4=_add_all_nonunique_full_hashed_children (*tree);
+    add_exact_results (*tree, stage4, results);
 
-    set_current_dir (dir_at_start);
-    
     wofstream fout;
     fout.open (result_filename, ios::out);
     fout.imbue(*utf8_locale);
@@ -700,16 +1130,26 @@ void do_all(set<wstring> dirs)
 void tests()
 {
     sha512_test();
+    fast_hash_test();
+    sha512_mb_test();
+    file_hash_test();
+#ifndef _WIN32
+    hash_db_test ("ddff_test.db");
+    hash_cache_test ("ddff_test.xattr");
+#endif
 
     try
     {
         wstring out1;
         FileSize out4;
+        Dir_handle cur_dir;
+
+        get_dir_handle (wstring(L".") + PATH_SEPARATOR, cur_dir);
 
-        //assert (SHA512_of_file (L"tst.mp3", out1)==true);
+        //assert (SHA512_of_file (cur_dir, L"tst.mp3", out1)==true);
         //assert (out1==L"3007efc65d0eb370731d770b222e4b7c89f02435085f0bc4ad20c0356fadf562227dffb80d3e1a7a38ef1acad3883504a80ae2f8e36471d87a3e8dfb7c2114c1");
 
-        get_file_size (L"10GB_empty_file", out4);
+        get_file_size (cur_dir, L"10GB_empty_file", out4);
         assert (out4==10737418240);
     }
     catch (bad_alloc& ba)
@@ -724,8 +1164,10 @@ void tests()
 
 int wmain(int argc, wchar_t** argv)
 {
+#ifdef _WIN32
     _setmode(_fileno(stdout), _O_U16TEXT);
     _setmode(_fileno(stderr), _O_U16TEXT);
+#endif
     locale::global(locale(""));
 
     //tests();
@@ -736,8 +1178,25 @@ int wmain(int argc, wchar_t** argv)
 
     if (argc==1)
     {
-       wcout << "Usage: ddff.exe <directory1> <directory2> ... " << endl;
+       wcout << "Usage: ddff.exe [options] <directory1> <directory2> ... " << endl;
        wcout << "For example: ddff.exe C:\\ D:\\ E:\\" << endl;
+       wcout << "Options:" << endl;
+       wcout << "    --direct-io   read files bypassing OS cache at stage 3 (Linux, where filesystem supports it)" << endl;
+       wcout << "    --hash=fast|sha512" << endl;
+       wcout << "                  hash of file contents: fast 128-bit non-cryptographic one (default) or SHA512" << endl;
+       wcout << "    --order=inode|extent|none" << endl;
+       wcout << "                  order of reading files from spinning disks (Linux): by inode number (default)," << endl;
+       wcout << "                  by physical position of the first extent (looked up once per file, several at once), or as is" << endl;
+       wcout << "    --max-memory=<MB>" << endl;
+       wcout << "                  out-of-core mode for trees not fitting into memory: file tree is kept in sorted runs" << endl;
+       wcout << "                  on scratch disk, and about that much memory is used. only files are compared then" << endl;
+       wcout << "    --scratch=<directory>" << endl;
+       wcout << "                  where out-of-core mode keeps its runs (current directory by default)" << endl;
+       wcout << "    --cache=none|xattr|db" << endl;
+       wcout << "                  where file hashes are kept between runs (Linux): nowhere (default), in extended" << endl;
+       wcout << "                  attributes of files (user.ddff.*, sets ctime of files hashed), or in database file" << endl;
+       wcout << "    --cache-db=<file>" << endl;
+       wcout << "                  database file of --cache=db (ddff_hashes.db in current directory by default)" << endl;
        return 0;
     }
     else 
@@ -746,13 +1205,56 @@ int wmain(int argc, wchar_t** argv)
         {
             wstring dir=wstring (argv[i+1]);
 
-            if (dir[dir.size()-1]!=L'\\')
-                dir+=wstring(L"\\");
+            if (dir==L"--direct-io")
+            {
+                options.direct_io=true;
+                continue;
+            };
+            if (dir==L"--hash=fast" || dir==L"--hash=sha512")
+            {
+                options.hash=dir==L"--hash=fast" ? Options::HASH_FAST : Options::HASH_SHA512;
+                continue;
+            };
+            if (dir==L"--order=none" || dir==L"--order=inode" || dir==L"--order=extent")
+            {
+                options.order=dir==L"--order=none" ? Options::ORDER_NONE : dir==L"--order=inode" ? Options::ORDER_INODE : Options::ORDER_EXTENT;
+                continue;
+            };
+            if (dir.compare (0, 13, L"--max-memory=")==0)
+            {
+                options.max_memory=(size_t)wcstoul (dir.c_str()+13, NULL, 10)*1024*1024;
+                continue;
+            };
+            if (dir==L"--cache=none" || dir==L"--cache=xattr" || dir==L"--cache=db")
+            {
+                options.cache=dir==L"--cache=none" ? Options::CACHE_NONE : dir==L"--cache=xattr" ? Options::CACHE_XATTR : Options::CACHE_DB;
+                continue;
+            };
+            if (dir.compare (0, 11, L"--cache-db=")==0)
+            {
+                options.cache_db=dir.substr (11);
+                continue;
+            };
+            if (dir.compare (0, 10, L"--scratch=")==0)
+            {
+                options.scratch_dir=dir.substr (10);
+                if (options.scratch_dir.empty() || options.scratch_dir[options.scratch_dir.size()-1]!=PATH_SEPARATOR)
+                    options.scratch_dir+=PATH_SEPARATOR;
+                continue;
+            };
+
+            if (dir[dir.size()-1]!=PATH_SEPARATOR)
+                dir+=PATH_SEPARATOR;
 
             dirs.insert (dir);
         };
     };
 
+#ifndef _WIN32
+    if (hash_cache_open()==false)
+        wcerr << L"Hashes will not be cached by this run" << endl;
+#endif
+
     try
     {
         do_all(dirs);
@@ -766,7 +1268,25 @@ int wmain(int argc, wchar_t** argv)
         wcerr << "exception: " << s.what() << endl;
     };
 
+#ifndef _WIN32
+    hash_cache_close();
+#endif
     return 0;
 };
 
+#ifndef _WIN32
+int main(int argc, char** argv)
+{
+    vector<wstring> wargs;
+    vector<wchar_t*> wargv;
+
+    for (int i=0; i<argc; i++)
+        wargs.push_back (from_native (argv[i]));
+    for (auto &a : wargs)
+        wargv.push_back (&a[0]);
+
+    return wmain (argc, &wargv[0]);
+};
+#endif
+
 /* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,994 @@
+// Out-of-core mode, see external.hpp.
+// Memory given by --max-memory is divided between these: half for records of stage 1 (one run),
+// then a quarter for read buffers of runs being merged, and 1/8 for a batch of size groups being hashed
+// (names are made only for files each stage reads). Size group which doesn't fit into batch is split
+// by digests out of memory (see Ext_splitter): pieces of 1/16 and read buffers of 1/8 for each level.
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/utility.hpp>
+
+#include "utils.hpp"
+#include "external.hpp"
+
+using namespace std;
+
+#define RUN_READ_BUFSIZE_MIN (64*1024)
+#define RUN_READ_BUFSIZE_MAX (1024*1024)
+
+// one file found in stage 1
+struct Ext_file
+{
+    FileSize size;
+    uint64_t dev; // 0 if file has only one name (then there is nothing to collapse)
+    uint64_t inode;
+    uint64_t dir; // offset of directory name in scratch file of directories
+    Name name;
+
+    size_t memory() const { return sizeof(Ext_file) + name.size()*sizeof(Name::value_type); };
+};
+
+// order of runs and of merge: the largest files first, so results come out ordered as in ordinary mode.
+// names of one physical file are neighbours, files of spinning disk go in inode order
+static bool ext_file_less (const Ext_file & a, const Ext_file & b)
+{
+    if (a.size!=b.size)
+        return a.size>b.size;
+    if (a.dev!=b.dev)
+        return a.dev<b.dev;
+    return a.inode<b.inode;
+};
+
+static FILE* open_file (const wstring & name, const char* mode)
+{
+#ifdef _WIN32
+    wstring wmode (mode, mode+strlen (mode));
+    return _wfopen (name.c_str(), wmode.c_str());
+#else
+    return fopen (to_native (name).c_str(), mode);
+#endif
+};
+
+static bool seek_file (FILE* f, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64 (f, offset, SEEK_SET)==0;
+#else
+    return fseeko (f, offset, SEEK_SET)==0;
+#endif
+};
+
+static void write_bytes (FILE* f, const void* buf, size_t len)
+{
+    if (len>0 && fwrite (buf, 1, len, f)!=len)
+        throw runtime_error ("can't write to scratch file (is disk full?)");
+};
+
+// false at the end of file
+static bool read_bytes (FILE* f, void* buf, size_t len)
+{
+    size_t got=fread (buf, 1, len, f);
+    if (got==len)
+        return true;
+    if (got==0 && feof (f))
+        return false;
+    throw runtime_error ("can't read from scratch file");
+};
+
+// scratch files of one run of the program, removed when it's done (or failed)
+class Scratch : boost::noncopyable
+{
+    private:
+        wstring prefix;
+        vector<wstring> names;
+
+    public:
+        Scratch()
+        {
+            prefix=options.scratch_dir + wstrfmt (L"ddff_%u_", (unsigned)getpid());
+        };
+
+        ~Scratch()
+        {
+            for (auto &n : names)
+#ifdef _WIN32
+                _wremove (n.c_str());
+#else
+                remove (to_native (n).c_str());
+#endif
+        };
+
+        // returns index of new file, which is open for writing
+        size_t create (FILE* & out)
+        {
+            wstring name=prefix + wstrfmt (L"%u", (unsigned)names.size());
+            out=open_file (name, "wb");
+            if (out==NULL)
+            {
+                wcerr << WFUNCTION << L"() can't create scratch file " << name << endl;
+                throw runtime_error ("can't create scratch file");
+            };
+            names.push_back (name);
+            return names.size()-1;
+        };
+
+        FILE* open_for_reading (size_t i)
+        {
+            FILE* f=open_file (names[i], "rb");
+            if (f==NULL)
+            {
+                wcerr << WFUNCTION << L"() can't open scratch file " << names[i] << endl;
+                throw runtime_error ("can't open scratch file");
+            };
+            return f;
+        };
+};
+
+static void write_file_record (FILE* f, const Ext_file & file)
+{
+    uint64_t head[4]={ file.size, file.dev, file.inode, file.dir };
+    uint32_t len=file.name.size();
+    write_bytes (f, head, sizeof(head));
+    write_bytes (f, &len, sizeof(len));
+    write_bytes (f, file.name.data(), len*sizeof(Name::value_type));
+};
+
+static bool read_file_record (FILE* f, Ext_file & file)
+{
+    uint64_t head[4];
+    uint32_t len;
+    if (read_bytes (f, head, sizeof(head))==false)
+        return false;
+    if (read_bytes (f, &len, sizeof(len))==false)
+        throw runtime_error ("scratch file is truncated");
+    file.size=head[0];
+    file.dev=head[1];
+    file.inode=head[2];
+    file.dir=head[3];
+    file.name.resize (len);
+    if (len>0 && read_bytes (f, &file.name[0], len*sizeof(Name::value_type))==false)
+        throw runtime_error ("scratch file is truncated");
+    return true;
+};
+
+// stage 1: directories are walked depth first, so there are not many of them waiting.
+// names of directories having files are written to scratch file as they come,
+// file records are collected up to the memory limit and then spilled as a sorted run
+class Ext_scanner : boost::noncopyable
+{
+    private:
+        Scratch & scratch;
+        size_t run_memory;
+        vector<Ext_file> files;
+        size_t files_memory;
+        FILE* dirs;
+        uint64_t dirs_size;
+
+        void spill()
+        {
+            if (files.empty())
+                return;
+
+            sort (files.begin(), files.end(), ext_file_less);
+            FILE* f;
+            runs.push_back (scratch.create (f));
+            for (auto &file : files)
+                write_file_record (f, file);
+            if (fclose (f)!=0)
+                throw runtime_error ("can't write to scratch file (is disk full?)");
+
+            files.clear();
+            files_memory=0;
+        };
+
+        uint64_t add_dir (const wstring & path)
+        {
+            uint64_t rt=dirs_size;
+            Name name=to_name (path);
+            uint32_t len=name.size();
+            write_bytes (dirs, &len, sizeof(len));
+            write_bytes (dirs, name.data(), len*sizeof(Name::value_type));
+            dirs_size+=sizeof(len) + len*sizeof(Name::value_type);
+            return rt;
+        };
+
+        void scan_dir (const wstring & path, vector<wstring> & pending)
+        {
+            Dir_handle h;
+            if (open_dir (path, h)==false)
+                return;
+
+            // entries are taken only if the whole directory was read, as in ordinary mode
+            vector<Dir_entry> entries;
+            bool ok=enumerate_dir (h, [&](const Dir_entry & e) { entries.push_back (e); });
+            if (ok)
+            {
+                uint64_t dir=0, dev=0;
+                bool dir_added=false, dev_known=false;
+
+                for (auto &e : entries)
+                {
+                    if (e.is_dir)
+                    {
+                        pending.push_back (path + e.name + PATH_SEPARATOR);
+                        continue;
+                    };
+
+                    if (dir_added==false)
+                    {
+                        dir=add_dir (path);
+                        dir_added=true;
+                    };
+
+                    Ext_file f;
+                    f.size=e.size;
+                    f.dev=0;
+                    if (e.links>1 && (dev_known || (dev_known=get_dir_device (h, dev))))
+                        f.dev=dev;
+                    f.inode=e.inode;
+                    f.dir=dir;
+                    f.name=to_name (e.name);
+                    files_memory+=f.memory();
+                    files.push_back (f);
+                    files_total++;
+                    if (files_memory>=run_memory)
+                        spill();
+                };
+            };
+            close_dir (h);
+        };
+
+    public:
+        vector<size_t> runs; // scratch file indices
+        size_t dirs_file; // scratch file index
+        uint64_t files_total;
+
+        Ext_scanner (Scratch & scratch, size_t run_memory) : scratch(scratch), run_memory(run_memory)
+        {
+            files_memory=0;
+            dirs_size=0;
+            files_total=0;
+            dirs_file=scratch.create (dirs);
+        };
+
+        void run (const set<wstring> & roots)
+        {
+            // in reverse order, so the first one is scanned first
+            vector<wstring> pending (roots.rbegin(), roots.rend());
+            while (pending.empty()==false)
+            {
+                wstring path=pending.back();
+                pending.pop_back();
+                size_t first_new=pending.size();
+                scan_dir (path, pending);
+                reverse (pending.begin()+first_new, pending.end()); // subdirectories in order they were listed
+            };
+            spill();
+
+            if (fclose (dirs)!=0)
+                throw runtime_error ("can't write to scratch file (is disk full?)");
+        };
+};
+
+// record of oversized size group, with digest it's grouped by (see Ext_splitter)
+struct Ext_keyed_file
+{
+    Digest key;
+    Ext_file file;
+};
+
+// names of one physical file stay neighbours
+static bool keyed_file_less (const Ext_keyed_file & a, const Ext_keyed_file & b)
+{
+    if (a.key!=b.key)
+        return a.key<b.key;
+    return ext_file_less (a.file, b.file);
+};
+
+static void write_keyed_record (FILE* f, const Ext_keyed_file & r)
+{
+    write_bytes (f, r.key.bytes, DIGEST_SIZE);
+    write_file_record (f, r.file);
+};
+
+static bool read_record (FILE* f, Ext_file & r)
+{
+    return read_file_record (f, r);
+};
+
+static bool read_record (FILE* f, Ext_keyed_file & r)
+{
+    if (read_bytes (f, r.key.bytes, DIGEST_SIZE)==false)
+        return false;
+    if (read_file_record (f, r.file)==false)
+        throw runtime_error ("scratch file is truncated");
+    return true;
+};
+
+static bool record_less (const Ext_file & a, const Ext_file & b)
+{
+    return ext_file_less (a, b);
+};
+
+static bool record_less (const Ext_keyed_file & a, const Ext_keyed_file & b)
+{
+    return keyed_file_less (a, b);
+};
+
+// names of the same physical file (of hard links)
+static bool same_physical (const Ext_file & a, const Ext_file & b)
+{
+    return a.dev!=0 && b.dev==a.dev && b.inode==a.inode && b.size==a.size;
+};
+
+template <typename R> class Run_reader : boost::noncopyable
+{
+    private:
+        FILE* f;
+        vector<char> buf;
+
+    public:
+        R cur; // valid while next() returns true
+
+        Run_reader (FILE* f, size_t bufsize) : f(f), buf(bufsize)
+        {
+            setvbuf (f, &buf[0], _IOFBF, bufsize);
+        };
+
+        ~Run_reader()
+        {
+            fclose (f);
+        };
+
+        bool next()
+        {
+            return read_record (f, cur);
+        };
+};
+
+// k-way merge of sorted runs, by record_less()
+template <typename R> class Run_merger : boost::noncopyable
+{
+    private:
+        vector<unique_ptr<Run_reader<R>>> runs;
+
+        struct Greater
+        {
+            const vector<unique_ptr<Run_reader<R>>> & runs;
+            Greater (const vector<unique_ptr<Run_reader<R>>> & runs) : runs(runs) {};
+            bool operator() (size_t a, size_t b) const { return record_less (runs[b]->cur, runs[a]->cur); };
+        };
+        priority_queue<size_t, vector<size_t>, Greater> heap;
+
+    public:
+        Run_merger (Scratch & scratch, const vector<size_t> & files, size_t memory) : heap (Greater (runs))
+        {
+            size_t bufsize=files.empty() ? 0 : memory/files.size();
+            bufsize=min (max (bufsize, (size_t)RUN_READ_BUFSIZE_MIN), (size_t)RUN_READ_BUFSIZE_MAX);
+
+            for (auto &i : files)
+            {
+                runs.push_back (unique_ptr<Run_reader<R>>(new Run_reader<R> (scratch.open_for_reading (i), bufsize)));
+                if (runs.back()->next())
+                    heap.push (runs.size()-1);
+            };
+        };
+
+        bool next (R & out)
+        {
+            if (heap.empty())
+                return false;
+            size_t i=heap.top();
+            heap.pop();
+            out=runs[i]->cur;
+            if (runs[i]->next())
+                heap.push (i);
+            return true;
+        };
+};
+
+// names of files being hashed. directory names are read back once per batch (or piece of oversized group),
+// names of files are made only for files read by each stage, full names only for hard links and results
+class Ext_names : boost::noncopyable
+{
+    private:
+        FILE* dirs;
+        map<uint64_t, wstring> dir_names;
+
+    public:
+        Ext_names (FILE* dirs) : dirs(dirs) {};
+
+        // stays where it is until clear()
+        const wstring & dir (uint64_t offset)
+        {
+            auto d=dir_names.find (offset);
+            if (d!=dir_names.end())
+                return d->second;
+
+            uint32_t len;
+            if (seek_file (dirs, offset)==false || read_bytes (dirs, &len, sizeof(len))==false)
+                throw runtime_error ("can't read from scratch file");
+            Name name (len, 0);
+            if (len>0 && read_bytes (dirs, &name[0], len*sizeof(Name::value_type))==false)
+                throw runtime_error ("scratch file is truncated");
+            return dir_names.insert (make_pair (offset, from_name (name.data(), name.size()))).first->second;
+        };
+
+        static wstring name (const Ext_file & f)
+        {
+            return from_name (f.name.data(), f.name.size());
+        };
+
+        wstring full (const Ext_file & f)
+        {
+            return dir (f.dir) + name (f);
+        };
+
+        void clear()
+        {
+            dir_names.clear();
+        };
+
+        // files[to_read[j]] is job j. file_names are names of jobs, which must stay there while jobs are used
+        vector<Hash_job> jobs (const vector<Ext_file> & files, const vector<size_t> & to_read, vector<wstring> & file_names)
+        {
+            vector<Hash_job> rt (to_read.size());
+            file_names.resize (to_read.size());
+            for (size_t j=0; j<to_read.size(); j++)
+            {
+                const Ext_file & f=files[to_read[j]];
+                file_names[j]=name (f);
+                rt[j].dir_name=&dir (f.dir);
+                rt[j].file_name=&file_names[j];
+                rt[j].size=f.size;
+                rt[j].inode=f.inode;
+            };
+            return rt;
+        };
+};
+
+// hard links: only the first name (in path order) of physical file is read, others are reported along with it
+static vector<size_t> primaries (const vector<Ext_file> & files, Ext_names & names)
+{
+    vector<size_t> rt (files.size());
+    size_t last;
+    for (size_t first=0; first<files.size(); first=last)
+    {
+        for (last=first+1; last<files.size() && same_physical (files[first], files[last]); last++)
+            ;
+        size_t p=first;
+        if (last-first>1)
+        {
+            wstring p_name=names.full (files[p]);
+            for (size_t i=first+1; i<last; i++)
+            {
+                wstring n=names.full (files[i]);
+                if (n<p_name)
+                {
+                    p=i;
+                    p_name=n;
+                };
+            };
+        };
+        for (size_t i=first; i<last; i++)
+            rt[i]=p;
+    };
+    return rt;
+};
+
+// physical file as it's reported: its first name, then other ones
+static wstring report_name (const vector<Ext_file> & files, const vector<size_t> & primary, size_t p, Ext_names & names)
+{
+    // other names are neighbours of the first one
+    set<wstring> links;
+    for (size_t i=p; i>0 && primary[i-1]==p; i--)
+        links.insert (names.full (files[i-1]));
+    for (size_t i=p+1; i<files.size() && primary[i]==p; i++)
+        links.insert (names.full (files[i]));
+    wstring rt=names.full (files[p]);
+    for (auto &l : links)
+        rt=rt + L"\n    (hard link) " + l;
+    return rt;
+};
+
+// size groups which are hashed together, so batch hashing functions have enough files to overlap I/O
+class Ext_batch : boost::noncopyable
+{
+    private:
+        Ext_names & names;
+        wostream & results;
+        vector<Digest> known; // digests files of oversized groups come with (see Ext_splitter)
+        vector<uint8_t> known_level; // 0 if there is none
+
+        // [first, last) ranges of files, having the same size, in order they are
+        vector<pair<size_t, size_t>> size_groups()
+        {
+            vector<pair<size_t, size_t>> rt;
+            size_t last;
+            for (size_t first=0; first<files.size(); first=last)
+            {
+                for (last=first+1; last<files.size() && files[last].size==files[first].size; last++)
+                    ;
+                rt.push_back (make_pair (first, last));
+            };
+            return rt;
+        };
+
+        // files of group which are read (the first names of physical files), grouped by digest.
+        // in each group of equal digests, survivors are passed to f(). files without digest are dropped
+        template <typename F> void for_each_equal (const vector<size_t> & group, const vector<Digest> & digests,
+                const vector<uint8_t> & ok, F f)
+        {
+            vector<pair<Digest, size_t>> keyed;
+            for (auto &i : group)
+                if (ok[i])
+                    keyed.push_back (make_pair (digests[i], i));
+            sort (keyed.begin(), keyed.end());
+
+            size_t last;
+            for (size_t first=0; first<keyed.size(); first=last)
+            {
+                for (last=first+1; last<keyed.size() && keyed[last].first==keyed[first].first; last++)
+                    ;
+                if (last-first<2)
+                    continue;
+                vector<size_t> equal;
+                for (size_t i=first; i<last; i++)
+                    equal.push_back (keyed[i].second);
+                f (equal);
+            };
+        };
+
+    public:
+        vector<Ext_file> files;
+        size_t memory;
+
+        Ext_batch (Ext_names & names, wostream & results) : names(names), results(results)
+        {
+            memory=0;
+        };
+
+        // partial digest of level 1 or 2 may be known already
+        void add (const Ext_file & f, int level=0, const Digest & d=Digest())
+        {
+            memory+=f.memory();
+            files.push_back (f);
+            known.push_back (d);
+            known_level.push_back (level);
+        };
+
+        void run()
+        {
+            vector<size_t> primary=primaries (files, names);
+
+            // groups of files to read. if all names of a size group are of one file, there is nothing to compare
+            vector<vector<size_t>> groups;
+            for (auto &g : size_groups())
+            {
+                vector<size_t> group;
+                for (size_t i=g.first; i<g.second; i++)
+                    if (primary[i]==i)
+                        group.push_back (i);
+                if (group.size()>1)
+                    groups.push_back (group);
+            };
+
+            vector<Digest> partial (files.size()), full (files.size());
+            vector<uint8_t> partial_ok (files.size(), 0), full_ok (files.size(), 0);
+
+            // stage 2
+            vector<size_t> to_read;
+            for (auto &g : groups)
+                for (auto &i : g)
+                    if (known_level[i]==0)
+                        to_read.push_back (i);
+                    else
+                    {
+                        partial[i]=known[i];
+                        partial_ok[i]=1;
+                    };
+            partial_hash (to_read, partial, partial_ok, 1);
+
+            // groups of big files which are not split by partial hash are sampled again at more places
+            // (see partial_hash_samples()), level 1 digests of them are replaced
+            vector<vector<size_t>> groups2, groups3, job_groups;
+            for (auto &g : groups)
+                for_each_equal (g, partial, partial_ok, [&](const vector<size_t> & equal) { groups2.push_back (equal); });
+            to_read.clear();
+            for (auto &g : groups2)
+                if (files[g[0]].size>=PARTIAL_SAMPLED_MIN)
+                    for (auto &i : g)
+                        if (known_level[i]<2)
+                        {
+                            to_read.push_back (i);
+                            partial_ok[i]=0;
+                        };
+            partial_hash (to_read, partial, partial_ok, 2);
+
+            // stage 3: groups are split by partial hash, and compared in lockstep
+            for (auto &g : groups2)
+                if (files[g[0]].size<PARTIAL_SAMPLED_MIN)
+                    groups3.push_back (g);
+                else
+                    for_each_equal (g, partial, partial_ok, [&](const vector<size_t> & equal) { groups3.push_back (equal); });
+            to_read.clear();
+            for (auto &g : groups3)
+            {
+                job_groups.push_back (vector<size_t>());
+                for (auto &i : g)
+                {
+                    job_groups.back().push_back (to_read.size());
+                    to_read.push_back (i);
+                };
+            };
+            vector<wstring> file_names;
+            // may be called from several threads at once, but each one writes to its own element
+            compare_files (names.jobs (files, to_read, file_names), job_groups, [&](size_t job, bool job_ok, const Digest & d)
+            {
+                if (job_ok)
+                {
+                    full[to_read[job]]=d;
+                    full_ok[to_read[job]]=1;
+                };
+            },
+            [&](size_t) { return true; }); // files unlike any other are not reported
+
+            for (auto &g : groups3)
+                for_each_equal (g, full, full_ok, [&](const vector<size_t> & equal)
+                {
+                    set<wstring> equal_files;
+                    for (auto &p : equal)
+                        equal_files.insert (report_name (files, primary, p, names));
+
+                    results << L"* equal files (size " << size_to_string (files[equal[0]].size) << ")" << endl;
+                    for (auto &name : equal_files)
+                        results << name << endl;
+                    results << endl;
+                });
+
+            files.clear();
+            known.clear();
+            known_level.clear();
+            memory=0;
+            names.clear();
+        };
+
+        void partial_hash (const vector<size_t> & to_read, vector<Digest> & digests, vector<uint8_t> & ok, int level)
+        {
+            if (to_read.empty())
+                return;
+            vector<wstring> file_names;
+            // may be called from several threads at once, but each one writes to its own element
+            partial_SHA512_of_files (names.jobs (files, to_read, file_names), [&](size_t job, bool job_ok, const Digest & d)
+            {
+                if (job_ok)
+                {
+                    digests[to_read[job]]=d;
+                    ok[to_read[job]]=1;
+                };
+            }, level);
+        };
+};
+
+#define EXT_FULL 3 // level of Ext_splitter after partial ones (1 and 2)
+
+// Size group which doesn't fit into batch is written out, and split out of memory: its files are hashed
+// a piece at a time, records keyed by digest go to a sorted run per piece, and runs are merged, so files
+// with equal digests come together. groups of equal partial digest which fit go to batch with it,
+// the others are split again by the next digest (level 2, then full). files of equal full digest
+// are written to results as they come.
+class Ext_splitter : boost::noncopyable
+{
+    private:
+        Scratch & scratch;
+        Ext_names & names;
+        Ext_batch & batch;
+        wostream & results;
+        size_t memory;
+
+        static int next_level (int level, FileSize size)
+        {
+            return level==1 && size>=PARTIAL_SAMPLED_MIN ? 2 : EXT_FULL;
+        };
+
+        // digests of all names of piece: physical file is read once (by its first name),
+        // its other names get the same digest
+        void hash_piece (const vector<Ext_file> & piece, int level, vector<Digest> & digests, vector<uint8_t> & ok)
+        {
+            vector<size_t> primary=primaries (piece, names);
+            vector<size_t> to_read;
+            for (size_t i=0; i<piece.size(); i++)
+                if (primary[i]==i)
+                    to_read.push_back (i);
+
+            digests.assign (piece.size(), Digest());
+            ok.assign (piece.size(), 0);
+            vector<wstring> file_names;
+            vector<Hash_job> jobs=names.jobs (piece, to_read, file_names);
+            // may be called from several threads at once, but each one writes to its own element
+            auto done=[&](size_t job, bool job_ok, const Digest & d)
+            {
+                if (job_ok)
+                {
+                    digests[to_read[job]]=d;
+                    ok[to_read[job]]=1;
+                };
+            };
+            if (level==EXT_FULL)
+                SHA512_of_files (jobs, done);
+            else
+                partial_SHA512_of_files (jobs, done, level);
+            names.clear();
+
+            for (size_t i=0; i<piece.size(); i++)
+            {
+                digests[i]=digests[primary[i]];
+                ok[i]=ok[primary[i]];
+            };
+        };
+
+        // sorted runs of records of group file keyed by digest of level. files which can't be read are dropped
+        vector<size_t> make_runs (size_t group_file, int level)
+        {
+            vector<size_t> runs;
+            Run_reader<Ext_file> reader (scratch.open_for_reading (group_file), RUN_READ_BUFSIZE_MAX);
+            bool more=reader.next();
+            while (more)
+            {
+                // piece takes half of memory (keyed records are moved out of it), and it's not cut
+                // between names of one physical file
+                vector<Ext_file> piece;
+                size_t piece_memory=0;
+                while (more && (piece_memory<memory/2 || same_physical (piece.back(), reader.cur)))
+                {
+                    piece_memory+=reader.cur.memory();
+                    piece.push_back (reader.cur);
+                    more=reader.next();
+                };
+
+                vector<Digest> digests;
+                vector<uint8_t> ok;
+                hash_piece (piece, level, digests, ok);
+                vector<Ext_keyed_file> keyed;
+                for (size_t i=0; i<piece.size(); i++)
+                    if (ok[i])
+                    {
+                        keyed.push_back (Ext_keyed_file());
+                        keyed.back().key=digests[i];
+                        keyed.back().file=move (piece[i]);
+                    };
+                vector<Ext_file>().swap (piece);
+                sort (keyed.begin(), keyed.end(), keyed_file_less);
+
+                FILE* f;
+                runs.push_back (scratch.create (f));
+                for (auto &r : keyed)
+                    write_keyed_record (f, r);
+                if (fclose (f)!=0)
+                    throw runtime_error ("can't write to scratch file (is disk full?)");
+            };
+            return runs;
+        };
+
+        // equal group of full digests is written out as it comes, a physical file at a time,
+        // header goes before the first one when the second one is seen
+        struct Report
+        {
+            vector<Ext_file> first; // names of the first physical file, until the second one is seen
+            vector<Ext_file> file; // names of the last one
+            size_t physical; // with all its names seen
+        };
+
+        void report_file (const vector<Ext_file> & file)
+        {
+            vector<size_t> primary=primaries (file, names);
+            results << report_name (file, primary, primary[0], names) << endl;
+            names.clear();
+        };
+
+        void report_complete (Report & r)
+        {
+            if (++r.physical==1)
+            {
+                r.first.swap (r.file);
+                r.file.clear();
+                return;
+            };
+            if (r.physical==2)
+            {
+                results << L"* equal files (size " << size_to_string (r.first[0].size) << ")" << endl;
+                report_file (r.first);
+                r.first.clear();
+            };
+            report_file (r.file);
+            r.file.clear();
+        };
+
+        void report_add (Report & r, const Ext_file & f)
+        {
+            if (r.file.empty()==false && same_physical (r.file.back(), f)==false)
+                report_complete (r);
+            r.file.push_back (f);
+        };
+
+        void report_end (Report & r)
+        {
+            if (r.file.empty()==false)
+                report_complete (r);
+            if (r.physical>=2)
+                results << endl;
+            r.first.clear();
+            r.physical=0;
+        };
+
+    public:
+        Ext_splitter (Scratch & scratch, Ext_names & names, Ext_batch & batch, wostream & results, size_t memory)
+            : scratch(scratch), names(names), batch(batch), results(results), memory(memory) {};
+
+        // group file has records of one size, in order of ext_file_less()
+        void split (size_t group_file, int level)
+        {
+            vector<size_t> runs=make_runs (group_file, level);
+            Run_merger<Ext_keyed_file> merger (scratch, runs, memory);
+
+            // group of equal digests, in memory, or written out when it doesn't fit
+            bool in_group=false;
+            vector<Ext_file> equal;
+            size_t equal_memory=0, physical=0;
+            FILE* spill=NULL;
+            size_t spill_file=0;
+            Report report;
+            report.physical=0;
+
+            Ext_keyed_file r;
+            Ext_file prev;
+            Digest prev_key;
+            bool more=true;
+            while (more)
+            {
+                more=merger.next (r);
+                if (in_group && (more==false || r.key!=prev_key))
+                {
+                    if (level==EXT_FULL)
+                        report_end (report);
+                    else if (spill!=NULL)
+                    {
+                        for (auto &f : equal)
+                            write_file_record (spill, f);
+                        if (fclose (spill)!=0)
+                            throw runtime_error ("can't write to scratch file (is disk full?)");
+                        spill=NULL;
+                        if (physical>1)
+                            split (spill_file, next_level (level, prev.size));
+                    }
+                    else if (physical>1)
+                    {
+                        // group is not split between batches
+                        for (auto &f : equal)
+                            batch.add (f, level, prev_key);
+                        if (batch.memory>=memory)
+                            batch.run();
+                    };
+                    in_group=false;
+                    equal.clear();
+                    equal_memory=0;
+                    physical=0;
+                };
+                if (more==false)
+                    break;
+
+                if (level==EXT_FULL)
+                    report_add (report, r.file);
+                else
+                {
+                    if (in_group==false || same_physical (prev, r.file)==false)
+                        physical++;
+                    equal_memory+=r.file.memory();
+                    equal.push_back (r.file);
+                    if (equal_memory>=memory)
+                    {
+                        if (spill==NULL)
+                            spill_file=scratch.create (spill);
+                        for (auto &f : equal)
+                            write_file_record (spill, f);
+                        equal.clear();
+                        equal_memory=0;
+                    };
+                };
+                in_group=true;
+                prev=r.file;
+                prev_key=r.key;
+            };
+        };
+};
+
+void do_all_external (const set<wstring> & dirs, wostream & results)
+{
+    Scratch scratch;
+
+    wcout << L"(Stage 1/3) Scanning file tree, sorted runs go to " << options.scratch_dir << endl;
+    Ext_scanner scanner (scratch, options.max_memory/2);
+    scanner.run (dirs);
+
+    wcout << L"(Stage 2/3, 3/3) Merging " << scanner.files_total << L" files in " << scanner.runs.size() << L" runs, computing partial and full filehashes" << endl;
+    Run_merger<Ext_file> merger (scratch, scanner.runs, options.max_memory/4);
+    FILE* dir_names=scratch.open_for_reading (scanner.dirs_file);
+    Ext_names names (dir_names);
+    Ext_batch batch (names, results);
+    Ext_splitter splitter (scratch, names, batch, results, options.max_memory/8);
+
+    // files of the same size come one after another, groups of one file are dropped.
+    // group which doesn't fit into batch is written out, and split by Ext_splitter
+    vector<Ext_file> group;
+    size_t group_memory=0;
+    FileSize group_size=0;
+    FILE* spill=NULL;
+    size_t spill_file=0;
+    Ext_file f;
+    bool more=true;
+    while (more)
+    {
+        more=merger.next (f) && f.size>0; // empty files are the last ones, and they are not compared
+        if ((group.empty()==false || spill!=NULL) && (more==false || f.size!=group_size))
+        {
+            if (spill!=NULL)
+            {
+                for (auto &g : group)
+                    write_file_record (spill, g);
+                if (fclose (spill)!=0)
+                    throw runtime_error ("can't write to scratch file (is disk full?)");
+                spill=NULL;
+                if (batch.files.empty()==false)
+                    batch.run(); // splitter takes its memory
+                splitter.split (spill_file, 1);
+            }
+            else if (group.size()>1)
+                for (auto &g : group)
+                    batch.add (g);
+            group.clear();
+            group_memory=0;
+            if (batch.memory>=options.max_memory/8 || (more==false && batch.files.empty()==false))
+                batch.run();
+        };
+        if (more==false)
+            break;
+
+        group_size=f.size;
+        group_memory+=f.memory();
+        group.push_back (f);
+        if (group_memory>=options.max_memory/8)
+        {
+            if (spill==NULL)
+                spill_file=scratch.create (spill);
+            for (auto &g : group)
+                write_file_record (spill, g);
+            group.clear();
+            group_memory=0;
+        };
+    };
+
+    fclose (dir_names);
+};
+
+/* vim: set expandtab ts=4 sw=4 : */
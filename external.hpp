@@ -0,0 +1,20 @@
+#pragma once
+
+// Out-of-core mode (--max-memory), for trees which don't fit into memory.
+// Stage 1 doesn't build the tree: each file found becomes a (size, device, inode, directory, name) record,
+// records are sorted in memory-sized runs and spilled to scratch files, directory names go to a scratch
+// file of their own. Runs are merged by size (the largest first, as results are reported), and only a batch
+// of size groups is in memory at a time: its files get partial and then full hashes, and equal ones
+// are written to results right away. Size group which doesn't fit into a batch is split on disk as well:
+// by partial digests and then by full ones, each time in sorted runs which are merged.
+// Only files are compared in this mode, directories are not.
+
+#include <set>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+void do_all_external (const set<wstring> & dirs, wostream & results);
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,201 @@
+// Fast 128-bit non-cryptographic hash, see fast_hash.h
+
+#include <string.h>
+#include <assert.h>
+
+#include "fast_hash.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define KEY_WORDS 24 // stripe of block N uses words [N, N+8), scrambling uses [16, 24)
+
+// key words are pseudo-random, made by splitmix64 from fixed seed
+struct Fast_hash_key
+{
+    uint64_t w[KEY_WORDS];
+
+    Fast_hash_key()
+    {
+        uint64_t x=PRIME64_5;
+        for (int i=0; i<KEY_WORDS; i++)
+        {
+            uint64_t z=(x+=0x9E3779B97F4A7C15ULL);
+            z=(z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z=(z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            w[i]=z ^ (z >> 31);
+        };
+    };
+};
+
+static const Fast_hash_key key;
+
+static inline uint64_t load64 (const uint8_t* p)
+{
+    uint64_t rt;
+    memcpy (&rt, p, sizeof(rt)); // may be unaligned
+    return rt;
+};
+
+static inline void accumulate_stripe (uint64_t* acc, const uint8_t* p, const uint64_t* k)
+{
+    for (int i=0; i<8; i++)
+    {
+        uint64_t d=load64 (p+i*8);
+        uint64_t dk=d ^ k[i];
+        acc[i ^ 1]+=d; // so no data is lost when (d ^ k) has zero half
+        acc[i]+=(dk & 0xFFFFFFFF) * (dk >> 32);
+    };
+};
+
+static inline void scramble (uint64_t* acc)
+{
+    for (int i=0; i<8; i++)
+    {
+        uint64_t a=acc[i];
+        a^=a >> 47;
+        a^=key.w[16+i];
+        a*=PRIME32_1;
+        acc[i]=a;
+    };
+};
+
+static void process_block (uint64_t* acc, const uint8_t* p)
+{
+    for (int s=0; s<FAST_HASH_STRIPES_PER_BLOCK; s++)
+        accumulate_stripe (acc, p+s*FAST_HASH_STRIPE, key.w+s);
+    scramble (acc);
+};
+
+static uint64_t mul128_fold64 (uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r=(unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t lo_lo=(a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo=(a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi=(a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi=(a >> 32) * (b >> 32);
+    uint64_t cross=(lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper=(hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower=(cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+};
+
+static uint64_t avalanche (uint64_t h)
+{
+    h^=h >> 37;
+    h*=PRIME64_3;
+    h^=h >> 32;
+    return h;
+};
+
+static uint64_t merge_lanes (const uint64_t* acc, const uint64_t* k, uint64_t start)
+{
+    uint64_t rt=start;
+    for (int i=0; i<4; i++)
+        rt+=mul128_fold64 (acc[i*2] ^ k[i*2], acc[i*2+1] ^ k[i*2+1]);
+    return avalanche (rt);
+};
+
+void fast_hash_init_ctx (struct fast_hash_ctx *ctx)
+{
+    static const uint64_t init[8]={ PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+    memcpy (ctx->acc, init, sizeof(init));
+    ctx->total=0;
+    ctx->buflen=0;
+};
+
+void fast_hash_process_bytes (const void *buffer, size_t len, struct fast_hash_ctx *ctx)
+{
+    const uint8_t* p=(const uint8_t*)buffer;
+    ctx->total+=len;
+
+    if (ctx->buflen>0)
+    {
+        size_t n=FAST_HASH_BLOCK-ctx->buflen;
+        if (n>len)
+            n=len;
+        memcpy (ctx->buffer+ctx->buflen, p, n);
+        ctx->buflen+=n;
+        p+=n;
+        len-=n;
+        if (ctx->buflen<FAST_HASH_BLOCK)
+            return;
+        process_block (ctx->acc, ctx->buffer);
+        ctx->buflen=0;
+    };
+
+    for ( ; len>=FAST_HASH_BLOCK; p+=FAST_HASH_BLOCK, len-=FAST_HASH_BLOCK)
+        process_block (ctx->acc, p);
+
+    if (len>0)
+        memcpy (ctx->buffer, p, len);
+    ctx->buflen=len;
+};
+
+void fast_hash_finish_ctx (struct fast_hash_ctx *ctx, void *resbuf)
+{
+    // whole stripes of the rest go as usual, the last partial one is padded with zeros
+    // (total length goes to the result, so padding can't be confused with data)
+    size_t s=0;
+    for ( ; (s+1)*FAST_HASH_STRIPE<=ctx->buflen; s++)
+        accumulate_stripe (ctx->acc, ctx->buffer+s*FAST_HASH_STRIPE, key.w+s);
+    if (s*FAST_HASH_STRIPE<ctx->buflen)
+    {
+        uint8_t last[FAST_HASH_STRIPE]={0};
+        memcpy (last, ctx->buffer+s*FAST_HASH_STRIPE, ctx->buflen-s*FAST_HASH_STRIPE);
+        accumulate_stripe (ctx->acc, last, key.w+s);
+    };
+
+    uint64_t rt[2];
+    rt[0]=merge_lanes (ctx->acc, key.w+1, ctx->total*PRIME64_1);
+    rt[1]=merge_lanes (ctx->acc, key.w+12, ~(ctx->total*PRIME64_2));
+    memcpy (resbuf, rt, sizeof(rt));
+};
+
+// the same digest whatever pieces input comes in, and different digest for each length of zeros
+void fast_hash_test()
+{
+    static uint8_t buf[FAST_HASH_BLOCK*3+100];
+    for (size_t i=0; i<sizeof(buf); i++)
+        buf[i]=(uint8_t)(i*7+i/256);
+
+    struct fast_hash_ctx ctx;
+    uint8_t whole[FAST_HASH_DIGEST_SIZE], pieces[FAST_HASH_DIGEST_SIZE];
+
+    fast_hash_init_ctx (&ctx);
+    fast_hash_process_bytes (buf, sizeof(buf), &ctx);
+    fast_hash_finish_ctx (&ctx, whole);
+
+    size_t steps[]={ 1, 63, 64, 65, 1000, 1024, 3000 };
+    for (auto &step : steps)
+    {
+        fast_hash_init_ctx (&ctx);
+        for (size_t i=0; i<sizeof(buf); i+=step)
+            fast_hash_process_bytes (buf+i, i+step<=sizeof(buf) ? step : sizeof(buf)-i, &ctx);
+        fast_hash_finish_ctx (&ctx, pieces);
+        assert (memcmp (whole, pieces, sizeof(whole))==0);
+    };
+
+    uint8_t prev[FAST_HASH_DIGEST_SIZE];
+    memset (buf, 0, sizeof(buf));
+    for (size_t len=0; len<=FAST_HASH_BLOCK+1; len++)
+    {
+        fast_hash_init_ctx (&ctx);
+        fast_hash_process_bytes (buf, len, &ctx);
+        fast_hash_finish_ctx (&ctx, pieces);
+        assert (len==0 || memcmp (prev, pieces, sizeof(prev))!=0);
+        memcpy (prev, pieces, sizeof(prev));
+    };
+};
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,33 @@
+#pragma once
+
+// Fast 128-bit non-cryptographic hash, for telling files apart (not for use against an adversary).
+// It's built like XXH3: input goes in 64-byte stripes into 8 independent 64-bit lanes, and each lane
+// does one 32x32->64 multiplication per 8 bytes, so the lane loop is vectorized by compiler (SSE2, AVX2, NEON).
+// Lanes are scrambled after each 1 KiB block and folded with 64x64->128 multiplications at the end.
+// It's not compatible with xxHash (or anything else): its digests are compared only to its own digests.
+// Words are read in native byte order, so digests of little and big endian machines differ.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FAST_HASH_STRIPE 64
+#define FAST_HASH_STRIPES_PER_BLOCK 16
+#define FAST_HASH_BLOCK (FAST_HASH_STRIPE*FAST_HASH_STRIPES_PER_BLOCK)
+#define FAST_HASH_DIGEST_SIZE 16
+
+struct fast_hash_ctx
+{
+    uint64_t acc[8];
+    uint64_t total; // bytes processed
+    size_t buflen;
+    uint8_t buffer[FAST_HASH_BLOCK]; // the rest of input, less than one block
+};
+
+void fast_hash_init_ctx (struct fast_hash_ctx *ctx);
+// LEN may be anything
+void fast_hash_process_bytes (const void *buffer, size_t len, struct fast_hash_ctx *ctx);
+void fast_hash_finish_ctx (struct fast_hash_ctx *ctx, void *resbuf); // FAST_HASH_DIGEST_SIZE bytes
+
+void fast_hash_test();
+
+/* vim: set expandtab ts=4 sw=4 : */
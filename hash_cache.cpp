@@ -0,0 +1,454 @@
+// Digests cached between runs, see hash_cache.hpp
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <wctype.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "hash_cache.hpp"
+#include "hash_engine.hpp"
+#include "hash_db.hpp"
+
+using namespace std;
+
+static Hash_db db; // of --cache=db
+
+static int64_t to_ns (const struct timespec & t)
+{
+    return (int64_t)t.tv_sec*1000000000LL + t.tv_nsec;
+};
+
+static bool same_file (const struct stat & a, const struct stat & b)
+{
+    return a.st_dev==b.st_dev && a.st_ino==b.st_ino && a.st_size==b.st_size &&
+        to_ns (a.st_mtim)==to_ns (b.st_mtim) && to_ns (a.st_ctim)==to_ns (b.st_ctim);
+};
+
+static Hash_db_key db_key (const struct stat & st, Hash_cache_kind kind)
+{
+    return Hash_db_key{ (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size, to_ns (st.st_mtim),
+        (uint32_t)kind << 8 | (uint32_t)options.hash };
+};
+
+// number of digests in checkpoint at offset: chunks, then leaves of the last chunk
+static size_t checkpoint_digests (FileSize offset)
+{
+    size_t leaves=(size_t)(offset/TREE_HASH_LEAF);
+    return leaves/TREE_HASH_LEAVES_PER_CHUNK + leaves%TREE_HASH_LEAVES_PER_CHUNK;
+};
+
+static void checkpoint_set_digests (File_hash_checkpoint & cp, const Digest* d)
+{
+    size_t leaves=(size_t)(cp.offset/TREE_HASH_LEAF);
+    cp.chunks.assign (d, d+leaves/TREE_HASH_LEAVES_PER_CHUNK);
+    cp.leaves.assign (d+cp.chunks.size(), d+cp.chunks.size()+leaves%TREE_HASH_LEAVES_PER_CHUNK);
+};
+
+// checkpoint in db is a few records of key with no size and mtime (file is not the same anyway):
+// part 0 is size of file and check of the others, part 1 is offset, part 2 is the last leaf,
+// then digests. parts of older checkpoint (or torn ones) don't match the check
+#define DB_CHECKPOINT_KIND 2
+
+static Hash_db_key db_checkpoint_key (const struct stat & st, size_t part)
+{
+    return Hash_db_key{ (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)part, 0,
+        (uint32_t)DB_CHECKPOINT_KIND << 8 | (uint32_t)options.hash };
+};
+
+static uint64_t db_checkpoint_check (const File_hash_checkpoint & cp)
+{
+    Hash_ctx ctx;
+    hash_init (&ctx);
+    hash_process_bytes (&ctx, &cp.size, sizeof(cp.size));
+    hash_process_bytes (&ctx, &cp.offset, sizeof(cp.offset));
+    hash_process_bytes (&ctx, &cp.last_leaf, sizeof(cp.last_leaf));
+    hash_process_bytes (&ctx, cp.chunks.data(), cp.chunks.size()*sizeof(Digest));
+    hash_process_bytes (&ctx, cp.leaves.data(), cp.leaves.size()*sizeof(Digest));
+    Digest d=hash_finish (&ctx);
+    uint64_t rt;
+    memcpy (&rt, d.bytes, sizeof(rt));
+    return rt;
+};
+
+static bool db_get_checkpoint (const struct stat & st, File_hash_checkpoint & out)
+{
+    Digest head, d;
+    uint64_t check;
+    if (db.get (db_checkpoint_key (st, 0), head)==false || db.get (db_checkpoint_key (st, 1), d)==false)
+        return false;
+    memcpy (&out.size, head.bytes, sizeof(out.size));
+    memcpy (&check, head.bytes+sizeof(out.size), sizeof(check));
+    memcpy (&out.offset, d.bytes, sizeof(out.offset));
+    if (out.size>=(FileSize)st.st_size || out.offset>out.size || db.get (db_checkpoint_key (st, 2), out.last_leaf)==false)
+        return false;
+
+    vector<Digest> digests (checkpoint_digests (out.offset));
+    for (size_t i=0; i<digests.size(); i++)
+        if (db.get (db_checkpoint_key (st, 3+i), digests[i])==false)
+            return false;
+    checkpoint_set_digests (out, digests.data());
+    return db_checkpoint_check (out)==check;
+};
+
+static void db_put_checkpoint (const struct stat & st, const File_hash_checkpoint & cp)
+{
+    Digest d;
+    memset (&d, 0, sizeof(d));
+    memcpy (d.bytes, &cp.offset, sizeof(cp.offset));
+    db.put (db_checkpoint_key (st, 1), d);
+    db.put (db_checkpoint_key (st, 2), cp.last_leaf);
+    size_t part=3;
+    for (const Digest & c : cp.chunks)
+        db.put (db_checkpoint_key (st, part++), c);
+    for (const Digest & l : cp.leaves)
+        db.put (db_checkpoint_key (st, part++), l);
+
+    uint64_t check=db_checkpoint_check (cp);
+    memcpy (d.bytes, &cp.size, sizeof(cp.size));
+    memcpy (d.bytes+sizeof(cp.size), &check, sizeof(check));
+    db.put (db_checkpoint_key (st, 0), d);
+};
+
+#ifdef __linux__
+
+#define XATTR_CACHE_MAGIC 0x33464444 // "DDF3"
+#define XATTR_CTIME_SLACK_NS 1000000000LL // see xattr_entry_valid()
+#define XATTR_CACHE_MAX 4096 // with checkpoint, larger ones (of files over ~16 GiB) don't fit xattr block of ext4 anyway
+#define XATTR_HAS_CHECKPOINT 4 // flags of entry, the others are 1 << Hash_cache_kind
+
+// value of xattr: what file it was, its digests, then its checkpoint if it has one
+struct Xattr_entry
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns; // as it was hashed
+    int64_t written_ns; // (coarse) clock just before entry was written
+    Digest digests[2]; // by Hash_cache_kind
+};
+
+// checkpoint after entry, digests follow it (see checkpoint_digests())
+struct Xattr_checkpoint
+{
+    uint64_t size;
+    uint64_t offset;
+    Digest last_leaf;
+};
+
+// all digests of file are in one xattr, which is written once by each put: each write sets ctime,
+// so entry written separately would make others invalid (see xattr_entry_valid())
+static string xattr_name()
+{
+    string rt="user.ddff.";
+    for (const wchar_t* p=hash_engine_name(); *p; p++)
+        rt.push_back ((char)towlower (*p));
+    return rt;
+};
+
+// writing of entry sets ctime of file, and that time isn't known before. so ctime must be either
+// the same as when file was hashed (filesystem which doesn't set it), or within a second after entry
+// was written. whatever is done to file later (even mtime set back by touch) sets ctime after that
+static bool xattr_entry_valid (const Xattr_entry & e, const struct stat & st)
+{
+    int64_t ctime=to_ns (st.st_ctim);
+    return e.inode==(uint64_t)st.st_ino && e.size==(uint64_t)st.st_size && e.mtime_ns==to_ns (st.st_mtim) &&
+        (ctime==e.ctime_ns || (ctime>=e.written_ns && ctime-e.written_ns<XATTR_CTIME_SLACK_NS));
+};
+
+// length of entry with checkpoint (if it has one), 0 if there is none (or it's not ours)
+static size_t xattr_read (int fd, uint8_t* buf)
+{
+    ssize_t len=fgetxattr (fd, xattr_name().c_str(), buf, XATTR_CACHE_MAX);
+    Xattr_entry e;
+    if (len<(ssize_t)sizeof(e))
+        return 0;
+    memcpy (&e, buf, sizeof(e));
+    if (e.magic!=XATTR_CACHE_MAGIC)
+        return 0;
+    if (e.flags & XATTR_HAS_CHECKPOINT)
+    {
+        Xattr_checkpoint c;
+        if (len<(ssize_t)(sizeof(e)+sizeof(c)))
+            return 0;
+        memcpy (&c, buf+sizeof(e), sizeof(c));
+        if (c.offset>c.size || (size_t)len!=sizeof(e)+sizeof(c)+checkpoint_digests (c.offset)*sizeof(Digest))
+            return 0;
+    }
+    else if (len!=(ssize_t)sizeof(e))
+        return 0;
+    return len;
+};
+
+static bool xattr_get (int fd, const struct stat & st, Hash_cache_kind kind, Digest & out)
+{
+    uint8_t buf[XATTR_CACHE_MAX];
+    Xattr_entry e;
+    if (xattr_read (fd, buf)==0)
+        return false;
+    memcpy (&e, buf, sizeof(e));
+    if ((e.flags & 1 << kind)==0 || xattr_entry_valid (e, st)==false)
+        return false;
+    out=e.digests[kind];
+    return true;
+};
+
+// it's taken only by file which has grown since, so its times are of no use
+static bool xattr_get_checkpoint (int fd, const struct stat & st, File_hash_checkpoint & out)
+{
+    uint8_t buf[XATTR_CACHE_MAX];
+    Xattr_entry e;
+    Xattr_checkpoint c;
+    if (xattr_read (fd, buf)==0)
+        return false;
+    memcpy (&e, buf, sizeof(e));
+    if ((e.flags & XATTR_HAS_CHECKPOINT)==0 || e.inode!=(uint64_t)st.st_ino)
+        return false;
+    memcpy (&c, buf+sizeof(e), sizeof(c));
+    if (c.size>=(uint64_t)st.st_size)
+        return false;
+
+    out.size=c.size;
+    out.offset=c.offset;
+    out.last_leaf=c.last_leaf;
+    vector<Digest> digests (checkpoint_digests (c.offset));
+    memcpy (digests.data(), buf+sizeof(e)+sizeof(c), digests.size()*sizeof(Digest));
+    checkpoint_set_digests (out, digests.data());
+    return true;
+};
+
+// digest of the other kind is kept if it's still valid, and checkpoint if file has not shrunk since
+static void xattr_put (int fd, const struct stat & st, Hash_cache_kind kind, const Digest & d, const File_hash_checkpoint* cp)
+{
+    uint8_t old_buf[XATTR_CACHE_MAX], buf[XATTR_CACHE_MAX];
+    size_t old_len=xattr_read (fd, old_buf);
+    Xattr_entry old;
+    if (old_len>0)
+        memcpy (&old, old_buf, sizeof(old));
+
+    struct timespec t;
+    clock_gettime (CLOCK_REALTIME_COARSE, &t); // the same clock file times are taken from
+
+    Xattr_entry e;
+    memset (&e, 0, sizeof(e));
+    e.magic=XATTR_CACHE_MAGIC;
+    e.inode=st.st_ino;
+    e.size=st.st_size;
+    e.mtime_ns=to_ns (st.st_mtim);
+    e.ctime_ns=to_ns (st.st_ctim);
+    e.written_ns=to_ns (t);
+    if (old_len>0 && xattr_entry_valid (old, st))
+    {
+        e.flags=old.flags & ~XATTR_HAS_CHECKPOINT;
+        memcpy (e.digests, old.digests, sizeof(e.digests));
+    };
+    e.flags|=1 << kind;
+    e.digests[kind]=d;
+
+    size_t len=sizeof(e);
+    Xattr_checkpoint c;
+    if (cp!=NULL && len+sizeof(c)+(cp->chunks.size()+cp->leaves.size())*sizeof(Digest)<=XATTR_CACHE_MAX)
+    {
+        c.size=cp->size;
+        c.offset=cp->offset;
+        c.last_leaf=cp->last_leaf;
+        memcpy (buf+len, &c, sizeof(c));
+        len+=sizeof(c);
+        if (cp->chunks.empty()==false)
+            memcpy (buf+len, cp->chunks.data(), cp->chunks.size()*sizeof(Digest));
+        len+=cp->chunks.size()*sizeof(Digest);
+        if (cp->leaves.empty()==false)
+            memcpy (buf+len, cp->leaves.data(), cp->leaves.size()*sizeof(Digest));
+        len+=cp->leaves.size()*sizeof(Digest);
+        e.flags|=XATTR_HAS_CHECKPOINT;
+    }
+    else if (cp==NULL && old_len>0 && (old.flags & XATTR_HAS_CHECKPOINT) && old.inode==(uint64_t)st.st_ino)
+    {
+        memcpy (&c, old_buf+sizeof(old), sizeof(c));
+        if (c.size<=(uint64_t)st.st_size)
+        {
+            memcpy (buf+len, old_buf+sizeof(old), old_len-sizeof(old));
+            len=old_len;
+            e.flags|=XATTR_HAS_CHECKPOINT;
+        };
+    };
+    memcpy (buf, &e, sizeof(e));
+
+    // no permission, read-only filesystem, no user xattrs there: it's just not cached
+    fsetxattr (fd, xattr_name().c_str(), buf, len, 0);
+};
+
+#else
+
+static bool xattr_get (int fd, const struct stat & st, Hash_cache_kind kind, Digest & out)
+{
+    return false;
+};
+
+static bool xattr_get_checkpoint (int fd, const struct stat & st, File_hash_checkpoint & out)
+{
+    return false;
+};
+
+static void xattr_put (int fd, const struct stat & st, Hash_cache_kind kind, const Digest & d, const File_hash_checkpoint* cp)
+{
+};
+
+#endif
+
+bool hash_cache_open()
+{
+    if (options.cache!=Options::CACHE_DB || db.open (to_native (options.cache_db)))
+        return true;
+    options.cache=Options::CACHE_NONE;
+    return false;
+};
+
+void hash_cache_close()
+{
+    db.close();
+};
+
+bool hash_cache_get (int fd, const struct stat & st, Hash_cache_kind kind, Digest & out)
+{
+    switch (options.cache)
+    {
+        case Options::CACHE_XATTR:
+            return xattr_get (fd, st, kind, out);
+        case Options::CACHE_DB:
+            return db.get (db_key (st, kind), out);
+        default:
+            return false;
+    };
+};
+
+bool hash_cache_get_checkpoint (int fd, const struct stat & st, File_hash_checkpoint & out)
+{
+    bool rt;
+    switch (options.cache)
+    {
+        case Options::CACHE_XATTR:
+            rt=xattr_get_checkpoint (fd, st, out);
+            break;
+        case Options::CACHE_DB:
+            rt=db_get_checkpoint (st, out);
+            break;
+        default:
+            return false;
+    };
+    return rt && file_hash_checkpoint_fits (st.st_size, out);
+};
+
+void hash_cache_put (int fd, const struct stat & st, Hash_cache_kind kind, const Digest & d, const File_hash_checkpoint* cp)
+{
+    if (options.cache==Options::CACHE_NONE)
+        return;
+
+    struct stat now;
+    if (fstat (fd, &now)!=0 || same_file (st, now)==false)
+        return; // changed while it was hashed
+
+    if (options.cache==Options::CACHE_XATTR)
+        xattr_put (fd, st, kind, d, cp);
+    else
+    {
+        if (cp!=NULL)
+            db_put_checkpoint (st, *cp);
+        db.put (db_key (st, kind), d);
+    };
+};
+
+void hash_cache_put (const Hash_job & job, const struct stat & st, Hash_cache_kind kind, const Digest & d,
+        const File_hash_checkpoint* cp)
+{
+    if (options.cache==Options::CACHE_NONE)
+        return;
+
+    Dir_handle dir;
+    if (get_dir_handle (*job.dir_name, dir)==false)
+        return;
+    string name=to_native (*job.file_name);
+
+    // nothing is written to file itself, so it's not opened again
+    if (options.cache==Options::CACHE_DB)
+    {
+        struct stat now;
+        if (fstatat (dir, name.c_str(), &now, AT_SYMLINK_NOFOLLOW)==0 && same_file (st, now))
+        {
+            if (cp!=NULL)
+                db_put_checkpoint (st, *cp);
+            db.put (db_key (st, kind), d);
+        };
+        return;
+    };
+
+    int fd=openat (dir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd==-1)
+        return;
+    hash_cache_put (fd, st, kind, d, cp);
+    close (fd);
+};
+
+// digests written by stages 2 and 3 more than XATTR_CTIME_SLACK_NS apart are both taken by the next run,
+// and checkpoint is still there after file has grown and its partial digest is written again
+void hash_cache_test (const string & fname)
+{
+#ifdef __linux__
+    auto saved=options.cache;
+    options.cache=Options::CACHE_XATTR;
+    int fd=open (fname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    assert (fd!=-1 && ftruncate (fd, 2*TREE_HASH_LEAF)==0);
+
+    Digest part, full, d;
+    memset (part.bytes, 1, DIGEST_SIZE);
+    memset (full.bytes, 2, DIGEST_SIZE);
+    File_hash_checkpoint cp, out;
+    cp.size=2*TREE_HASH_LEAF;
+    cp.offset=2*TREE_HASH_LEAF;
+    cp.last_leaf=full;
+    cp.leaves.assign (2, part);
+
+    struct stat st;
+    assert (fstat (fd, &st)==0);
+    hash_cache_put (fd, st, HASH_CACHE_PARTIAL, part);
+    assert (fstat (fd, &st)==0);
+    if (hash_cache_get (fd, st, HASH_CACHE_PARTIAL, d)) // or filesystem has no user xattrs
+    {
+        usleep (XATTR_CTIME_SLACK_NS/1000+200000);
+        hash_cache_put (fd, st, HASH_CACHE_FULL, full, &cp);
+        assert (fstat (fd, &st)==0);
+        assert (hash_cache_get (fd, st, HASH_CACHE_PARTIAL, d) && d==part);
+        assert (hash_cache_get (fd, st, HASH_CACHE_FULL, d) && d==full);
+
+        assert (ftruncate (fd, 3*TREE_HASH_LEAF)==0 && fstat (fd, &st)==0);
+        assert (hash_cache_get (fd, st, HASH_CACHE_PARTIAL, d)==false);
+        hash_cache_put (fd, st, HASH_CACHE_PARTIAL, part);
+        assert (fstat (fd, &st)==0);
+        assert (hash_cache_get (fd, st, HASH_CACHE_PARTIAL, d) && d==part);
+        assert (hash_cache_get (fd, st, HASH_CACHE_FULL, d)==false);
+        assert (hash_cache_get_checkpoint (fd, st, out) && out.offset==cp.offset && out.leaves==cp.leaves);
+    };
+
+    close (fd);
+    unlink (fname.c_str());
+    options.cache=saved;
+#endif
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,49 @@
+#pragma once
+
+// Digests of files cached between runs on Linux, as NTFS streams are on Win32 (see utils.cpp).
+// With --cache=db, they are kept in database file of its own, keyed by device, inode, size and mtime
+// of file (see hash_db.hpp): that's for volumes where nothing can be written.
+// With --cache=xattr, they are kept in extended attribute of file itself: user.ddff.<engine>.
+// Value is binary: what file it was (inode, size, mtime and ctime in nanoseconds), then partial and
+// full digest (either may be missing), then checkpoint. Digests are taken only if all of that is
+// the same now, and they are read with one fgetxattr() from file which is open anyway. It's written
+// after hashing, and only if file is still the same as it was then: whole value at once, as each write
+// sets ctime, and digest written before would not be valid after that.
+// Writing of xattr needs permission to write to file: files of others, read-only filesystems and
+// filesystems without user xattrs are just not cached.
+// Tree hashed files have checkpoint as well (see hash_engine.hpp), in xattr, or in db by device and
+// inode only: it's taken when file has grown, so only what's appended is hashed.
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+#include "hash_engine.hpp"
+
+enum Hash_cache_kind { HASH_CACHE_PARTIAL, HASH_CACHE_FULL }; // partial is of level 1 only
+
+// database of --cache=db. if it can't be opened, there is no cache at all
+bool hash_cache_open();
+void hash_cache_close();
+
+// st is of fd, taken just now
+bool hash_cache_get (int fd, const struct stat & st, Hash_cache_kind kind, Digest & out);
+// checkpoint of file which was smaller then, it's checked with file_hash_checkpoint_fits() already
+bool hash_cache_get_checkpoint (int fd, const struct stat & st, File_hash_checkpoint & out);
+// st is of file as it was before hashing. cp is of full digest of tree hashed file
+void hash_cache_put (int fd, const struct stat & st, Hash_cache_kind kind, const Digest & d,
+        const File_hash_checkpoint* cp=NULL);
+// the same, but file is opened again (by those who have closed it already)
+void hash_cache_put (const Hash_job & job, const struct stat & st, Hash_cache_kind kind, const Digest & d,
+        const File_hash_checkpoint* cp=NULL);
+
+void hash_cache_test (const std::string & fname);
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
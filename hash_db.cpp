@@ -0,0 +1,482 @@
+// Database of digests, see hash_db.hpp
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "hash_db.hpp"
+
+using namespace std;
+
+#define HASH_DB_LOG_MAGIC 0x314244464444ULL // "DDFDB1"
+#define HASH_DB_INDEX_MAGIC 0x315849464444ULL // "DDFIX1"
+#define HASH_DB_HEADER 64 // of both files, records and slots are aligned
+#define HASH_DB_MIN_SLOTS (1<<16)
+#define HASH_DB_FLUSH 65536 // records are appended to log by that many
+
+static_assert (sizeof(Hash_db_record)==64, "record of log is 64 bytes");
+static_assert (sizeof(Hash_db_index_header)<=HASH_DB_HEADER, "index header fits");
+
+struct Hash_db_log_header
+{
+    uint64_t magic;
+    uint64_t id; // index is of this log only if it has the same
+    uint64_t record_size;
+};
+
+static uint64_t mix (uint64_t h, uint64_t v)
+{
+    // splitmix64 finalizer
+    h^=v;
+    h=(h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h=(h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+};
+
+static uint64_t key_hash (uint64_t dev, uint64_t inode, uint64_t size, int64_t mtime_ns, uint32_t kind)
+{
+    return mix (mix (mix (mix (mix (0, dev), inode), size), (uint64_t)mtime_ns), kind);
+};
+
+static uint64_t key_hash (const Hash_db_key & k)
+{
+    return key_hash (k.dev, k.inode, k.size, k.mtime_ns, k.kind);
+};
+
+static uint64_t key_hash (const Hash_db_record & r)
+{
+    return key_hash (r.dev, r.inode, r.size, r.mtime_ns, r.kind);
+};
+
+static uint32_t record_check (const Hash_db_record & r)
+{
+    uint64_t d[2];
+    memcpy (d, r.digest.bytes, sizeof(d));
+    return (uint32_t)mix (mix (key_hash (r), d[0]), d[1]);
+};
+
+static bool same_key (const Hash_db_record & r, const Hash_db_key & k)
+{
+    return r.dev==k.dev && r.inode==k.inode && r.size==k.size && r.mtime_ns==k.mtime_ns && r.kind==k.kind;
+};
+
+static bool same_key (const Hash_db_record & a, const Hash_db_record & b)
+{
+    return a.dev==b.dev && a.inode==b.inode && a.size==b.size && a.mtime_ns==b.mtime_ns && a.kind==b.kind;
+};
+
+// slot: high half is high half of hash of key, low half is number of record+1 (0 is empty slot)
+static uint64_t make_slot (uint64_t hash, size_t r)
+{
+    return (hash & 0xffffffff00000000ULL) | (uint64_t)(r+1);
+};
+
+static size_t slot_record (uint64_t slot)
+{
+    return (size_t)(slot & 0xffffffffULL)-1;
+};
+
+static bool write_full (int fd, const void* buf, size_t len, off_t offset)
+{
+    size_t done=0;
+    while (done<len)
+    {
+        ssize_t r=pwrite (fd, (const uint8_t*)buf+done, len-done, offset+done);
+        if (r==-1 && errno==EINTR)
+            continue;
+        if (r<=0)
+            return false;
+        done+=r;
+    };
+    return true;
+};
+
+// no more than 3/4 of slots are used
+static uint64_t slots_for (size_t records)
+{
+    uint64_t rt=HASH_DB_MIN_SLOTS;
+    while (rt*3 < (uint64_t)records*4)
+        rt*=2;
+    return rt;
+};
+
+Hash_db::Hash_db()
+{
+    ok=false;
+    log_fd=index_fd=-1;
+    id=0;
+    log_map=index_map=NULL;
+    log_map_len=index_map_len=0;
+    log_records=0;
+    header=NULL;
+    slots=NULL;
+};
+
+Hash_db::~Hash_db()
+{
+    close();
+};
+
+const Hash_db_record & Hash_db::record (size_t r) const
+{
+    if (r<log_records)
+        return ((const Hash_db_record*)(log_map+HASH_DB_HEADER))[r];
+    return pending[r-log_records];
+};
+
+bool Hash_db::map_log (size_t records)
+{
+    if (log_map!=NULL)
+        munmap (log_map, log_map_len);
+    log_map=NULL;
+    log_map_len=HASH_DB_HEADER+records*sizeof(Hash_db_record);
+    void* p=mmap (NULL, log_map_len, PROT_READ, MAP_SHARED, log_fd, 0);
+    if (p==MAP_FAILED)
+    {
+        wcerr << WFUNCTION << L"(): can't map " << from_native (log_name.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+    log_map=(uint8_t*)p;
+    log_records=records;
+    return true;
+};
+
+bool Hash_db::map_index (int fd, size_t len)
+{
+    void* p=mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p==MAP_FAILED)
+        return false;
+    index_fd=fd;
+    index_map=(uint8_t*)p;
+    index_map_len=len;
+    header=(Hash_db_index_header*)index_map;
+    slots=(uint64_t*)(index_map+HASH_DB_HEADER);
+    return true;
+};
+
+void Hash_db::unmap_index()
+{
+    if (index_map!=NULL)
+        munmap (index_map, index_map_len);
+    if (index_fd!=-1)
+        ::close (index_fd);
+    index_map=NULL;
+    index_fd=-1;
+    header=NULL;
+    slots=NULL;
+};
+
+// index as it's left by the last run, and records it hasn't got yet (that run has crashed)
+bool Hash_db::open_index()
+{
+    int fd=::open (index_name.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd==-1)
+        return false;
+    struct stat st;
+    if (fstat (fd, &st)!=0 || st.st_size<HASH_DB_HEADER || map_index (fd, st.st_size)==false)
+    {
+        ::close (fd);
+        return false;
+    };
+    if (header->magic!=HASH_DB_INDEX_MAGIC || header->id!=id || header->slots<HASH_DB_MIN_SLOTS ||
+            (header->slots & (header->slots-1))!=0 || (uint64_t)st.st_size!=HASH_DB_HEADER+header->slots*sizeof(uint64_t) ||
+            header->records>log_records || header->used>header->slots)
+    {
+        unmap_index();
+        return false;
+    };
+
+    if (header->used+(log_records-header->records) > header->slots*3/4)
+        return rebuild_index (slots_for (header->used+(log_records-header->records)));
+    for (size_t r=header->records; r<log_records; r++)
+        insert (r);
+    header->records=log_records;
+    return true;
+};
+
+// new index of all records, to temporary file first, so the old one is still there if it fails
+bool Hash_db::rebuild_index (uint64_t n)
+{
+    string tmp_name=index_name+".tmp";
+    int fd=::open (tmp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd==-1 || ftruncate (fd, HASH_DB_HEADER+n*sizeof(uint64_t))!=0) // file of zeros, without writing them
+    {
+        wcerr << WFUNCTION << L"(): can't create " << from_native (tmp_name.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        if (fd!=-1)
+            ::close (fd);
+        return false;
+    };
+    unmap_index();
+    if (map_index (fd, HASH_DB_HEADER+n*sizeof(uint64_t))==false)
+    {
+        wcerr << WFUNCTION << L"(): can't map " << from_native (tmp_name.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        ::close (fd);
+        return false;
+    };
+
+    header->magic=HASH_DB_INDEX_MAGIC;
+    header->id=id;
+    header->slots=n;
+    header->used=0;
+    for (size_t r=0; r<records(); r++)
+        insert (r);
+    header->records=log_records;
+
+    if (rename (tmp_name.c_str(), index_name.c_str())!=0)
+    {
+        wcerr << WFUNCTION << L"(): can't rename " << from_native (tmp_name.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        unmap_index();
+        return false;
+    };
+    return true;
+};
+
+// newer record of the same key takes its slot. slot of record which is lost (crash) is taken by anyone
+void Hash_db::insert (size_t r)
+{
+    const Hash_db_record & rec=record (r);
+    if (rec.check!=record_check (rec))
+        return; // torn
+    uint64_t h=key_hash (rec);
+    uint64_t mask=header->slots-1;
+    for (uint64_t i=h & mask; ; i=(i+1) & mask)
+    {
+        if (slots[i]==0)
+        {
+            slots[i]=make_slot (h, r);
+            header->used++;
+            return;
+        };
+        if ((slots[i] >> 32)!=(h >> 32))
+            continue;
+        size_t old=slot_record (slots[i]);
+        if (old>=records() || same_key (record (old), rec))
+        {
+            slots[i]=make_slot (h, r);
+            return;
+        };
+    };
+};
+
+bool Hash_db::find (const Hash_db_key & key, Digest & out) const
+{
+    uint64_t h=key_hash (key);
+    uint64_t mask=header->slots-1;
+    for (uint64_t i=h & mask; slots[i]!=0; i=(i+1) & mask)
+    {
+        if ((slots[i] >> 32)!=(h >> 32))
+            continue;
+        size_t r=slot_record (slots[i]);
+        if (r>=records())
+            continue;
+        const Hash_db_record & rec=record (r);
+        if (same_key (rec, key) && rec.check==record_check (rec))
+        {
+            out=rec.digest;
+            return true;
+        };
+    };
+    return false;
+};
+
+bool Hash_db::flush()
+{
+    if (pending.empty())
+        return true;
+    if (write_full (log_fd, pending.data(), pending.size()*sizeof(Hash_db_record),
+                HASH_DB_HEADER+(off_t)log_records*sizeof(Hash_db_record))==false)
+    {
+        wcerr << WFUNCTION << L"(): can't write to " << from_native (log_name.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+    if (map_log (log_records+pending.size())==false)
+        return false;
+    pending.clear();
+    header->records=log_records;
+    return true;
+};
+
+bool Hash_db::open (const string & fname)
+{
+    close();
+    log_name=fname;
+    index_name=fname+".idx";
+
+    log_fd=::open (fname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd==-1)
+    {
+        wcerr << WFUNCTION << L"(): can't open " << from_native (fname.c_str()) << L" (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+    if (flock (log_fd, LOCK_EX | LOCK_NB)!=0)
+    {
+        wcerr << WFUNCTION << L"(): " << from_native (fname.c_str()) << L" is used by another run" << endl;
+        close();
+        return false;
+    };
+
+    struct stat st;
+    if (fstat (log_fd, &st)!=0)
+    {
+        close();
+        return false;
+    };
+
+    uint8_t buf[HASH_DB_HEADER];
+    Hash_db_log_header h;
+    if (st.st_size==0)
+    {
+        // id tells this log from another one, which may have the same name later
+        struct timespec t;
+        clock_gettime (CLOCK_REALTIME, &t);
+        h.magic=HASH_DB_LOG_MAGIC;
+        h.id=mix (mix ((uint64_t)t.tv_sec, (uint64_t)t.tv_nsec), (uint64_t)getpid());
+        h.record_size=sizeof(Hash_db_record);
+        memset (buf, 0, sizeof(buf));
+        memcpy (buf, &h, sizeof(h));
+        if (write_full (log_fd, buf, sizeof(buf), 0)==false)
+        {
+            wcerr << WFUNCTION << L"(): can't write to " << from_native (fname.c_str()) << L" (" << strerror (errno) << L")" << endl;
+            close();
+            return false;
+        };
+        st.st_size=HASH_DB_HEADER;
+    }
+    else
+    {
+        if (st.st_size<HASH_DB_HEADER || pread (log_fd, buf, sizeof(buf), 0)!=(ssize_t)sizeof(buf))
+            h.magic=0;
+        else
+            memcpy (&h, buf, sizeof(h));
+        if (h.magic!=HASH_DB_LOG_MAGIC || h.record_size!=sizeof(Hash_db_record))
+        {
+            wcerr << WFUNCTION << L"(): " << from_native (fname.c_str()) << L" is not a hash database" << endl;
+            close();
+            return false;
+        };
+    };
+    id=h.id;
+
+    size_t n=(size_t)((st.st_size-HASH_DB_HEADER)/sizeof(Hash_db_record));
+    if ((st.st_size-HASH_DB_HEADER)%sizeof(Hash_db_record)!=0 && ftruncate (log_fd, HASH_DB_HEADER+(off_t)n*sizeof(Hash_db_record))!=0)
+    {
+        close(); // torn record can't be dropped, so the next ones would be misplaced
+        return false;
+    };
+    if (map_log (n)==false || (open_index()==false && rebuild_index (slots_for (n))==false))
+    {
+        close();
+        return false;
+    };
+    ok=true;
+    return true;
+};
+
+void Hash_db::close()
+{
+    lock_guard<mutex> l (lock);
+    if (ok)
+        flush();
+    ok=false;
+    unmap_index();
+    if (log_map!=NULL)
+        munmap (log_map, log_map_len);
+    log_map=NULL;
+    log_records=0;
+    pending.clear();
+    if (log_fd!=-1)
+        ::close (log_fd); // and it's unlocked
+    log_fd=-1;
+};
+
+bool Hash_db::get (const Hash_db_key & key, Digest & out)
+{
+    lock_guard<mutex> l (lock);
+    return ok && find (key, out);
+};
+
+void Hash_db::put (const Hash_db_key & key, const Digest & d)
+{
+    lock_guard<mutex> l (lock);
+    Digest old;
+    if (ok==false || (find (key, old) && old==d))
+        return;
+
+    if ((header->used+1)*4 > header->slots*3 && rebuild_index (header->slots*2)==false)
+    {
+        ok=false; // and nothing more is cached by this run
+        return;
+    };
+
+    Hash_db_record r;
+    memset (&r, 0, sizeof(r));
+    r.dev=key.dev;
+    r.inode=key.inode;
+    r.size=key.size;
+    r.mtime_ns=key.mtime_ns;
+    r.kind=key.kind;
+    r.digest=d;
+    r.check=record_check (r);
+    pending.push_back (r);
+    insert (records()-1);
+    if (pending.size()>=HASH_DB_FLUSH && flush()==false)
+        ok=false;
+};
+
+// records are found after reopen, after index is lost, and after torn record at the end
+void hash_db_test (const string & fname)
+{
+    string index_name=fname+".idx";
+    unlink (fname.c_str());
+    unlink (index_name.c_str());
+
+    const size_t n=200000; // more than initial index takes, and more than one flush
+    auto key=[](size_t i) { return Hash_db_key{ 1, i, i*7, (int64_t)i*1000, (uint32_t)(i%3) }; };
+    auto digest=[](size_t i) { Digest d; memset (d.bytes, 0, DIGEST_SIZE); memcpy (d.bytes, &i, sizeof(i)); return d; };
+
+    Hash_db db;
+    Digest d;
+    assert (db.open (fname));
+    for (size_t i=0; i<n; i++)
+        db.put (key (i), digest (i));
+    for (size_t i=0; i<n; i++)
+        assert (db.get (key (i), d) && d==digest (i));
+    db.close();
+
+    for (int pass=0; pass<3; pass++)
+    {
+        if (pass==1)
+            unlink (index_name.c_str());
+        if (pass==2)
+        {
+            struct stat st;
+            assert (stat (fname.c_str(), &st)==0 && truncate (fname.c_str(), st.st_size-10)==0);
+        };
+        assert (db.open (fname));
+        for (size_t i=0; i<n; i++)
+            assert ((pass==2 && i==n-1) ? db.get (key (i), d)==false : (db.get (key (i), d) && d==digest (i)));
+        assert (db.get (key (n), d)==false);
+        db.close();
+    };
+
+    unlink (fname.c_str());
+    unlink (index_name.c_str());
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
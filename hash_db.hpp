@@ -0,0 +1,101 @@
+#pragma once
+
+// Database of digests of files in one file of its own (--cache=db), for volumes where nothing can be
+// kept along with files: read-only snapshots, NFS exports, filesystems without xattrs (see hash_cache.hpp).
+// It's append-only log of fixed size records: key is device, inode, size and mtime (in nanoseconds) of file
+// and kind of digest, value is digest. New records are only appended, nothing is ever rewritten, so torn
+// record at the end (of crash) is all that can go wrong, and it's dropped by the next open.
+// Records of files which are changed since are not removed: log grows by one record per version of file.
+// Log is indexed by open-addressing hash table in another file (<db>.idx). Both are memory-mapped, so open
+// reads nothing at all (whatever the size), and lookup is a few memory reads, without syscalls.
+// Each slot of index is number of record and a part of hash of its key, so probing doesn't touch log
+// until key is likely found there. Index is rebuilt from log if it's lost, or it's not of this log.
+// Database is locked (flock()) while it's open, so another run at the same time goes without it.
+
+#ifndef _WIN32
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <boost/utility.hpp>
+
+#include "utils.hpp"
+
+struct Hash_db_key
+{
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t kind; // whatever caller tells digests apart with
+};
+
+// as it's in log
+struct Hash_db_record
+{
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t kind;
+    uint32_t check; // of everything else, so torn record is seen
+    Digest digest;
+    uint64_t reserved;
+};
+
+struct Hash_db_index_header
+{
+    uint64_t magic;
+    uint64_t id; // of log
+    uint64_t slots; // power of 2
+    uint64_t used;
+    uint64_t records; // of log, which are all in index for sure
+};
+
+// may be called from several threads at once
+class Hash_db : boost::noncopyable
+{
+    private:
+        std::mutex lock;
+        bool ok;
+        std::string log_name, index_name;
+        int log_fd, index_fd;
+        uint64_t id;
+        uint8_t* log_map;
+        size_t log_map_len;
+        size_t log_records; // written to log (and mapped)
+        std::vector<Hash_db_record> pending; // appended, not written yet
+        uint8_t* index_map;
+        size_t index_map_len;
+        Hash_db_index_header* header;
+        uint64_t* slots;
+
+        size_t records() const { return log_records+pending.size(); };
+        const Hash_db_record & record (size_t r) const;
+        bool map_log (size_t records);
+        bool map_index (int fd, size_t len);
+        void unmap_index();
+        bool open_index();
+        bool rebuild_index (uint64_t slots);
+        void insert (size_t r);
+        bool find (const Hash_db_key & key, Digest & out) const;
+        bool flush();
+
+    public:
+        Hash_db();
+        ~Hash_db();
+        bool open (const std::string & fname); // false if it can't be opened, or it's locked by another run
+        void close();
+        bool get (const Hash_db_key & key, Digest & out);
+        void put (const Hash_db_key & key, const Digest & d);
+};
+
+void hash_db_test (const std::string & fname);
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,269 @@
+// Hash engines, see hash_engine.hpp
+
+#include <string.h>
+#include <assert.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "hash_engine.hpp"
+#include "sha512_mb.hpp"
+
+using namespace std;
+
+void hash_init (Hash_ctx *ctx)
+{
+    ctx->engine=options.hash;
+    if (ctx->engine==Options::HASH_SHA512)
+        sha512_init_ctx (&ctx->sha512);
+    else
+        fast_hash_init_ctx (&ctx->fast);
+};
+
+void hash_process_bytes (Hash_ctx *ctx, const void *buf, size_t len)
+{
+    if (ctx->engine==Options::HASH_SHA512)
+        sha512_process_bytes (buf, len, &ctx->sha512);
+    else
+        fast_hash_process_bytes (buf, len, &ctx->fast);
+};
+
+// holes of sparse files are fed to hash from here instead of disk
+static const uint8_t zero_block[64*1024]={0};
+
+void hash_process_zeros (Hash_ctx *ctx, FileSize len)
+{
+    while (len>0)
+    {
+        size_t sz=(size_t)min (len, (FileSize)sizeof(zero_block));
+        hash_process_bytes (ctx, zero_block, sz);
+        len-=sz;
+    };
+};
+
+Digest hash_finish (Hash_ctx *ctx)
+{
+    if (ctx->engine==Options::HASH_SHA512)
+        return SHA512_finish_and_get_digest (&ctx->sha512);
+
+    static_assert (DIGEST_SIZE<=FAST_HASH_DIGEST_SIZE, "digest is cut from hash");
+    uint8_t res[FAST_HASH_DIGEST_SIZE];
+    fast_hash_finish_ctx (&ctx->fast, res);
+
+    Digest rt;
+    memcpy (rt.bytes, res, DIGEST_SIZE);
+    return rt;
+};
+
+void hash_messages (size_t n, const uint8_t* const* msgs, const size_t* lens, Digest* out)
+{
+    if (options.hash!=Options::HASH_SHA512)
+    {
+        for (size_t i=0; i<n; i++)
+        {
+            Hash_ctx ctx;
+            hash_init (&ctx);
+            hash_process_bytes (&ctx, msgs[i], lens[i]);
+            out[i]=hash_finish (&ctx);
+        };
+        return;
+    };
+
+    vector<uint8_t> full (n*SHA512_DIGEST_SIZE);
+    sha512_mb (n, msgs, lens, (uint8_t (*)[SHA512_DIGEST_SIZE])full.data());
+    for (size_t i=0; i<n; i++)
+        memcpy (out[i].bytes, &full[i*SHA512_DIGEST_SIZE], DIGEST_SIZE);
+};
+
+// a few messages for each lane, so lanes freed by short ones get the next ones
+#define HASH_MESSAGES_PER_LANE 4
+
+size_t hash_messages_batch()
+{
+    if (options.hash!=Options::HASH_SHA512 || sha512_mb_lanes()==1)
+        return 1;
+    return sha512_mb_lanes()*HASH_MESSAGES_PER_LANE;
+};
+
+bool tree_hashed (FileSize size)
+{
+    return size>TREE_HASH_LEAF;
+};
+
+Digest tree_hash_node (const Digest* children, size_t n)
+{
+    Hash_ctx ctx;
+    hash_init (&ctx);
+    hash_process_bytes (&ctx, children, n*sizeof(Digest));
+    return hash_finish (&ctx);
+};
+
+static Digest hash_of_zero_leaf()
+{
+    Hash_ctx ctx;
+    hash_init (&ctx);
+    hash_process_zeros (&ctx, TREE_HASH_LEAF);
+    return hash_finish (&ctx);
+};
+
+const Digest & tree_hash_zero_leaf()
+{
+    static const Digest rt=hash_of_zero_leaf(); // engine is chosen before anything is hashed
+    return rt;
+};
+
+void file_hash_init (File_hash_ctx *ctx, FileSize size)
+{
+    ctx->tree=tree_hashed (size);
+    ctx->leaf_len=0;
+    ctx->leaves.clear();
+    ctx->chunks.clear();
+    hash_init (&ctx->ctx);
+};
+
+static void file_hash_leaf_done (File_hash_ctx *ctx, const Digest & leaf)
+{
+    ctx->last_leaf=leaf;
+    ctx->leaves.push_back (leaf);
+    if (ctx->leaves.size()==TREE_HASH_LEAVES_PER_CHUNK)
+    {
+        ctx->chunks.push_back (tree_hash_node (ctx->leaves.data(), ctx->leaves.size()));
+        ctx->leaves.clear();
+    };
+};
+
+// when current leaf is full
+static void file_hash_next_leaf (File_hash_ctx *ctx)
+{
+    if (ctx->leaf_len<TREE_HASH_LEAF)
+        return;
+    file_hash_leaf_done (ctx, hash_finish (&ctx->ctx));
+    hash_init (&ctx->ctx);
+    ctx->leaf_len=0;
+};
+
+void file_hash_process_bytes (File_hash_ctx *ctx, const void *buf, size_t len)
+{
+    if (ctx->tree==false)
+    {
+        hash_process_bytes (&ctx->ctx, buf, len);
+        return;
+    };
+
+    const uint8_t* p=(const uint8_t*)buf;
+    while (len>0)
+    {
+        size_t sz=min (len, (size_t)TREE_HASH_LEAF-ctx->leaf_len);
+        hash_process_bytes (&ctx->ctx, p, sz);
+        ctx->leaf_len+=sz;
+        p+=sz;
+        len-=sz;
+        file_hash_next_leaf (ctx);
+    };
+};
+
+void file_hash_process_zeros (File_hash_ctx *ctx, FileSize len)
+{
+    if (ctx->tree==false)
+    {
+        hash_process_zeros (&ctx->ctx, len);
+        return;
+    };
+
+    while (len>0)
+    {
+        if (ctx->leaf_len==0 && len>=TREE_HASH_LEAF)
+        {
+            file_hash_leaf_done (ctx, tree_hash_zero_leaf());
+            len-=TREE_HASH_LEAF;
+            continue;
+        };
+        size_t sz=(size_t)min (len, (FileSize)(TREE_HASH_LEAF-ctx->leaf_len));
+        hash_process_zeros (&ctx->ctx, sz);
+        ctx->leaf_len+=sz;
+        len-=sz;
+        file_hash_next_leaf (ctx);
+    };
+};
+
+Digest file_hash_finish (File_hash_ctx *ctx)
+{
+    if (ctx->tree==false)
+        return hash_finish (&ctx->ctx);
+
+    if (ctx->leaf_len>0)
+        ctx->leaves.push_back (hash_finish (&ctx->ctx));
+    if (ctx->leaves.empty()==false)
+        ctx->chunks.push_back (tree_hash_node (ctx->leaves.data(), ctx->leaves.size()));
+    return tree_hash_node (ctx->chunks.data(), ctx->chunks.size());
+};
+
+bool file_hash_checkpoint (const File_hash_ctx *ctx, FileSize size, File_hash_checkpoint & out)
+{
+    if (ctx->tree==false)
+        return false;
+    out.size=size;
+    out.chunks=ctx->chunks;
+    out.leaves=ctx->leaves;
+    out.offset=(FileSize)(out.chunks.size()*TREE_HASH_LEAVES_PER_CHUNK + out.leaves.size())*TREE_HASH_LEAF;
+    out.last_leaf=ctx->last_leaf;
+    return true;
+};
+
+bool file_hash_checkpoint_fits (FileSize size, const File_hash_checkpoint & cp)
+{
+    return tree_hashed (size) && size>cp.size && cp.offset>0 && cp.offset<=cp.size &&
+        cp.leaves.size()<TREE_HASH_LEAVES_PER_CHUNK &&
+        cp.offset==(FileSize)(cp.chunks.size()*TREE_HASH_LEAVES_PER_CHUNK + cp.leaves.size())*TREE_HASH_LEAF;
+};
+
+bool file_hash_resume (File_hash_ctx *ctx, FileSize size, const File_hash_checkpoint & cp)
+{
+    if (file_hash_checkpoint_fits (size, cp)==false)
+        return false;
+    file_hash_init (ctx, size);
+    ctx->chunks=cp.chunks;
+    ctx->leaves=cp.leaves;
+    ctx->last_leaf=cp.last_leaf;
+    return true;
+};
+
+const wchar_t* hash_engine_name()
+{
+    return options.hash==Options::HASH_SHA512 ? L"SHA512" : L"FAST128";
+};
+
+// file grown after checkpoint has the same digest, whether it's hashed from checkpoint or from byte 0
+void file_hash_test()
+{
+    static uint8_t buf[3000];
+    for (size_t i=0; i<sizeof(buf); i++)
+        buf[i]=(uint8_t)(i*7+i/256);
+    FileSize old_size=TREE_HASH_LEAF*(FileSize)(TREE_HASH_LEAVES_PER_CHUNK+1)+sizeof(buf);
+    FileSize size=old_size+2*TREE_HASH_LEAF+sizeof(buf);
+
+    File_hash_ctx ctx;
+    File_hash_checkpoint cp;
+    file_hash_init (&ctx, old_size);
+    file_hash_process_zeros (&ctx, old_size-sizeof(buf));
+    file_hash_process_bytes (&ctx, buf, sizeof(buf));
+    assert (file_hash_checkpoint (&ctx, old_size, cp));
+    assert (cp.offset==old_size-sizeof(buf) && cp.chunks.size()==1 && cp.leaves.size()==1);
+    assert (cp.last_leaf==tree_hash_zero_leaf());
+
+    file_hash_init (&ctx, size);
+    file_hash_process_zeros (&ctx, old_size-sizeof(buf));
+    file_hash_process_bytes (&ctx, buf, sizeof(buf));
+    file_hash_process_zeros (&ctx, 2*TREE_HASH_LEAF);
+    file_hash_process_bytes (&ctx, buf, sizeof(buf));
+    Digest whole=file_hash_finish (&ctx);
+
+    assert (file_hash_resume (&ctx, old_size, cp)==false);
+    assert (file_hash_resume (&ctx, size, cp));
+    file_hash_process_bytes (&ctx, buf, sizeof(buf));
+    file_hash_process_zeros (&ctx, 2*TREE_HASH_LEAF);
+    file_hash_process_bytes (&ctx, buf, sizeof(buf));
+    assert (file_hash_finish (&ctx)==whole);
+};
+
+/* vim: set expandtab ts=4 sw=4 : */
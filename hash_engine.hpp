@@ -0,0 +1,92 @@
+#pragma once
+
+// Contents of files are hashed by one of these engines, chosen once per run (--hash=):
+// fast (default): 128-bit non-cryptographic hash (see fast_hash.h), many times faster than SHA512;
+// sha512: SHA512, for those who want cryptographic hash.
+// Digest of either one is DIGEST_SIZE bytes. Digests of different engines are never compared:
+// caches of file hashes are kept separately for each engine.
+// (Directory hashes are SHA512 of digests of children, whatever engine made these.)
+
+#include <vector>
+
+#include "utils.hpp"
+#include "sha512.h"
+#include "fast_hash.h"
+
+struct Hash_ctx
+{
+    int engine; // Options::HASH_*
+    union
+    {
+        struct sha512_ctx sha512;
+        struct fast_hash_ctx fast;
+    };
+};
+
+void hash_init (Hash_ctx *ctx); // engine is taken from options
+void hash_process_bytes (Hash_ctx *ctx, const void *buf, size_t len);
+void hash_process_zeros (Hash_ctx *ctx, FileSize len); // holes of sparse files are hashed without reading them
+Digest hash_finish (Hash_ctx *ctx);
+const wchar_t* hash_engine_name(); // of this run, for caches
+
+// many whole messages at once (partial hashes, small files): SHA512 engine hashes them side by side
+// in lanes of vector registers (see sha512_mb.hpp), fast one one by one (it's fast enough anyway)
+void hash_messages (size_t n, const uint8_t* const* msgs, const size_t* lens, Digest* out);
+// how many messages are worth collecting for one hash_messages() call, 1 if there is no point
+size_t hash_messages_batch();
+
+// Files bigger than one leaf are hashed as a tree, so one huge file can be hashed by all cores
+// at once (pieces of it go to all hashers, see utils_pipeline.cpp):
+// leaf: each TREE_HASH_LEAF bytes of file (the last one may be shorter) are hashed on their own;
+// chunk: digests of each TREE_HASH_LEAVES_PER_CHUNK leaves are hashed together;
+// root: digests of all chunks hashed together, that's the digest of file.
+// Files of one size are always hashed the same way, so equal files still have equal digests.
+// Chunk digests (one per 64 MiB) are kept in caches only as part of checkpoint (see below).
+#define TREE_HASH_LEAF (1024*1024)
+#define TREE_HASH_LEAVES_PER_CHUNK 64
+
+bool tree_hashed (FileSize size);
+Digest tree_hash_node (const Digest* children, size_t n); // of chunk (children are leaves) or root
+const Digest & tree_hash_zero_leaf(); // of whole leaf of zeros: such holes are not hashed at all
+
+// whole file hashed sequentially, as tree or not, depending on its size
+struct File_hash_ctx
+{
+    bool tree;
+    Hash_ctx ctx; // of whole file, or of current leaf
+    size_t leaf_len; // how much of current leaf is hashed
+    std::vector<Digest> leaves; // of current chunk
+    std::vector<Digest> chunks;
+    Digest last_leaf; // the last whole one
+};
+
+void file_hash_init (File_hash_ctx *ctx, FileSize size);
+void file_hash_process_bytes (File_hash_ctx *ctx, const void *buf, size_t len);
+void file_hash_process_zeros (File_hash_ctx *ctx, FileSize len);
+Digest file_hash_finish (File_hash_ctx *ctx);
+
+// State of tree hash at the last whole leaf, kept in caches along with digest (see DDF_CKPT_* NTFS streams):
+// files which only grow (logs, journals) are hashed again from there, not from byte 0.
+// Before that, the leaf just before offset is read again and must still have last_leaf digest:
+// that's all the checking of old part of file, it's assumed to be appended to, not rewritten.
+// Nothing is hashed beyond leaves here, so there is no midstate of engine to keep.
+struct File_hash_checkpoint
+{
+    FileSize size; // of file, when it was hashed
+    FileSize offset; // of the end of the last whole leaf
+    Digest last_leaf;
+    std::vector<Digest> chunks; // whole chunks before offset
+    std::vector<Digest> leaves; // whole leaves after them
+};
+
+// all of file is hashed by ctx, but not finished yet. false if file isn't tree hashed
+bool file_hash_checkpoint (const File_hash_ctx *ctx, FileSize size, File_hash_checkpoint & out);
+// checkpoint is of use for file of this size: file has grown since, and checkpoint isn't broken
+bool file_hash_checkpoint_fits (FileSize size, const File_hash_checkpoint & cp);
+// ctx for file of this size, continued from checkpoint: the rest is to be hashed from cp.offset,
+// after checking the leaf before it. false if checkpoint is of no use (file hasn't grown, or it's broken)
+bool file_hash_resume (File_hash_ctx *ctx, FileSize size, const File_hash_checkpoint & cp);
+
+void file_hash_test();
+
+/* vim: set expandtab ts=4 sw=4 : */
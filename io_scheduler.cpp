@@ -0,0 +1,234 @@
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#include "io_scheduler.hpp"
+
+using namespace std;
+
+#define HDD_STREAMS 1
+#define HDD_DEPTH 8 // let NCQ reorder a bit, but don't make heads jump around between too many files
+#define SSD_STREAMS 32
+#define SSD_DEPTH 256
+#define OTHER_STREAMS 4 // network filesystems, tmpfs, btrfs subvolumes, etc: we just don't know
+#define OTHER_DEPTH 64
+
+// -1 if there is no such block device (network filesystem, etc)
+static int read_sysfs_flag (const string & path)
+{
+    FILE* f=fopen (path.c_str(), "r");
+    if (f==NULL)
+        return -1;
+    int rt;
+    if (fscanf (f, "%d", &rt)!=1)
+        rt=-1;
+    fclose (f);
+    return rt;
+};
+
+static int device_is_rotational (dev_t dev)
+{
+    char dir[64];
+    snprintf (dir, sizeof(dir), "/sys/dev/block/%u:%u", major (dev), minor (dev));
+
+    int rt=read_sysfs_flag (string(dir) + "/queue/rotational");
+    if (rt==-1) // partition, its queue/ is in the whole disk directory
+        rt=read_sysfs_flag (string(dir) + "/../queue/rotational");
+    return rt;
+};
+
+// physical position of the first byte of file, or -1 if filesystem can't tell (or file is empty, or inline)
+static uint64_t first_extent (int fd)
+{
+#ifdef __linux__
+    union
+    {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    memset (&u, 0, sizeof(u));
+    u.fm.fm_start=0;
+    u.fm.fm_length=FIEMAP_MAX_OFFSET;
+    u.fm.fm_extent_count=1;
+
+    if (ioctl (fd, FS_IOC_FIEMAP, &u.fm)==0 && u.fm.fm_mapped_extents==1 &&
+            (u.fm.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))==0)
+        return u.fm.fm_extents[0].fe_physical;
+#endif
+    return UINT64_MAX;
+};
+
+static uint64_t first_extent (const Hash_job & job)
+{
+    Dir_handle dir;
+    if (get_dir_handle (*job.dir_name, dir)==false)
+        return UINT64_MAX;
+    int fd=openat (dir, to_native (*job.file_name).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd==-1)
+        return UINT64_MAX;
+    uint64_t rt=first_extent (fd);
+    close (fd);
+    return rt;
+};
+
+// positions of files seen so far, from all threads. sorted by (device, inode) before lookups
+struct Known_extent
+{
+    dev_t dev;
+    uint64_t inode;
+    uint64_t physical;
+
+    bool operator< (const Known_extent & o) const { return dev!=o.dev ? dev<o.dev : inode<o.inode; };
+};
+static mutex known_extents_lock;
+static vector<Known_extent> known_extents;
+static size_t known_extents_sorted=0; // first ones
+
+void remember_extent (const Device_queue & q, uint64_t inode, int fd)
+{
+    if (options.order!=Options::ORDER_EXTENT || q.rotational==false || inode==0)
+        return;
+    Known_extent e{q.dev, inode, first_extent (fd)};
+    lock_guard<mutex> l(known_extents_lock);
+    known_extents.push_back (e);
+};
+
+static bool find_extent (dev_t dev, uint64_t inode, uint64_t & out)
+{
+    lock_guard<mutex> l(known_extents_lock);
+    if (known_extents_sorted<known_extents.size())
+    {
+        sort (known_extents.begin(), known_extents.end());
+        known_extents_sorted=known_extents.size();
+    };
+    Known_extent key{dev, inode, 0};
+    auto i=lower_bound (known_extents.begin(), known_extents.end(), key);
+    if (i==known_extents.end() || i->dev!=dev || i->inode!=inode)
+        return false;
+    out=i->physical;
+    return true;
+};
+
+// on spinning disk, reading files in directory order (or hash order) means a seek for each one.
+// inode numbers mostly grow along the disk on ext4/xfs, so sorting by them is almost as good
+// as sorting by physical position, and costs nothing. FIEMAP gives the exact position, but file must be
+// opened: positions are remembered by stage 2 (which opens files anyway), and those not known yet
+// are taken here, depth of them at once, so disk's own queue (NCQ) orders metadata reads
+static void order_by_layout (const vector<Hash_job> & jobs, Device_queue & q)
+{
+    if (options.order==Options::ORDER_NONE)
+        return;
+
+    // sort by inode first in any case: FIEMAP opens then go in the inode table order too
+    stable_sort (q.jobs.begin(), q.jobs.end(), [&](size_t a, size_t b) { return jobs[a].inode < jobs[b].inode; });
+
+    if (options.order==Options::ORDER_EXTENT)
+    {
+        vector<pair<uint64_t, size_t>> keys; // (physical position, job)
+        vector<size_t> unknown; // in keys
+        keys.reserve (q.jobs.size());
+        for (auto &j : q.jobs)
+        {
+            uint64_t physical;
+            if (jobs[j].inode==0 || find_extent (q.dev, jobs[j].inode, physical)==false)
+            {
+                unknown.push_back (keys.size());
+                physical=UINT64_MAX;
+            };
+            keys.push_back (make_pair (physical, j));
+        };
+
+        atomic<size_t> next (0);
+        auto taker=[&]()
+        {
+            size_t i;
+            while ((i=next++) < unknown.size())
+            {
+                pair<uint64_t, size_t> & k=keys[unknown[i]];
+                k.first=first_extent (jobs[k.second]);
+                if (jobs[k.second].inode!=0)
+                {
+                    lock_guard<mutex> l(known_extents_lock);
+                    known_extents.push_back (Known_extent{q.dev, jobs[k.second].inode, k.first});
+                };
+            };
+        };
+        vector<thread> takers;
+        for (unsigned t=1; t<q.depth && t<unknown.size(); t++)
+            takers.push_back (thread (taker));
+        taker();
+        for (auto &t : takers)
+            t.join();
+
+        stable_sort (keys.begin(), keys.end(), [](const pair<uint64_t, size_t> & a, const pair<uint64_t, size_t> & b) { return a.first < b.first; });
+        for (size_t i=0; i<keys.size(); i++)
+            q.jobs[i]=keys[i].second;
+    };
+};
+
+vector<Device_queue> group_jobs_by_device (const vector<Hash_job> & jobs)
+{
+    map<const wstring*, dev_t> dir_devs; // directory name address -> device
+    map<dev_t, size_t> queue_of_dev;
+    vector<Device_queue> rt;
+
+    for (size_t i=0; i<jobs.size(); i++)
+    {
+        auto d=dir_devs.find (jobs[i].dir_name);
+        if (d==dir_devs.end())
+        {
+            struct stat st;
+            dev_t dev=0;
+            if (stat (to_native (*jobs[i].dir_name).c_str(), &st)==0)
+                dev=st.st_dev;
+            d=dir_devs.insert (make_pair (jobs[i].dir_name, dev)).first;
+        };
+
+        auto q=queue_of_dev.find (d->second);
+        if (q==queue_of_dev.end())
+        {
+            Device_queue n;
+            n.dev=d->second;
+            int rot=device_is_rotational (n.dev);
+            n.rotational=(rot==1);
+            n.streams=rot==1 ? HDD_STREAMS : rot==0 ? SSD_STREAMS : OTHER_STREAMS;
+            n.depth=rot==1 ? HDD_DEPTH : rot==0 ? SSD_DEPTH : OTHER_DEPTH;
+            rt.push_back (n);
+            q=queue_of_dev.insert (make_pair (n.dev, rt.size()-1)).first;
+        };
+
+        rt[q->second].jobs.push_back (i);
+    };
+
+    // all spinning disks at once
+    vector<thread> orderers;
+    for (auto &q : rt)
+        if (q.rotational)
+            orderers.push_back (thread (order_by_layout, cref (jobs), ref (q)));
+    for (auto &t : orderers)
+        t.join();
+
+    return rt;
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
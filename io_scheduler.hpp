@@ -0,0 +1,42 @@
+#pragma once
+
+// Files to be hashed are grouped by the device they are stored on, and each device gets its own
+// queue with its own concurrency limit. All devices are read at the same time, so scanning several
+// disks at once is as fast as the sum of disks, not as one disk at a time.
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+
+#include <vector>
+#include <atomic>
+
+#include "utils.hpp"
+
+using namespace std;
+
+struct Device_queue
+{
+    dev_t dev;
+    bool rotational; // spinning disk, seeks are expensive
+    unsigned streams; // sequential readers at stage 3
+    unsigned depth; // small random reads in flight at stage 2
+    vector<size_t> jobs; // indices in Hash_job vector, in reading order
+    atomic<size_t> next; // next index in jobs[] to be taken
+    unsigned in_flight; // for single-threaded schedulers
+
+    Device_queue() { next=0; in_flight=0; };
+    Device_queue (const Device_queue & q) : dev(q.dev), rotational(q.rotational), streams(q.streams), depth(q.depth), jobs(q.jobs), in_flight(q.in_flight) { next=q.next.load(); };
+};
+
+// jobs whose directory can't be stat'ed are put into queue of device 0, they will fail later anyway
+// jobs of spinning disks are sorted by physical layout, as set by options.order
+vector<Device_queue> group_jobs_by_device (const vector<Hash_job> & jobs);
+
+// with --order=extent: physical position of file of spinning disk is taken while it's open anyway (stage 2),
+// so next stages order it without opening it once more
+void remember_extent (const Device_queue & q, uint64_t inode, int fd);
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
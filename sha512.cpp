@@ -33,20 +33,39 @@
 # include "unlocked-io.h"
 #endif
 
+#if defined _MSC_VER
+# include <intrin.h>
+#endif
+
+/* Native 64-bit rotates and byte swaps: compilers make single
+   instructions of these.  */
+static inline uint64_t
+rotr64 (uint64_t x, int n)
+{
+#if defined _MSC_VER
+  return _rotr64 (x, n);
+#else
+  return (x >> n) | (x << (64 - n));
+#endif
+}
+
 #ifdef WORDS_BIGENDIAN
 # define SWAP(n) (n)
+#elif defined _MSC_VER
+# define SWAP(n) _byteswap_uint64 (n)
 #else
-# define SWAP(n) \
-    u64or (u64or (u64or (u64shl (n, 56),                                \
-                         u64shl (u64and (n, u64lo (0x0000ff00)), 40)),  \
-                  u64or (u64shl (u64and (n, u64lo (0x00ff0000)), 24),   \
-                         u64shl (u64and (n, u64lo (0xff000000)),  8))), \
-           u64or (u64or (u64and (u64shr (n,  8), u64lo (0xff000000)),   \
-                         u64and (u64shr (n, 24), u64lo (0x00ff0000))),  \
-                  u64or (u64and (u64shr (n, 40), u64lo (0x0000ff00)),   \
-                         u64shr (n, 56))))
+# define SWAP(n) __builtin_bswap64 (n)
 #endif
 
+/* Big endian word at P, which may be unaligned.  */
+static inline uint64_t
+load_be64 (const unsigned char *p)
+{
+  uint64_t v;
+  memcpy (&v, p, sizeof v);
+  return SWAP (v);
+}
+
 #define BLOCKSIZE 32768
 #if BLOCKSIZE % 128 != 0
 # error "invalid BLOCKSIZE"
@@ -423,7 +442,7 @@ sha512_process_bytes (const void *buffer, size_t len, struct sha512_ctx *ctx)
 
 /* SHA512 round constants */
 #define K(I) sha512_round_constants[I]
-static u64 const sha512_round_constants[80] = {
+u64 const sha512_round_constants[80] = {
   u64init (0x428a2f98, 0xd728ae22), u64init (0x71374491, 0x23ef65cd),
   u64init (0xb5c0fbcf, 0xec4d3b2f), u64init (0xe9b5dba5, 0x8189dbbc),
   u64init (0x3956c25b, 0xf348b538), u64init (0x59f111f1, 0xb605d019),
@@ -467,27 +486,322 @@ static u64 const sha512_round_constants[80] = {
 };
 
 /* Round functions.  */
-#define F2(A, B, C) u64or (u64and (A, B), u64and (C, u64or (A, B)))
-#define F1(E, F, G) u64xor (G, u64and (E, u64xor (F, G)))
+#define CH(E, F, G) ((G) ^ ((E) & ((F) ^ (G))))
+#define SUM0(x) (rotr64 (x, 28) ^ rotr64 (x, 34) ^ rotr64 (x, 39))
+#define SUM1(x) (rotr64 (x, 14) ^ rotr64 (x, 18) ^ rotr64 (x, 41))
+#define SIG0(x) (rotr64 (x, 1) ^ rotr64 (x, 8) ^ ((x) >> 7))
+#define SIG1(x) (rotr64 (x, 19) ^ rotr64 (x, 61) ^ ((x) >> 6))
+
+/* One round, WK is W[t] + K[t].  Maj (A, B, C) is B ^ ((A ^ B) & (B ^ C)):
+   A ^ B of this round is B ^ C of the next one, so it's saved into AB
+   and used as BC there.  */
+#define R(A, B, C, D, E, F, G, H, WK, AB, BC)                             \
+  do                                                                      \
+    {                                                                     \
+      uint64_t t1 = H + SUM1 (E) + CH (E, F, G) + (WK);                   \
+      AB = A ^ B;                                                         \
+      D += t1;                                                            \
+      H = t1 + SUM0 (A) + (B ^ (AB & BC));                                \
+    }                                                                     \
+  while (0)
+
+/* Eight rounds, after which the variables are in their places again.
+   AB and BC swap their roles every round.  */
+#define R8(I, WK)                                                         \
+  do                                                                      \
+    {                                                                     \
+      R (a, b, c, d, e, f, g, h, WK ((I) + 0), ab, bc);                   \
+      R (h, a, b, c, d, e, f, g, WK ((I) + 1), bc, ab);                   \
+      R (g, h, a, b, c, d, e, f, WK ((I) + 2), ab, bc);                   \
+      R (f, g, h, a, b, c, d, e, WK ((I) + 3), bc, ab);                   \
+      R (e, f, g, h, a, b, c, d, WK ((I) + 4), ab, bc);                   \
+      R (d, e, f, g, h, a, b, c, WK ((I) + 5), bc, ab);                   \
+      R (c, d, e, f, g, h, a, b, WK ((I) + 6), ab, bc);                   \
+      R (b, c, d, e, f, g, h, a, WK ((I) + 7), bc, ab);                   \
+    }                                                                     \
+  while (0)
+
+/* Kernels: process N 128-byte blocks at P (which may be unaligned) into
+   STATE.  One of them is picked at startup, see sha512_pick_blocks.  */
+typedef void (*sha512_blocks_fn) (uint64_t *state, const unsigned char *p,
+                                  size_t n);
+
+/* Portable one: rounds are unrolled at compile time, message schedule is
+   kept in ring of 16 words.  */
+static void
+sha512_blocks_generic (uint64_t *state, const unsigned char *p, size_t n)
+{
+  for (; n > 0; n--, p += 128)
+    {
+      uint64_t x[16];
+      uint64_t a = state[0];
+      uint64_t b = state[1];
+      uint64_t c = state[2];
+      uint64_t d = state[3];
+      uint64_t e = state[4];
+      uint64_t f = state[5];
+      uint64_t g = state[6];
+      uint64_t h = state[7];
+      uint64_t ab, bc = b ^ c;
+
+#define W0(I) (K (I) + (x[I] = load_be64 (p + (I) * 8)))
+#define W(I) (K (I) + (x[(I) & 15] += SIG1 (x[((I) - 2) & 15])          \
+                                      + x[((I) - 7) & 15]                 \
+                                      + SIG0 (x[((I) - 15) & 15])))
+      R8 (0, W0);
+      R8 (8, W0);
+      R8 (16, W);
+      R8 (24, W);
+      R8 (32, W);
+      R8 (40, W);
+      R8 (48, W);
+      R8 (56, W);
+      R8 (64, W);
+      R8 (72, W);
+#undef W0
+#undef W
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+    }
+}
+
+#if defined __x86_64__ || defined _M_X64
+# define SHA512_X86 1
+# include <immintrin.h>
+# if defined __GNUC__
+#  include <cpuid.h>
+#  define TARGET(t) __attribute__ ((target (t)))
+# else
+#  define TARGET(t)
+# endif
+#endif
+
+#ifdef SHA512_X86
+
+/* Message schedule for two blocks at once, in 256-bit vectors: W[2i] and
+   W[2i+1] of the first block are in low half of W[i], of the second one
+   in high half (sigma1 of W[t-2] is needed for W[t], so there can't be
+   more than two words of a block in a vector).  Each step makes one
+   vector, adds K to it and stores it into WK[0] and WK[1].  Steps for next
+   two blocks are interleaved with rounds of current two, so vector units
+   work while scalar ones do rounds.  */
+struct sha512_sched
+{
+  __m256i w[40];
+  const unsigned char *p, *q;   /* the two blocks, the same if only one */
+  int i;                        /* next step */
+};
+
+TARGET ("avx2") static inline __m256i
+vrotr64 (__m256i x, int n)
+{
+  return _mm256_or_si256 (_mm256_srli_epi64 (x, n),
+                          _mm256_slli_epi64 (x, 64 - n));
+}
+
+TARGET ("avx2") static inline void
+sha512_sched_step (struct sha512_sched *s, uint64_t wk[2][80])
+{
+  const __m256i bswap = _mm256_set_epi8 (8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7);
+  int i = s->i++;
+  __m256i v;
+
+  if (i < 8)
+    v = _mm256_shuffle_epi8 (_mm256_inserti128_si256 (
+          _mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) (s->p + i * 16))),
+          _mm_loadu_si128 ((const __m128i *) (s->q + i * 16)), 1), bswap);
+  else
+    {
+      __m256i w2 = s->w[i - 1];
+      /* W[t-7] and W[t-15] straddle two vectors */
+      __m256i w7 = _mm256_alignr_epi8 (s->w[i - 3], s->w[i - 4], 8);
+      __m256i w15 = _mm256_alignr_epi8 (s->w[i - 7], s->w[i - 8], 8);
+      __m256i s1 = _mm256_xor_si256 (_mm256_xor_si256 (vrotr64 (w2, 19), vrotr64 (w2, 61)),
+                                     _mm256_srli_epi64 (w2, 6));
+      __m256i s0 = _mm256_xor_si256 (_mm256_xor_si256 (vrotr64 (w15, 1), vrotr64 (w15, 8)),
+                                     _mm256_srli_epi64 (w15, 7));
+      v = _mm256_add_epi64 (_mm256_add_epi64 (s1, w7),
+                            _mm256_add_epi64 (s0, s->w[i - 8]));
+    }
+  s->w[i] = v;
+
+  v = _mm256_add_epi64 (v, _mm256_broadcastsi128_si256 (
+        _mm_loadu_si128 ((const __m128i *) &K (2 * i))));
+  _mm_storeu_si128 ((__m128i *) &wk[0][2 * i], _mm256_castsi256_si128 (v));
+  _mm_storeu_si128 ((__m128i *) &wk[1][2 * i], _mm256_extracti128_si256 (v, 1));
+}
+
+/* AVX2 message schedule, rounds are scalar (with BMI2 rotates).  */
+TARGET ("avx2,bmi2") static void
+sha512_blocks_avx2 (uint64_t *state, const unsigned char *p, size_t n)
+{
+  uint64_t wk[2][2][80];        /* current and next two blocks */
+  struct sha512_sched s;
+  int cur = 0;
+
+  if (n == 0)
+    return;
+
+  s.p = p;
+  s.q = n > 1 ? p + 128 : p;
+  s.i = 0;
+  while (s.i < 40)
+    sha512_sched_step (&s, wk[0]);
+
+  while (n > 0)
+    {
+      size_t here = n > 1 ? 2 : 1, blk;
+      int more = n > here;
+
+      if (more)
+        {
+          s.p = p + here * 128;
+          s.q = n - here > 1 ? s.p + 128 : s.p;
+          s.i = 0;
+        }
+
+      /* 2 steps per 8 rounds: all 40 are done by the end of second block */
+      for (blk = 0; blk < here; blk++)
+        {
+          const uint64_t *w = wk[cur][blk];
+          uint64_t a = state[0];
+          uint64_t b = state[1];
+          uint64_t c = state[2];
+          uint64_t d = state[3];
+          uint64_t e = state[4];
+          uint64_t f = state[5];
+          uint64_t g = state[6];
+          uint64_t h = state[7];
+          uint64_t ab, bc = b ^ c;
+
+#define WK(I) w[I]
+#define R8S(I)                                                            \
+          R8 (I, WK);                                                     \
+          if (more)                                                       \
+            {                                                             \
+              sha512_sched_step (&s, wk[cur ^ 1]);                        \
+              sha512_sched_step (&s, wk[cur ^ 1]);                        \
+            }
+          R8S (0);
+          R8S (8);
+          R8S (16);
+          R8S (24);
+          R8S (32);
+          R8S (40);
+          R8S (48);
+          R8S (56);
+          R8S (64);
+          R8S (72);
+#undef R8S
+#undef WK
+
+          state[0] += a;
+          state[1] += b;
+          state[2] += c;
+          state[3] += d;
+          state[4] += e;
+          state[5] += f;
+          state[6] += g;
+          state[7] += h;
+        }
+
+      n -= here;
+      p += here * 128;
+      cur ^= 1;
+    }
+}
+
+static void
+sha512_cpuid (unsigned leaf, unsigned subleaf, unsigned r[4])
+{
+# if defined _MSC_VER
+  __cpuidex ((int *) r, leaf, subleaf);
+# else
+  if (__get_cpuid_max (leaf & 0x80000000, NULL) < leaf)
+    r[0] = r[1] = r[2] = r[3] = 0;
+  else
+    __cpuid_count (leaf, subleaf, r[0], r[1], r[2], r[3]);
+# endif
+}
+
+/* Whether CPU has AVX2 and BMI2, and OS saves YMM registers.  */
+static int
+sha512_have_avx2 (void)
+{
+  unsigned r[4];
+  uint64_t xcr0;
+
+  sha512_cpuid (1, 0, r);
+  if (!(r[2] & (1u << 27)))     /* OSXSAVE */
+    return 0;
+# if defined _MSC_VER
+  xcr0 = _xgetbv (0);
+# else
+  {
+    unsigned lo, hi;
+    __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    xcr0 = ((uint64_t) hi << 32) | lo;
+  }
+# endif
+  if ((xcr0 & 6) != 6)          /* XMM and YMM state */
+    return 0;
+
+  sha512_cpuid (7, 0, r);
+  return (r[1] & (1u << 5)) && (r[1] & (1u << 8));      /* AVX2, BMI2 */
+}
+
+#endif /* SHA512_X86 */
+
+/* The fastest kernel this CPU has.  Each one is checked against the
+   portable one before it's used (and the portable one is checked by
+   sha512_test()), so a kernel which is wrong on some CPU or compiler is
+   just not used there.  */
+static sha512_blocks_fn
+sha512_pick_blocks (void)
+{
+#ifdef SHA512_X86
+  sha512_blocks_fn candidates[1];
+  size_t count = 0, i, j;
+  unsigned char data[3 * 128 + 1];      /* odd number of unaligned blocks */
+
+  if (sha512_have_avx2 ())
+    candidates[count++] = sha512_blocks_avx2;
+
+  for (i = 0; i < sizeof data; i++)
+    data[i] = (unsigned char) (i * 131 + (i >> 3));
+
+  for (i = 0; i < count; i++)
+    {
+      uint64_t expected[8], got[8];
+      for (j = 0; j < 8; j++)
+        expected[j] = got[j] = K (j);
+      sha512_blocks_generic (expected, data + 1, 3);
+      candidates[i] (got, data + 1, 3);
+      if (memcmp (expected, got, sizeof got) == 0)
+        return candidates[i];
+    }
+#endif
+  return sha512_blocks_generic;
+}
+
+static const sha512_blocks_fn sha512_blocks = sha512_pick_blocks ();
 
 /* Process LEN bytes of BUFFER, accumulating context into CTX.
-   It is assumed that LEN % 128 == 0.
-   Most of this code comes from GnuPG's cipher/sha1.c.  */
+   It is assumed that LEN % 128 == 0.  BUFFER may be unaligned.  */
 
 void
 sha512_process_block (const void *buffer, size_t len, struct sha512_ctx *ctx)
 {
-  u64 const *words = (const u64*)buffer;
-  u64 const *endp = words + len / sizeof (u64);
-  u64 x[16];
-  u64 a = ctx->state[0];
-  u64 b = ctx->state[1];
-  u64 c = ctx->state[2];
-  u64 d = ctx->state[3];
-  u64 e = ctx->state[4];
-  u64 f = ctx->state[5];
-  u64 g = ctx->state[6];
-  u64 h = ctx->state[7];
   u64 lolen = u64size (len);
 
   /* First increment the byte count.  FIPS PUB 180-2 specifies the possible
@@ -498,127 +812,5 @@ sha512_process_block (const void *buffer, size_t len, struct sha512_ctx *ctx)
                            u64plus (u64size (len >> 31 >> 31 >> 2),
                                     u64lo (u64lt (ctx->total[0], lolen))));
 
-#define S0(x) u64xor (u64rol(x, 63), u64xor (u64rol (x, 56), u64shr (x, 7)))
-#define S1(x) u64xor (u64rol (x, 45), u64xor (u64rol (x, 3), u64shr (x, 6)))
-#define SS0(x) u64xor (u64rol (x, 36), u64xor (u64rol (x, 30), u64rol (x, 25)))
-#define SS1(x) u64xor (u64rol(x, 50), u64xor (u64rol (x, 46), u64rol (x, 23)))
-
-#define M(I) (x[(I) & 15]                                                 \
-              = u64plus (x[(I) & 15],                                     \
-                         u64plus (S1 (x[((I) - 2) & 15]),                 \
-                                  u64plus (x[((I) - 7) & 15],             \
-                                           S0 (x[((I) - 15) & 15])))))
-
-#define R(A, B, C, D, E, F, G, H, K, M)                                   \
-  do                                                                      \
-    {                                                                     \
-      u64 t0 = u64plus (SS0 (A), F2 (A, B, C));                           \
-      u64 t1 =                                                            \
-        u64plus (H, u64plus (SS1 (E),                                     \
-                             u64plus (F1 (E, F, G), u64plus (K, M))));    \
-      D = u64plus (D, t1);                                                \
-      H = u64plus (t0, t1);                                               \
-    }                                                                     \
-  while (0)
-
-  while (words < endp)
-    {
-      int t;
-      /* FIXME: see sha1.c for a better implementation.  */
-      for (t = 0; t < 16; t++)
-        {
-          x[t] = SWAP (*words);
-          words++;
-        }
-
-      R( a, b, c, d, e, f, g, h, K( 0), x[ 0] );
-      R( h, a, b, c, d, e, f, g, K( 1), x[ 1] );
-      R( g, h, a, b, c, d, e, f, K( 2), x[ 2] );
-      R( f, g, h, a, b, c, d, e, K( 3), x[ 3] );
-      R( e, f, g, h, a, b, c, d, K( 4), x[ 4] );
-      R( d, e, f, g, h, a, b, c, K( 5), x[ 5] );
-      R( c, d, e, f, g, h, a, b, K( 6), x[ 6] );
-      R( b, c, d, e, f, g, h, a, K( 7), x[ 7] );
-      R( a, b, c, d, e, f, g, h, K( 8), x[ 8] );
-      R( h, a, b, c, d, e, f, g, K( 9), x[ 9] );
-      R( g, h, a, b, c, d, e, f, K(10), x[10] );
-      R( f, g, h, a, b, c, d, e, K(11), x[11] );
-      R( e, f, g, h, a, b, c, d, K(12), x[12] );
-      R( d, e, f, g, h, a, b, c, K(13), x[13] );
-      R( c, d, e, f, g, h, a, b, K(14), x[14] );
-      R( b, c, d, e, f, g, h, a, K(15), x[15] );
-      R( a, b, c, d, e, f, g, h, K(16), M(16) );
-      R( h, a, b, c, d, e, f, g, K(17), M(17) );
-      R( g, h, a, b, c, d, e, f, K(18), M(18) );
-      R( f, g, h, a, b, c, d, e, K(19), M(19) );
-      R( e, f, g, h, a, b, c, d, K(20), M(20) );
-      R( d, e, f, g, h, a, b, c, K(21), M(21) );
-      R( c, d, e, f, g, h, a, b, K(22), M(22) );
-      R( b, c, d, e, f, g, h, a, K(23), M(23) );
-      R( a, b, c, d, e, f, g, h, K(24), M(24) );
-      R( h, a, b, c, d, e, f, g, K(25), M(25) );
-      R( g, h, a, b, c, d, e, f, K(26), M(26) );
-      R( f, g, h, a, b, c, d, e, K(27), M(27) );
-      R( e, f, g, h, a, b, c, d, K(28), M(28) );
-      R( d, e, f, g, h, a, b, c, K(29), M(29) );
-      R( c, d, e, f, g, h, a, b, K(30), M(30) );
-      R( b, c, d, e, f, g, h, a, K(31), M(31) );
-      R( a, b, c, d, e, f, g, h, K(32), M(32) );
-      R( h, a, b, c, d, e, f, g, K(33), M(33) );
-      R( g, h, a, b, c, d, e, f, K(34), M(34) );
-      R( f, g, h, a, b, c, d, e, K(35), M(35) );
-      R( e, f, g, h, a, b, c, d, K(36), M(36) );
-      R( d, e, f, g, h, a, b, c, K(37), M(37) );
-      R( c, d, e, f, g, h, a, b, K(38), M(38) );
-      R( b, c, d, e, f, g, h, a, K(39), M(39) );
-      R( a, b, c, d, e, f, g, h, K(40), M(40) );
-      R( h, a, b, c, d, e, f, g, K(41), M(41) );
-      R( g, h, a, b, c, d, e, f, K(42), M(42) );
-      R( f, g, h, a, b, c, d, e, K(43), M(43) );
-      R( e, f, g, h, a, b, c, d, K(44), M(44) );
-      R( d, e, f, g, h, a, b, c, K(45), M(45) );
-      R( c, d, e, f, g, h, a, b, K(46), M(46) );
-      R( b, c, d, e, f, g, h, a, K(47), M(47) );
-      R( a, b, c, d, e, f, g, h, K(48), M(48) );
-      R( h, a, b, c, d, e, f, g, K(49), M(49) );
-      R( g, h, a, b, c, d, e, f, K(50), M(50) );
-      R( f, g, h, a, b, c, d, e, K(51), M(51) );
-      R( e, f, g, h, a, b, c, d, K(52), M(52) );
-      R( d, e, f, g, h, a, b, c, K(53), M(53) );
-      R( c, d, e, f, g, h, a, b, K(54), M(54) );
-      R( b, c, d, e, f, g, h, a, K(55), M(55) );
-      R( a, b, c, d, e, f, g, h, K(56), M(56) );
-      R( h, a, b, c, d, e, f, g, K(57), M(57) );
-      R( g, h, a, b, c, d, e, f, K(58), M(58) );
-      R( f, g, h, a, b, c, d, e, K(59), M(59) );
-      R( e, f, g, h, a, b, c, d, K(60), M(60) );
-      R( d, e, f, g, h, a, b, c, K(61), M(61) );
-      R( c, d, e, f, g, h, a, b, K(62), M(62) );
-      R( b, c, d, e, f, g, h, a, K(63), M(63) );
-      R( a, b, c, d, e, f, g, h, K(64), M(64) );
-      R( h, a, b, c, d, e, f, g, K(65), M(65) );
-      R( g, h, a, b, c, d, e, f, K(66), M(66) );
-      R( f, g, h, a, b, c, d, e, K(67), M(67) );
-      R( e, f, g, h, a, b, c, d, K(68), M(68) );
-      R( d, e, f, g, h, a, b, c, K(69), M(69) );
-      R( c, d, e, f, g, h, a, b, K(70), M(70) );
-      R( b, c, d, e, f, g, h, a, K(71), M(71) );
-      R( a, b, c, d, e, f, g, h, K(72), M(72) );
-      R( h, a, b, c, d, e, f, g, K(73), M(73) );
-      R( g, h, a, b, c, d, e, f, K(74), M(74) );
-      R( f, g, h, a, b, c, d, e, K(75), M(75) );
-      R( e, f, g, h, a, b, c, d, K(76), M(76) );
-      R( d, e, f, g, h, a, b, c, K(77), M(77) );
-      R( c, d, e, f, g, h, a, b, K(78), M(78) );
-      R( b, c, d, e, f, g, h, a, K(79), M(79) );
-
-      a = ctx->state[0] = u64plus (ctx->state[0], a);
-      b = ctx->state[1] = u64plus (ctx->state[1], b);
-      c = ctx->state[2] = u64plus (ctx->state[2], c);
-      d = ctx->state[3] = u64plus (ctx->state[3], d);
-      e = ctx->state[4] = u64plus (ctx->state[4], e);
-      f = ctx->state[5] = u64plus (ctx->state[5], f);
-      g = ctx->state[6] = u64plus (ctx->state[6], g);
-      h = ctx->state[7] = u64plus (ctx->state[7], h);
-    }
+  sha512_blocks (ctx->state, (const unsigned char *) buffer, len / 128);
 }
@@ -39,6 +39,9 @@ struct sha512_ctx
 enum { SHA384_DIGEST_SIZE = 384 / 8 };
 enum { SHA512_DIGEST_SIZE = 512 / 8 };
 
+/* SHA512 round constants, for other implementations (see sha512_mb.hpp).  */
+extern const u64 sha512_round_constants[80];
+
 /* Initialize structure containing state of computation. */
 extern void sha512_init_ctx (struct sha512_ctx *ctx);
 extern void sha384_init_ctx (struct sha512_ctx *ctx);
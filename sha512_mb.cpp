@@ -0,0 +1,376 @@
+// Multi-buffer SHA512, see sha512_mb.hpp
+
+#include <string.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#include "sha512_mb.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SHA512_MB_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(t)
+#else
+#include <cpuid.h>
+#define TARGET(t) __attribute__ ((target (t)))
+#endif
+#endif
+
+using namespace std;
+
+#define K(i) sha512_round_constants[i]
+
+// state of all lanes: word j of lane i is state[j][i], so each word of all lanes is one vector
+typedef uint64_t Mb_state[8][SHA512_MB_MAX_LANES];
+
+// one block of each lane, blocks[i] may be unaligned
+typedef void (*Mb_kernel) (Mb_state & state, const uint8_t* const* blocks);
+
+#ifdef SHA512_MB_X86
+
+// words of blocks are gathered by their offsets from the first block
+#define BSWAP64_BYTES 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7
+
+TARGET("avx2") static inline __m256i rotr4 (__m256i x, int n)
+{
+    return _mm256_or_si256 (_mm256_srli_epi64 (x, n), _mm256_slli_epi64 (x, 64-n));
+};
+
+TARGET("avx2") static inline __m256i xor4 (__m256i a, __m256i b, __m256i c)
+{
+    return _mm256_xor_si256 (_mm256_xor_si256 (a, b), c);
+};
+
+// 4 lanes, AVX2 has no rotates: each one is two shifts and OR
+TARGET("avx2") static void sha512_mb_avx2 (Mb_state & state, const uint8_t* const* blocks)
+{
+    const __m256i bswap=_mm256_set_epi8 (BSWAP64_BYTES, BSWAP64_BYTES);
+    __m256i offsets=_mm256_set_epi64x (blocks[3]-blocks[0], blocks[2]-blocks[0], blocks[1]-blocks[0], 0);
+    __m256i w[16];
+
+    for (int t=0; t<16; t++)
+        w[t]=_mm256_shuffle_epi8 (_mm256_i64gather_epi64 ((const long long*)(blocks[0]+t*8), offsets, 1), bswap);
+
+    __m256i v[8];
+    for (int j=0; j<8; j++)
+        v[j]=_mm256_load_si256 ((const __m256i*)state[j]);
+    __m256i a=v[0], b=v[1], c=v[2], d=v[3], e=v[4], f=v[5], g=v[6], h=v[7];
+
+    for (int t=0; t<80; t++)
+    {
+        if (t>=16)
+        {
+            __m256i w2=w[(t-2) & 15], w15=w[(t-15) & 15];
+            __m256i s0=xor4 (rotr4 (w15, 1), rotr4 (w15, 8), _mm256_srli_epi64 (w15, 7));
+            __m256i s1=xor4 (rotr4 (w2, 19), rotr4 (w2, 61), _mm256_srli_epi64 (w2, 6));
+            w[t & 15]=_mm256_add_epi64 (_mm256_add_epi64 (w[t & 15], s0), _mm256_add_epi64 (w[(t-7) & 15], s1));
+        };
+        __m256i ch=_mm256_xor_si256 (g, _mm256_and_si256 (e, _mm256_xor_si256 (f, g)));
+        __m256i maj=_mm256_or_si256 (_mm256_and_si256 (a, b), _mm256_and_si256 (c, _mm256_or_si256 (a, b)));
+        __m256i t1=_mm256_add_epi64 (_mm256_add_epi64 (h, xor4 (rotr4 (e, 14), rotr4 (e, 18), rotr4 (e, 41))),
+                _mm256_add_epi64 (_mm256_add_epi64 (ch, w[t & 15]), _mm256_set1_epi64x (K(t))));
+        __m256i t2=_mm256_add_epi64 (xor4 (rotr4 (a, 28), rotr4 (a, 34), rotr4 (a, 39)), maj);
+        h=g; g=f; f=e; e=_mm256_add_epi64 (d, t1);
+        d=c; c=b; b=a; a=_mm256_add_epi64 (t1, t2);
+    };
+
+    v[0]=_mm256_add_epi64 (v[0], a); v[1]=_mm256_add_epi64 (v[1], b);
+    v[2]=_mm256_add_epi64 (v[2], c); v[3]=_mm256_add_epi64 (v[3], d);
+    v[4]=_mm256_add_epi64 (v[4], e); v[5]=_mm256_add_epi64 (v[5], f);
+    v[6]=_mm256_add_epi64 (v[6], g); v[7]=_mm256_add_epi64 (v[7], h);
+    for (int j=0; j<8; j++)
+        _mm256_store_si256 ((__m256i*)state[j], v[j]);
+};
+
+// intrinsics of GCC 12 make "undefined" vectors of themselves, and -Wall warns about that
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// truth tables for _mm512_ternarylogic_epi64()
+#define TERNLOG_XOR3 0x96
+#define TERNLOG_CH 0xCA // first ? second : third
+#define TERNLOG_MAJ 0xE8
+
+TARGET("avx512f,avx512bw") static inline __m512i xor8 (__m512i a, __m512i b, __m512i c)
+{
+    return _mm512_ternarylogic_epi64 (a, b, c, TERNLOG_XOR3);
+};
+
+// 8 lanes, with native rotates and three-input logic
+TARGET("avx512f,avx512bw") static void sha512_mb_avx512 (Mb_state & state, const uint8_t* const* blocks)
+{
+    const __m512i bswap=_mm512_set_epi8 (BSWAP64_BYTES, BSWAP64_BYTES, BSWAP64_BYTES, BSWAP64_BYTES);
+    __m512i offsets=_mm512_set_epi64 (blocks[7]-blocks[0], blocks[6]-blocks[0], blocks[5]-blocks[0], blocks[4]-blocks[0],
+            blocks[3]-blocks[0], blocks[2]-blocks[0], blocks[1]-blocks[0], 0);
+    __m512i w[16];
+
+    for (int t=0; t<16; t++)
+        w[t]=_mm512_shuffle_epi8 (_mm512_i64gather_epi64 (offsets, (const long long*)(blocks[0]+t*8), 1), bswap);
+
+    __m512i v[8];
+    for (int j=0; j<8; j++)
+        v[j]=_mm512_load_si512 ((const void*)state[j]);
+    __m512i a=v[0], b=v[1], c=v[2], d=v[3], e=v[4], f=v[5], g=v[6], h=v[7];
+
+    for (int t=0; t<80; t++)
+    {
+        if (t>=16)
+        {
+            __m512i w2=w[(t-2) & 15], w15=w[(t-15) & 15];
+            __m512i s0=xor8 (_mm512_ror_epi64 (w15, 1), _mm512_ror_epi64 (w15, 8), _mm512_srli_epi64 (w15, 7));
+            __m512i s1=xor8 (_mm512_ror_epi64 (w2, 19), _mm512_ror_epi64 (w2, 61), _mm512_srli_epi64 (w2, 6));
+            w[t & 15]=_mm512_add_epi64 (_mm512_add_epi64 (w[t & 15], s0), _mm512_add_epi64 (w[(t-7) & 15], s1));
+        };
+        __m512i t1=_mm512_add_epi64 (_mm512_add_epi64 (h, xor8 (_mm512_ror_epi64 (e, 14), _mm512_ror_epi64 (e, 18), _mm512_ror_epi64 (e, 41))),
+                _mm512_add_epi64 (_mm512_add_epi64 (_mm512_ternarylogic_epi64 (e, f, g, TERNLOG_CH), w[t & 15]), _mm512_set1_epi64 (K(t))));
+        __m512i t2=_mm512_add_epi64 (xor8 (_mm512_ror_epi64 (a, 28), _mm512_ror_epi64 (a, 34), _mm512_ror_epi64 (a, 39)),
+                _mm512_ternarylogic_epi64 (a, b, c, TERNLOG_MAJ));
+        h=g; g=f; f=e; e=_mm512_add_epi64 (d, t1);
+        d=c; c=b; b=a; a=_mm512_add_epi64 (t1, t2);
+    };
+
+    v[0]=_mm512_add_epi64 (v[0], a); v[1]=_mm512_add_epi64 (v[1], b);
+    v[2]=_mm512_add_epi64 (v[2], c); v[3]=_mm512_add_epi64 (v[3], d);
+    v[4]=_mm512_add_epi64 (v[4], e); v[5]=_mm512_add_epi64 (v[5], f);
+    v[6]=_mm512_add_epi64 (v[6], g); v[7]=_mm512_add_epi64 (v[7], h);
+    for (int j=0; j<8; j++)
+        _mm512_store_si512 ((void*)state[j], v[j]);
+};
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+static void cpuid (unsigned leaf, unsigned subleaf, unsigned r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex ((int*)r, leaf, subleaf);
+#else
+    if (__get_cpuid_max (0, NULL)<leaf)
+        r[0]=r[1]=r[2]=r[3]=0;
+    else
+        __cpuid_count (leaf, subleaf, r[0], r[1], r[2], r[3]);
+#endif
+};
+
+static size_t detect_lanes()
+{
+    unsigned r[4];
+    cpuid (1, 0, r);
+    if ((r[2] & (1u<<27))==0) // OS doesn't use XSAVE
+        return 1;
+
+    uint64_t xcr0;
+#ifdef _MSC_VER
+    xcr0=_xgetbv (0);
+#else
+    unsigned lo, hi;
+    __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    xcr0=((uint64_t)hi<<32) | lo;
+#endif
+
+    cpuid (7, 0, r);
+    bool avx2=(r[1] & (1u<<5))!=0;
+    bool avx512=(r[1] & (1u<<16)) && (r[1] & (1u<<30)); // F and BW
+    if (avx512 && (xcr0 & 0xE6)==0xE6) // OS saves ZMM registers too
+        return 8;
+    if (avx2 && (xcr0 & 6)==6)
+        return 4;
+    return 1;
+};
+
+#else
+
+static size_t detect_lanes()
+{
+    return 1;
+};
+
+#endif
+
+static const size_t lanes=detect_lanes();
+
+size_t sha512_mb_lanes()
+{
+    return lanes;
+};
+
+struct Mb_lane
+{
+    size_t msg; // SIZE_MAX if lane is idle
+    const uint8_t* p; // next block of message itself
+    size_t body_blocks; // whole blocks of message left
+    size_t tail_blocks, tail_pos; // the rest of message with padding, 1 or 2 blocks
+    uint8_t tail[256];
+};
+
+static void put_be64 (uint8_t* p, uint64_t v)
+{
+    for (int i=7; i>=0; i--, v>>=8)
+        p[i]=(uint8_t)v;
+};
+
+static struct sha512_ctx make_initial_ctx()
+{
+    struct sha512_ctx rt;
+    sha512_init_ctx (&rt);
+    return rt;
+};
+
+static const struct sha512_ctx initial=make_initial_ctx();
+
+static void start_message (Mb_lane & l, Mb_state & state, size_t i, size_t msg, const uint8_t* p, size_t len)
+{
+    for (int j=0; j<8; j++)
+        state[j][i]=initial.state[j];
+
+    l.msg=msg;
+    l.p=p;
+    l.body_blocks=len/128;
+
+    size_t rest=len%128;
+    l.tail_blocks=rest<112 ? 1 : 2;
+    l.tail_pos=0;
+    memset (l.tail, 0, sizeof(l.tail));
+    if (rest>0) // p may be NULL for empty message
+        memcpy (l.tail, p+len-rest, rest);
+    l.tail[rest]=0x80;
+    // length in bits, 128-bit big endian
+    put_be64 (l.tail+l.tail_blocks*128-16, (uint64_t)len>>61);
+    put_be64 (l.tail+l.tail_blocks*128-8, (uint64_t)len<<3);
+};
+
+void sha512_mb (size_t n, const uint8_t* const* msgs, const size_t* lens, uint8_t (*out)[SHA512_DIGEST_SIZE])
+{
+#ifdef SHA512_MB_X86
+    Mb_kernel kernel=lanes==8 ? sha512_mb_avx512 : sha512_mb_avx2;
+#else
+    Mb_kernel kernel=NULL;
+#endif
+    if (lanes==1 || n==1)
+    {
+        for (size_t m=0; m<n; m++)
+            sha512_buffer ((const char*)msgs[m], lens[m], out[m]);
+        return;
+    };
+
+    static const uint8_t idle_block[128]={0};
+#ifdef _MSC_VER
+    __declspec(align(64)) Mb_state state;
+#else
+    Mb_state state __attribute__ ((aligned (64)));
+#endif
+    Mb_lane lane[SHA512_MB_MAX_LANES];
+    const uint8_t* blocks[SHA512_MB_MAX_LANES];
+    size_t next=0, active=0;
+
+    for (size_t i=0; i<lanes; i++)
+    {
+        lane[i].msg=SIZE_MAX;
+        if (next<n)
+        {
+            start_message (lane[i], state, i, next, msgs[next], lens[next]);
+            next++;
+            active++;
+        };
+    };
+
+    while (active>0)
+    {
+        if (active==1 && next==n)
+        {
+            // vector units would be mostly idle: the last message goes on as usual,
+            // if it's not in its padding already
+            size_t i=0;
+            while (lane[i].msg==SIZE_MAX)
+                i++;
+            Mb_lane & l=lane[i];
+            if (l.tail_pos==0)
+            {
+                struct sha512_ctx ctx;
+                size_t left=msgs[l.msg]+lens[l.msg]-l.p;
+                for (int j=0; j<8; j++)
+                    ctx.state[j]=state[j][i];
+                ctx.total[0]=lens[l.msg]-left;
+                ctx.total[1]=0;
+                ctx.buflen=0;
+                sha512_process_bytes (l.p, left, &ctx);
+                sha512_finish_ctx (&ctx, out[l.msg]);
+                break;
+            };
+        };
+
+        for (size_t i=0; i<lanes; i++)
+        {
+            Mb_lane & l=lane[i];
+            if (l.msg==SIZE_MAX)
+                blocks[i]=idle_block;
+            else
+                blocks[i]=l.body_blocks>0 ? l.p : l.tail+l.tail_pos*128;
+        };
+
+        kernel (state, blocks);
+
+        for (size_t i=0; i<lanes; i++)
+        {
+            Mb_lane & l=lane[i];
+            if (l.msg==SIZE_MAX)
+                continue;
+            if (l.body_blocks>0)
+            {
+                l.p+=128;
+                l.body_blocks--;
+                continue;
+            };
+            if (++l.tail_pos<l.tail_blocks)
+                continue;
+
+            for (int j=0; j<8; j++)
+                put_be64 (out[l.msg]+j*8, state[j][i]);
+            l.msg=SIZE_MAX;
+            active--;
+            if (next<n)
+            {
+                start_message (l, state, i, next, msgs[next], lens[next]);
+                next++;
+                active++;
+            };
+        };
+    };
+};
+
+// all lengths around block and padding boundaries, in one call, so lanes are refilled
+// at different steps, and all digests are the same as of single SHA512
+void sha512_mb_test()
+{
+    const size_t max_len=3*128+20;
+    static uint8_t buf[max_len+1];
+    for (size_t i=0; i<sizeof(buf); i++)
+        buf[i]=(uint8_t)(i*13+(i>>5));
+
+    const uint8_t* msgs[max_len+1];
+    size_t lens[max_len+1];
+    static uint8_t out[max_len+1][SHA512_DIGEST_SIZE];
+    for (size_t len=0; len<=max_len; len++)
+    {
+        msgs[len]=buf+(len & 7); // unaligned too
+        lens[len]=min (len, (size_t)max_len-(len & 7));
+    };
+
+    sha512_mb (max_len+1, msgs, lens, out);
+
+    for (size_t m=0; m<=max_len; m++)
+    {
+        uint8_t expected[SHA512_DIGEST_SIZE];
+        sha512_buffer ((const char*)msgs[m], lens[m], expected);
+        assert (memcmp (expected, out[m], SHA512_DIGEST_SIZE)==0);
+    };
+};
+
+/* vim: set expandtab ts=4 sw=4 : */
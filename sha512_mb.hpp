@@ -0,0 +1,24 @@
+#pragma once
+
+// Multi-buffer SHA512: many independent messages are hashed at once, each one in its own lane
+// of vector registers, 4 lanes with AVX2 and 8 with AVX-512. One block of each lane is processed
+// per step, and when a message ends, its lane gets the next one, so messages of different lengths
+// keep all lanes busy.
+// This is for many small messages (partial hashes, small files), where single SHA512 can't use
+// vector units at all (each round depends on the previous one). Large files go through sha512_ctx.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sha512.h"
+
+#define SHA512_MB_MAX_LANES 8
+
+size_t sha512_mb_lanes(); // of this CPU, 1 if it has neither AVX2 nor AVX-512
+
+// SHA512 of each one of N messages: msgs[i] of lens[i] bytes, digest into out[i]
+void sha512_mb (size_t n, const uint8_t* const* msgs, const size_t* lens, uint8_t (*out)[SHA512_DIGEST_SIZE]);
+
+void sha512_mb_test();
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,189 @@
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+#include <thread>
+
+#include "uring.hpp"
+
+using namespace std;
+
+Uring::Uring (unsigned entries)
+{
+    sq_ring=cq_ring=MAP_FAILED;
+    sqes=(struct io_uring_sqe*)MAP_FAILED;
+    sq_entries=sqe_tail=in_flight_count=0;
+
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    ring_fd=syscall (__NR_io_uring_setup, entries, &p);
+    if (ring_fd==-1)
+        return;
+
+    sq_ring_size=p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cq_ring_size=p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size=cq_ring_size=max (sq_ring_size, cq_ring_size);
+
+    sq_ring=mmap (NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring==MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring=sq_ring;
+    else
+    {
+        cq_ring=mmap (NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring==MAP_FAILED)
+            goto fail;
+    };
+
+    sqes_size=p.sq_entries*sizeof(struct io_uring_sqe);
+    sqes=(struct io_uring_sqe*)mmap (NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes==MAP_FAILED)
+        goto fail;
+
+    sq_head=(unsigned*)((char*)sq_ring + p.sq_off.head);
+    sq_tail=(unsigned*)((char*)sq_ring + p.sq_off.tail);
+    sq_mask=(unsigned*)((char*)sq_ring + p.sq_off.ring_mask);
+    sq_array=(unsigned*)((char*)sq_ring + p.sq_off.array);
+    cq_head=(unsigned*)((char*)cq_ring + p.cq_off.head);
+    cq_tail=(unsigned*)((char*)cq_ring + p.cq_off.tail);
+    cq_mask=(unsigned*)((char*)cq_ring + p.cq_off.ring_mask);
+    cqes=(struct io_uring_cqe*)((char*)cq_ring + p.cq_off.cqes);
+
+    sq_entries=p.sq_entries;
+    sqe_tail=*sq_tail;
+    return;
+
+fail:
+    release();
+};
+
+Uring::~Uring()
+{
+    release();
+};
+
+void Uring::release()
+{
+    if (sqes!=MAP_FAILED)
+        munmap (sqes, sqes_size);
+    if (cq_ring!=MAP_FAILED && cq_ring!=sq_ring)
+        munmap (cq_ring, cq_ring_size);
+    if (sq_ring!=MAP_FAILED)
+        munmap (sq_ring, sq_ring_size);
+    sqes=(struct io_uring_sqe*)MAP_FAILED;
+    sq_ring=cq_ring=MAP_FAILED;
+    if (ring_fd!=-1)
+        close (ring_fd);
+    ring_fd=-1;
+};
+
+struct io_uring_sqe* Uring::get_sqe()
+{
+    // CQ ring is (at least) twice as big as SQ, so it can't overflow while this holds
+    if (in_flight_count>=sq_entries)
+        return NULL;
+
+    unsigned head=__atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail-head>=sq_entries)
+        return NULL;
+
+    unsigned idx=sqe_tail & *sq_mask;
+    sq_array[idx]=idx;
+    sqe_tail++;
+    in_flight_count++;
+
+    struct io_uring_sqe* sqe=&sqes[idx];
+    memset (sqe, 0, sizeof(*sqe));
+    return sqe;
+};
+
+bool Uring::submit (unsigned wait_nr)
+{
+    __atomic_store_n (sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    while (true)
+    {
+        // kernel may have taken some of them before it was interrupted
+        unsigned to_submit=sqe_tail - __atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+        int rt=syscall (__NR_io_uring_enter, ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rt==-1 && errno==EINTR)
+            continue;
+        if (rt==-1 && (errno==EAGAIN || errno==EBUSY)) // out of memory for requests, or CQ is full
+        {
+            this_thread::yield();
+            continue;
+        };
+        return rt!=-1;
+    };
+};
+
+void Uring::drain()
+{
+    unsigned head=__atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+    for (; sqe_tail!=head; sqe_tail--)
+    {
+        struct io_uring_cqe c;
+        memset (&c, 0, sizeof(c));
+        c.user_data=sqes[(sqe_tail-1) & *sq_mask].user_data;
+        c.res=-ECANCELED;
+        cancelled.push_front (c);
+    };
+    __atomic_store_n (sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    while (true)
+    {
+        unsigned ready=__atomic_load_n (cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+        if (ready+cancelled.size()>=in_flight_count)
+            return;
+        int rt=syscall (__NR_io_uring_enter, ring_fd, 0, in_flight_count-cancelled.size()-ready, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rt==-1 && errno!=EINTR)
+            usleep (1000); // completions come anyway, they are posted on the way back from any syscall
+    };
+};
+
+bool Uring::get_cqe (struct io_uring_cqe & out)
+{
+    if (cancelled.empty()==false)
+    {
+        out=cancelled.front();
+        cancelled.pop_front();
+        in_flight_count--;
+        return true;
+    };
+
+    unsigned head=*cq_head;
+    if (head==__atomic_load_n (cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    out=cqes[head & *cq_mask];
+    __atomic_store_n (cq_head, head+1, __ATOMIC_RELEASE);
+    in_flight_count--;
+    return true;
+};
+
+bool Uring::supports (int opcode)
+{
+    const unsigned ops=256;
+    vector<char> buf (sizeof(struct io_uring_probe) + ops*sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe* probe=(struct io_uring_probe*)&buf[0];
+
+    // IORING_REGISTER_PROBE itself is 5.6+, as most of opcodes we need
+    if (syscall (__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops)==-1)
+        return false;
+    if (opcode>probe->last_op)
+        return false;
+    return (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)!=0;
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,60 @@
+#pragma once
+
+// Minimal io_uring wrapper on raw syscalls, so there is no dependency on liburing.
+// One ring is meant to be used by one thread only.
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+
+#include <deque>
+
+#include <boost/utility.hpp>
+
+class Uring : boost::noncopyable
+{
+    private:
+        int ring_fd;
+        void* sq_ring;
+        size_t sq_ring_size;
+        void* cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe* sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe* cqes;
+
+        unsigned sq_entries;
+        unsigned sqe_tail; // our copy of SQ tail, published by submit()
+        unsigned in_flight_count; // got by get_sqe(), but completion not yet taken by get_cqe()
+        std::deque<struct io_uring_cqe> cancelled; // by drain(), taken by get_cqe() before those of kernel
+
+        void release();
+
+    public:
+        // ok() is false if kernel has no io_uring or it is disabled (seccomp, sysctl, etc)
+        Uring (unsigned entries);
+        ~Uring();
+        bool ok() const { return ring_fd!=-1; };
+        unsigned entries() const { return sq_entries; };
+        unsigned in_flight() const { return in_flight_count; };
+
+        // zeroed SQE, or NULL if there are already entries() requests in flight
+        struct io_uring_sqe* get_sqe();
+        // submit all new SQEs and wait until at least wait_nr completions are available
+        bool submit (unsigned wait_nr);
+        // after submit() failed: requests kernel hasn't taken yet complete with -ECANCELED, and this waits
+        // until all it has taken are complete, so memory they point to is not in use anymore.
+        // all completions are then there for get_cqe()
+        void drain();
+        // non-blocking, false if there are no completions yet
+        bool get_cqe (struct io_uring_cqe & out);
+        // is opcode (IORING_OP_*) known to this kernel?
+        bool supports (int opcode);
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -1,22 +1,53 @@
+#ifdef _WIN32
 #include <windows.h>
+#include <winioctl.h>
+#endif
 
 #include <stdio.h>
 #include <stdint.h>
 #include <wchar.h>
 #include <assert.h>
+#include <string.h>
 
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
 #include <set>
 #include <list>
 
 #include "utils.hpp"
 #include "sha512.h"
+#include "hash_engine.hpp"
 
 using namespace std;
 
+Options options;
+
+#ifdef _WIN32
+Name to_name (const wstring & s)
+{
+    return s;
+};
+
+wstring from_name (const wchar_t* s, size_t len)
+{
+    return wstring (s, len);
+};
+#else
+Name to_name (const wstring & s)
+{
+    return to_native (s);
+};
+
+wstring from_name (const char* s, size_t len)
+{
+    return from_native (string (s, len));
+};
+#endif
+
+#ifdef _WIN32
 wstring GetLastError_to_message(DWORD dw) 
 {
     wstring rt;
@@ -70,8 +101,9 @@ wstring wstrfmt (const wchar_t * szFormat, ...)
     return rt;
 };
 
-bool get_file_size (wstring name, FileSize & out)
+bool get_file_size (const Dir_handle & dir, const wstring & fname, FileSize & out)
 {
+    wstring name=dir+fname;
     HANDLE h=CreateFile(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
     if (h==INVALID_HANDLE_VALUE)
@@ -103,20 +135,7 @@ bool get_file_size (wstring name, FileSize & out)
     return rt;
 };
 
-wstring get_current_dir ()
-{
-    wchar_t *cur_dir;
-    wstring rt;
-
-    int l=GetCurrentDirectory (0, NULL); // results is in BYTES
-    cur_dir=(wchar_t*)malloc (l*sizeof (wchar_t));
-    GetCurrentDirectory (l, cur_dir);
-
-    rt=cur_dir;
-
-    free (cur_dir);
-    return rt;
-};
+#endif
 
 string SHA512_finish_and_get_result (struct sha512_ctx *ctx)
 {
@@ -139,6 +158,54 @@ string SHA512_finish_and_get_result (struct sha512_ctx *ctx)
     return rt;
 };
 
+Digest SHA512_finish_and_get_digest (struct sha512_ctx *ctx)
+{
+    uint8_t res[64];
+    sha512_finish_ctx (ctx, res);
+
+    Digest rt;
+    memcpy (rt.bytes, res, DIGEST_SIZE);
+    return rt;
+};
+
+string digest_to_hex (const Digest & d)
+{
+    static const char digits[]="0123456789abcdef";
+    string rt;
+    for (int i=0; i<DIGEST_SIZE; i++)
+    {
+        rt.push_back (digits[d.bytes[i] >> 4]);
+        rt.push_back (digits[d.bytes[i] & 0xf]);
+    };
+    return rt;
+};
+
+static int hex_digit (char c)
+{
+    if (c>='0' && c<='9')
+        return c-'0';
+    if (c>='a' && c<='f')
+        return c-'a'+10;
+    if (c>='A' && c<='F')
+        return c-'A'+10;
+    return -1;
+};
+
+bool digest_from_hex (const string & s, Digest & out)
+{
+    if (s.size()<DIGEST_SIZE*2)
+        return false;
+    for (int i=0; i<DIGEST_SIZE; i++)
+    {
+        int hi=hex_digit (s[i*2]), lo=hex_digit (s[i*2+1]);
+        if (hi==-1 || lo==-1)
+            return false;
+        out.bytes[i]=(uint8_t)(hi << 4 | lo);
+    };
+    return true;
+};
+
+#ifdef _WIN32
 bool NTFS_stream_get_info_if_exist (wstring fname, FILETIME & ft_out, string & hash_out)
 {
     HANDLE h=CreateFile(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -149,14 +216,21 @@ bool NTFS_stream_get_info_if_exist (wstring fname, FILETIME & ft_out, string & h
         return false; // throw exception?
     };
 
-    char buf[1024];
-    memset (buf, 0, 1024);
+    // whole stream: digests of all chunks of big file (or checkpoint) may take more than one buffer
+    string buf;
+    char tmp[4096];
     DWORD actually_read;
-    if (ReadFile (h, buf, 1024, &actually_read, NULL)==FALSE)
+    do
     {
-        //wprintf (L"NTFS_streams_get_info_if_exist() can't read file %s\n", fname.c_str());
-        return false; // throw exception?
-    };
+        if (ReadFile (h, tmp, sizeof(tmp), &actually_read, NULL)==FALSE)
+        {
+            //wprintf (L"NTFS_streams_get_info_if_exist() can't read file %s\n", fname.c_str());
+            CloseHandle (h);
+            return false; // throw exception?
+        };
+        buf.append (tmp, actually_read);
+    }
+    while (actually_read>0);
 
     istringstream s;
     s.exceptions (ifstream::failbit | ifstream::badbit);
@@ -168,7 +242,7 @@ bool NTFS_stream_get_info_if_exist (wstring fname, FILETIME & ft_out, string & h
     }
     catch (ifstream::failure & e)
     {
-        wcerr << WFUNCTION << " sname=" << fname << " buf=[" << buf << "]" << endl;
+        wcerr << WFUNCTION << " sname=" << fname << " buf=[" << buf.c_str() << "]" << endl;
         wcerr << "Exception while reading: " << e.what() << endl;
         CloseHandle (h);
         return false;
@@ -234,13 +308,102 @@ void NTFS_stream_save_info (wstring sname, FILETIME ft, string hash) // or, over
 
 #define FULL_HASH_BUFSIZE 1024000
 
-bool SHA512_of_file (wstring fname, string & rt)
+// first allocated range at or after offset, see POSIX version in utils_posix.cpp
+static void find_data_range (HANDLE h, FileSize offset, FileSize size, FileSize & data_start, FileSize & data_end)
 {
-    wstring stream_fname;
-    if (fname.size()==1)
-        stream_fname=L".\\"+fname;
-    else
-        stream_fname=fname;
+    FILE_ALLOCATED_RANGE_BUFFER query, range;
+    DWORD returned;
+
+    data_start=offset;
+    data_end=size;
+
+    query.FileOffset.QuadPart=offset;
+    query.Length.QuadPart=size-offset;
+    // ERROR_MORE_DATA is OK, we need only the first range
+    if (DeviceIoControl (h, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), &range, sizeof(range), &returned, NULL)==FALSE &&
+            GetLastError()!=ERROR_MORE_DATA)
+        return; // can't tell, so it's all data
+
+    if (returned<sizeof(range)) // hole till the end
+    {
+        data_start=data_end=size;
+        return;
+    };
+
+    data_start=max (offset, (FileSize)range.FileOffset.QuadPart);
+    data_end=min (size, (FileSize)(range.FileOffset.QuadPart + range.Length.QuadPart));
+};
+
+// checkpoint in stream: "<size>:<offset>:" and hex digests of last leaf, chunks and leaves
+// (how many of each is known from offset)
+static string checkpoint_to_string (const File_hash_checkpoint & cp)
+{
+    ostringstream s;
+    s << cp.size << ":" << cp.offset << ":" << digest_to_hex (cp.last_leaf);
+    for (auto &c : cp.chunks)
+        s << digest_to_hex (c);
+    for (auto &l : cp.leaves)
+        s << digest_to_hex (l);
+    return s.str();
+};
+
+static bool checkpoint_from_string (const string & str, File_hash_checkpoint & cp)
+{
+    unsigned long long size, offset;
+    int hex_start;
+    if (sscanf (str.c_str(), "%llu:%llu:%n", &size, &offset, &hex_start)!=2 || offset%TREE_HASH_LEAF!=0)
+        return false;
+    cp.size=size;
+    cp.offset=offset;
+    FileSize leaves=offset/TREE_HASH_LEAF;
+    size_t chunks=(size_t)(leaves/TREE_HASH_LEAVES_PER_CHUNK);
+    cp.chunks.resize (chunks);
+    cp.leaves.resize ((size_t)(leaves%TREE_HASH_LEAVES_PER_CHUNK));
+    if (str.size()-hex_start!=(1+cp.chunks.size()+cp.leaves.size())*DIGEST_SIZE*2)
+        return false;
+
+    const char* p=str.c_str()+hex_start;
+    bool b=digest_from_hex (string (p, DIGEST_SIZE*2), cp.last_leaf);
+    p+=DIGEST_SIZE*2;
+    for (auto &c : cp.chunks)
+    {
+        b=b && digest_from_hex (string (p, DIGEST_SIZE*2), c);
+        p+=DIGEST_SIZE*2;
+    };
+    for (auto &l : cp.leaves)
+    {
+        b=b && digest_from_hex (string (p, DIGEST_SIZE*2), l);
+        p+=DIGEST_SIZE*2;
+    };
+    return b;
+};
+
+// leaf just before checkpoint, as it's in file now
+static bool hash_leaf_before (HANDLE h, FileSize offset, uint8_t* buf, Digest & out)
+{
+    LARGE_INTEGER pos;
+    pos.QuadPart=offset-TREE_HASH_LEAF;
+    if (SetFilePointerEx (h, pos, NULL, FILE_BEGIN)==FALSE)
+        return false;
+
+    Hash_ctx ctx;
+    hash_init (&ctx);
+    for (size_t done=0; done<TREE_HASH_LEAF; )
+    {
+        DWORD want=(DWORD)min ((size_t)FULL_HASH_BUFSIZE, TREE_HASH_LEAF-done), actually_read;
+        if (ReadFile (h, buf, want, &actually_read, NULL)==FALSE || actually_read<want)
+            return false;
+        hash_process_bytes (&ctx, buf, actually_read);
+        done+=actually_read;
+    };
+    out=hash_finish (&ctx);
+    return true;
+};
+
+bool SHA512_of_file (const Dir_handle & dir, const wstring & name, Digest & rt)
+{
+    wstring fname=dir+name;
+    wstring stream_fname=fname; // full path, so single-letter names can't be confused with drive letters
 
     HANDLE h=CreateFile(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
@@ -258,9 +421,23 @@ bool SHA512_of_file (wstring fname, string & rt)
         return false; // throw exception?
     };
 
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle (h, &info)==FALSE)
+    {
+        wprintf (L"%s() can't get information about file %s\n", WFUNCTION, fname.c_str());
+        return false; // throw exception?
+    };
+    FileSize size=((DWORD64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    bool sparse=(info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)!=0;
+
+    // digest of tree hashed file is not SHA512 of file as it was before, so its stream is another one.
+    // digests of its chunks are not there: these are in checkpoint (DDF_CKPT_*), which is what uses them
+    wstring stream=stream_fname+(tree_hashed (size) ? L":DDF_TREE_" : L":DDF_FULL_")+hash_engine_name();
+
     FILETIME ft_from_stream;
+    string hex_from_stream;
     bool b;
-    b=NTFS_stream_get_info_if_exist (stream_fname+L":DDF_FULL_SHA512", ft_from_stream, rt);
+    b=NTFS_stream_get_info_if_exist (stream, ft_from_stream, hex_from_stream) && digest_from_hex (hex_from_stream, rt);
     if (b)
     {
         //wprintf (L"%s(): Got full SHA512 from %s file\n", WFUNCTION, fname.c_str());
@@ -275,41 +452,80 @@ bool SHA512_of_file (wstring fname, string & rt)
         };
     };
 
-    struct sha512_ctx ctx;
-    sha512_init_ctx (&ctx);
-
     uint8_t* buf=(uint8_t*)malloc(FULL_HASH_BUFSIZE);
 
     assert (buf!=NULL);
 
     memset (buf, 0, FULL_HASH_BUFSIZE);
     DWORD actually_read;
+    FileSize offset=0;
+
+    // file which has grown since it was hashed is hashed from checkpoint, if its old part looks the same
+    wstring ckpt_stream=stream_fname+L":DDF_CKPT_"+hash_engine_name();
+    File_hash_ctx ctx;
+    File_hash_checkpoint cp;
+    Digest leaf;
+    if (tree_hashed (size) && NTFS_stream_get_info_if_exist (ckpt_stream, ft_from_stream, hex_from_stream) &&
+            checkpoint_from_string (hex_from_stream, cp) && file_hash_resume (&ctx, size, cp) &&
+            hash_leaf_before (h, cp.offset, buf, leaf) && leaf==cp.last_leaf)
+        offset=cp.offset;
+    else
+        file_hash_init (&ctx, size);
 
-    do
+    // only allocated ranges are read, holes are hashed as zeros
+    while (offset<size)
     {
-        if (ReadFile (h, buf, FULL_HASH_BUFSIZE, &actually_read, NULL)==FALSE)
+        FileSize data_start=offset, data_end=size;
+        if (sparse)
+            find_data_range (h, offset, size, data_start, data_end);
+        file_hash_process_zeros (&ctx, data_start-offset);
+        offset=data_start;
+
+        LARGE_INTEGER pos;
+        pos.QuadPart=offset;
+        if (offset<data_end && SetFilePointerEx (h, pos, NULL, FILE_BEGIN)==FALSE)
         {
-            wcerr << WFUNCTION << L"() can't read file " << fname << endl;
+            wcerr << WFUNCTION << L"() can't seek in file " << fname << endl;
             free (buf);
             return false; // throw exception?
         };
-        sha512_process_bytes (buf, actually_read, &ctx);
-    }
-    while (actually_read==FULL_HASH_BUFSIZE);
+
+        while (offset<data_end)
+        {
+            DWORD want=(DWORD)min ((FileSize)FULL_HASH_BUFSIZE, data_end-offset);
+            if (ReadFile (h, buf, want, &actually_read, NULL)==FALSE)
+            {
+                wcerr << WFUNCTION << L"() can't read file " << fname << endl;
+                free (buf);
+                return false; // throw exception?
+            };
+            file_hash_process_bytes (&ctx, buf, actually_read);
+            offset+=actually_read;
+            if (actually_read<want) // truncated while we read it
+            {
+                size=offset;
+                break;
+            };
+        };
+    };
 
     CloseHandle (h);
 
     free (buf);
-    rt=SHA512_finish_and_get_result (&ctx);
-    NTFS_stream_save_info (stream_fname+L":DDF_FULL_SHA512", LastWriteTime, rt);
+    if (file_hash_checkpoint (&ctx, size, cp))
+        NTFS_stream_save_info (ckpt_stream, LastWriteTime, checkpoint_to_string (cp));
+    rt=file_hash_finish (&ctx);
+    // each engine has its own stream (SHA512 one is where it always was)
+    NTFS_stream_save_info (stream, LastWriteTime, digest_to_hex (rt));
     return true;
 };
+#endif
 
 void sha512_test()
 {
     struct sha512_ctx ctx;
     string result;
-    char *s1="The quick brown fox jumps over the lazy dog";
+    const char *s1="The quick brown fox jumps over the lazy dog";
 
     sha512_init_ctx (&ctx);
     sha512_process_bytes (s1, strlen(s1), &ctx);
@@ -329,16 +545,53 @@ void SHA512_process_wstring (struct sha512_ctx *ctx, wstring s)
     sha512_process_bytes (tmp, s.size()*sizeof(wchar_t), ctx);
 };
 
-#define PARTIAL_HASH_BUFSIZE 512
+// n blocks, one at pseudo-random offset (splitmix64 of seed) in each of n equal parts of file
+static void add_partial_samples (vector<Partial_sample> & out, FileSize size, size_t n, uint64_t seed)
+{
+    FileSize part=size/n;
+    for (size_t i=0; i<n; i++)
+    {
+        uint64_t z=(seed+=0x9E3779B97F4A7C15ULL);
+        z=(z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z=(z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z^=z >> 31;
+
+        FileSize offset=part*i + z % (part-PARTIAL_SAMPLE_SIZE);
+        offset&=~(FileSize)(PARTIAL_SAMPLE_SIZE-1); // whole block of disk
+        out.push_back (Partial_sample{offset, PARTIAL_SAMPLE_SIZE});
+    };
+};
 
-bool partial_SHA512_of_file (wstring fname, string & out)
+vector<Partial_sample> partial_hash_samples (FileSize size, int level)
 {
-    wstring stream_fname;
-    if (fname.size()==1)
-        stream_fname=L".\\"+fname;
-    else
-        stream_fname=fname;
-    
+    vector<Partial_sample> rt;
+    rt.push_back (Partial_sample{0, (size_t)min (size, (FileSize)PARTIAL_HASH_BUFSIZE)});
+    if (size<=PARTIAL_HASH_BUFSIZE)
+        return rt;
+    rt.push_back (Partial_sample{size-PARTIAL_HASH_BUFSIZE, PARTIAL_HASH_BUFSIZE});
+    if (size<PARTIAL_SAMPLED_MIN)
+        return rt;
+
+    // one block for each doubling of size: 1 for 16 MiB, 8 for 2 GiB
+    size_t n=1;
+    for (FileSize s=size/PARTIAL_SAMPLED_MIN; s>1 && n<PARTIAL_SAMPLES_MAX; s/=2)
+        n++;
+    add_partial_samples (rt, size, n, size);
+    // level 2 has level 1 blocks too, so it tells apart everything level 1 did
+    if (level==2)
+        add_partial_samples (rt, size, n*(PARTIAL_LEVEL2_FACTOR-1), ~size);
+
+    sort (rt.begin(), rt.end(), [](const Partial_sample & a, const Partial_sample & b) { return a.offset<b.offset; });
+    return rt;
+};
+
+#ifdef _WIN32
+
+bool partial_SHA512_of_file (const Dir_handle & dir, const wstring & name, Digest & out, int level)
+{
+    wstring fname=dir+name;
+    wstring stream_fname=fname; // full path, so single-letter names can't be confused with drive letters
+
     HANDLE h=CreateFile(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
     if (h==INVALID_HANDLE_VALUE)
@@ -355,9 +608,22 @@ bool partial_SHA512_of_file (wstring fname, string & out)
         return false; // throw exception?
     };
 
+    FileSize filesize;
+    if (get_file_size (dir, name, filesize)==false)
+    {
+        wprintf (L"%s(): get_file_size(%s) failed\n", WFUNCTION, fname.c_str());
+        return false;
+    };
+    vector<Partial_sample> samples=partial_hash_samples (filesize, level);
+
+    // partial hash of file having samples other than head and tail is not what it was before, so its
+    // stream is another one. level 2 is not kept at all (it's read for a few files only)
+    wstring stream=stream_fname+(samples.size()>2 ? L":DDF_SAMPLED_" : L":DDF_PART_")+hash_engine_name();
+
     FILETIME ft_from_stream;
+    string hex_from_stream;
     bool b;
-    b=NTFS_stream_get_info_if_exist (stream_fname+L":DDF_PART_SHA512", ft_from_stream, out);
+    b=level==1 && NTFS_stream_get_info_if_exist (stream, ft_from_stream, hex_from_stream) && digest_from_hex (hex_from_stream, out);
     if (b)
     {
         //wprintf (L"%s(): Got partial SHA512 from %s file\n", WFUNCTION, fname.c_str());
@@ -374,84 +640,186 @@ bool partial_SHA512_of_file (wstring fname, string & out)
          };
     };
 
-    struct sha512_ctx ctx;
-    sha512_init_ctx (&ctx);
+    Hash_ctx ctx;
+    hash_init (&ctx);
 
-    uint8_t buf[PARTIAL_HASH_BUFSIZE];
+    uint8_t buf[PARTIAL_SAMPLE_SIZE];
 
-    memset (buf, 0, PARTIAL_HASH_BUFSIZE);
+    memset (buf, 0, PARTIAL_SAMPLE_SIZE);
     DWORD actually_read;
 
-    FileSize filesize;
-    if (get_file_size (fname, filesize)==false)
-    {
-        wprintf (L"%s(): get_file_size(%s) failed\n", WFUNCTION, fname.c_str());
-        return false;
-    };
-
-    if (filesize<=512)
-    {
-        if (ReadFile (h, buf, PARTIAL_HASH_BUFSIZE, &actually_read, NULL)==FALSE)
-        {
-            wprintf (L"%s() can't read file %s\n", WFUNCTION, fname.c_str());
-            return false;
-        };
-        sha512_process_bytes (buf, actually_read, &ctx);
-    }
-    else
+    for (auto &sample : samples)
     {
-        if (ReadFile (h, buf, PARTIAL_HASH_BUFSIZE, &actually_read, NULL)==FALSE)
-        {
-            wprintf (L"%s() can't read file %s\n", WFUNCTION, fname.c_str());
-            return false;
-        };
-        sha512_process_bytes (buf, actually_read, &ctx);
-
-        LONG tmp=0;
-        if (SetFilePointer (h, -512, &tmp, FILE_END)==INVALID_SET_FILE_POINTER && GetLastError()!=NO_ERROR)
+        LARGE_INTEGER pos;
+        pos.QuadPart=sample.offset;
+        if (SetFilePointerEx (h, pos, NULL, FILE_BEGIN)==FALSE)
         {
             DWORD err=GetLastError();
-            wcerr << WFUNCTION L"() SetFilePointer failed for " << fname << " (" << GetLastError_to_message (err) << ")" << endl;
+            wcerr << WFUNCTION L"() SetFilePointerEx failed for " << fname << " (" << GetLastError_to_message (err) << ")" << endl;
             return false;
         };
 
-        if (ReadFile (h, buf, PARTIAL_HASH_BUFSIZE, &actually_read, NULL)==FALSE)
+        if (ReadFile (h, buf, (DWORD)sample.len, &actually_read, NULL)==FALSE)
         {
             wprintf (L"%s() can't read file %s\n", WFUNCTION, fname.c_str());
             return false;
         };
-        sha512_process_bytes (buf, actually_read, &ctx);
+        hash_process_bytes (&ctx, buf, actually_read);
     };
 
     CloseHandle (h);
 
-    out=SHA512_finish_and_get_result (&ctx);
-    NTFS_stream_save_info (stream_fname+L":DDF_PART_SHA512", LastWriteTime, out);
+    out=hash_finish (&ctx);
+    if (level==1)
+        NTFS_stream_save_info (stream, LastWriteTime, digest_to_hex (out));
     return true;
 };
+#endif
+
+void partial_SHA512_of_files_one_by_one (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, int level)
+{
+    for (size_t i=0; i<jobs.size(); i++)
+    {
+        Dir_handle dir;
+        Digest hash;
+        bool ok=get_dir_handle (*jobs[i].dir_name, dir) && partial_SHA512_of_file (dir, *jobs[i].file_name, hash, level);
+        done (i, ok, hash);
+    };
+};
+
+#ifndef __linux__
+// batched version is in utils_uring.cpp
+void partial_SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, int level)
+{
+    partial_SHA512_of_files_one_by_one (jobs, done, level);
+};
+#endif
+
+void SHA512_of_files_one_by_one (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done)
+{
+    for (size_t i=0; i<jobs.size(); i++)
+    {
+        Dir_handle dir;
+        Digest hash;
+        bool ok=get_dir_handle (*jobs[i].dir_name, dir) && SHA512_of_file (dir, *jobs[i].file_name, hash);
+        done (i, ok, hash);
+    };
+};
+
+#ifdef _WIN32
+// reader/hasher pipeline is in utils_pipeline.cpp
+void SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done)
+{
+    SHA512_of_files_one_by_one (jobs, done);
+};
+
+// no lockstep reading here: files of groups are just hashed whole
+void compare_files (const vector<Hash_job> & jobs, const vector<vector<size_t>> & groups,
+        function<void(size_t job, bool ok, const Digest & hash)> done, function<bool(size_t job)> unique)
+{
+    vector<Hash_job> to_hash;
+    vector<size_t> to_job;
+    for (auto &g : groups)
+        for (auto &j : g)
+            if (g.size()>1 || unique (j)==false)
+            {
+                to_hash.push_back (jobs[j]);
+                to_job.push_back (j);
+            };
+    SHA512_of_files (to_hash, [&](size_t job, bool ok, const Digest & hash) { done (to_job[job], ok, hash); });
+};
+#endif
 
 wstring size_to_string (FileSize i)
 {
     if (i>1000000000)
-        return wstrfmt (L"~%dG", i/1000000000);
+        return wstrfmt (L"~%lluG", (unsigned long long)(i/1000000000));
     if (i>1000000)
-        return wstrfmt (L"~%dM", i/1000000);
+        return wstrfmt (L"~%lluM", (unsigned long long)(i/1000000));
     if (i>1000)
-        return wstrfmt (L"~%dk", i/1000);
-    return wstrfmt (L"%d", i);
+        return wstrfmt (L"~%lluk", (unsigned long long)(i/1000));
+    return wstrfmt (L"%llu", (unsigned long long)i);
 };
 
-bool set_current_dir(wstring dir)
+#ifdef _WIN32
+bool open_dir (const wstring & dir, Dir_handle & out)
 {
-    BOOL B=SetCurrentDirectory (dir.c_str());
-    if (B==FALSE)
+    out=dir;
+    return true;
+};
+
+bool open_subdir (const Dir_handle & parent, const wstring & name, Dir_handle & out)
+{
+    out=parent+name+PATH_SEPARATOR;
+    return true;
+};
+
+void close_dir (const Dir_handle & dir)
+{
+};
+
+bool get_dir_handle (const wstring & dir, Dir_handle & out)
+{
+    return open_dir (dir, out);
+};
+
+// hard links are not tracked on Win32 (Dir_entry::links is always 1), so there is no need for volume ID
+bool get_dir_device (const Dir_handle & dir, uint64_t & out)
+{
+    return false;
+};
+
+// dir is full path ending with backslash.
+// file sizes are taken from directory entries, files are not opened here at all.
+bool enumerate_dir (const Dir_handle & dir, function<void(const Dir_entry & e)> f)
+{
+    WIN32_FIND_DATA ff;
+    // bigger buffer and no 8.3 names, but both are Win7+ only, XP says ERROR_INVALID_PARAMETER
+    HANDLE hfile=FindFirstFileEx ((dir + L"*").c_str(), FindExInfoBasic, &ff, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hfile==INVALID_HANDLE_VALUE && GetLastError()==ERROR_INVALID_PARAMETER)
+        hfile=FindFirstFile ((dir + L"*").c_str(), &ff);
+
+    if (hfile==INVALID_HANDLE_VALUE)
     {
         DWORD err=GetLastError();
-        wcerr << L"cannot change directory to [" << dir << L"]" << endl;
-        wcerr << GetLastError_to_message (err) << endl;
+        wcerr << WFUNCTION << L"(): FindFirstFile() failed for [" << dir << L"] " << GetLastError_to_message (err) << endl;
+        return false;
     };
-    return B==TRUE;
+
+    Dir_entry e;
+    e.inode=0; // file ID needs CreateFile(), too slow
+    e.links=1; // the same
+
+    do
+    {
+        DWORD att=ff.dwFileAttributes;
+
+        if (att & FILE_ATTRIBUTE_REPARSE_POINT) // do not follow symlinks
+            continue;
+
+        if (att & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if (wcscmp (ff.cFileName, L".")==0 || wcscmp (ff.cFileName, L"..")==0) // skip subdirectories links
+                continue;
+            e.name=ff.cFileName;
+            e.is_dir=true;
+            e.size=0;
+            f (e);
+        }
+        else
+        {
+            e.name=ff.cFileName;
+            e.is_dir=false;
+            e.size=((DWORD64)ff.nFileSizeHigh << 32) | ff.nFileSizeLow;
+            f (e);
+        };
+    }
+    while (FindNextFile (hfile, &ff)!=0);
+
+    FindClose (hfile);
+    return true;
 };
+#endif
 
 void SHA512_process (struct sha512_ctx *ctx, set<string> s)
 {
@@ -465,38 +833,38 @@ void SHA512_process (struct sha512_ctx *ctx, set<wstring> s)
         SHA512_process_wstring (ctx, st);
 };
 
-string SHA512_process (multiset<string> s)
+Digest SHA512_process (multiset<Digest> s)
 {
     struct sha512_ctx ctx;
     sha512_init_ctx (&ctx);      
-    for (string st : s)
-        SHA512_process_string (&ctx, st);
-    return SHA512_finish_and_get_result (&ctx);
+    for (auto &d : s)
+        sha512_process_bytes (d.bytes, DIGEST_SIZE, &ctx);
+    return SHA512_finish_and_get_digest (&ctx);
 };
 
-string SHA512_process (list<string> s)
+Digest SHA512_process (list<string> s)
 {
     struct sha512_ctx ctx;
     sha512_init_ctx (&ctx);      
     for (string st : s)
         SHA512_process_string (&ctx, st);
-    return SHA512_finish_and_get_result (&ctx);
+    return SHA512_finish_and_get_digest (&ctx);
 };
 
-string SHA512_process (set<string> s)
+Digest SHA512_process (set<string> s)
 {
     struct sha512_ctx ctx;
     sha512_init_ctx (&ctx);      
     SHA512_process (&ctx, s);
-    return SHA512_finish_and_get_result (&ctx);
+    return SHA512_finish_and_get_digest (&ctx);
 }
 
-string SHA512_process (set<wstring> s)
+Digest SHA512_process (set<wstring> s)
 {
     struct sha512_ctx ctx;
     sha512_init_ctx (&ctx);      
     SHA512_process (&ctx, s);
-    return SHA512_finish_and_get_result (&ctx);
+    return SHA512_finish_and_get_digest (&ctx);
 }
 
 /* vim: set expandtab ts=4 sw=4 : */
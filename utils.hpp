@@ -4,37 +4,165 @@
 #define WIDEN(x) WIDEN2(x)
 #define WFILE WIDEN(__FILE__)
 #define WDATE WIDEN(__DATE__)
+#ifdef _WIN32
 #define WFUNCTION WIDEN(__FUNCTION__)
+#else
+#define WFUNCTION __FUNCTION__ // not a string literal in GCC, can't be widened, but wostream will do it
+#endif
 
 #include <wchar.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <string>
 #include <set>
 #include <list>
+#include <functional>
+#include <vector>
 
 using namespace std;
 
+#ifdef _WIN32
 typedef DWORD64 FileSize;
+#define PATH_SEPARATOR L'\\'
+// directory is referred by its full path ending with backslash, "opening" it costs nothing
+typedef wstring Dir_handle;
+#else
+typedef uint64_t FileSize;
+#define PATH_SEPARATOR L'/'
+// directory is referred by descriptor opened with O_DIRECTORY, all files are opened relative to it
+typedef int Dir_handle;
+
+wstring from_native (const string & s);
+string to_native (const wstring & s);
+// first allocated range of file at or after offset: [data_start, data_end), holes before and after it
+// read as zeros. if filesystem can't tell, it's all data
+void find_data_range (int fd, FileSize offset, FileSize size, FileSize & data_start, FileSize & data_end);
+// worth asking find_data_range() at all
+bool may_have_holes (const struct stat & st);
+#endif
+
+// names are kept as OS gave them: UTF-8 (or whatever bytes) on POSIX, UTF-16 on Win32,
+// not as wchar_t, which is 4 bytes on Linux
+#ifdef _WIN32
+typedef wstring Name;
+#else
+typedef string Name;
+#endif
+Name to_name (const wstring & s);
+wstring from_name (const Name::value_type* s, size_t len);
+
+// command line switches, set once in wmain()
+struct Options
+{
+    bool direct_io; // stage 3 reads bypass page cache (O_DIRECT) where filesystem allows it
+    enum { ORDER_NONE, ORDER_INODE, ORDER_EXTENT } order; // in what order files of spinning disk are read
+    size_t max_memory; // 0 if whole tree is kept in memory, otherwise bytes for out-of-core mode (see external.hpp)
+    wstring scratch_dir; // where out-of-core mode puts its sorted runs, ends with PATH_SEPARATOR
+    enum { HASH_FAST, HASH_SHA512 } hash; // what contents of files are hashed with, see hash_engine.hpp
+    enum { CACHE_NONE, CACHE_XATTR, CACHE_DB } cache; // where digests are kept between runs on Linux, see hash_cache.hpp
+    wstring cache_db; // file of CACHE_DB
+
+    Options() { direct_io=false; order=ORDER_INODE; max_memory=0; scratch_dir=wstring(L".")+PATH_SEPARATOR; hash=HASH_FAST; cache=CACHE_NONE; cache_db=L"ddff_hashes.db"; };
+};
+extern Options options;
 
 wstring wstrfmt (const wchar_t * szFormat, ...);
-bool get_file_size (wstring name, FileSize & out);
-wstring get_current_dir ();
-bool set_current_dir(wstring dir);
 
-void SHA512_process (struct sha512_ctx *ctx, string s);
+// none of these change current directory, so all may be called from several threads at once
+bool open_dir (const wstring & dir, Dir_handle & out);
+bool open_subdir (const Dir_handle & parent, const wstring & name, Dir_handle & out);
+void close_dir (const Dir_handle & dir);
+bool get_dir_handle (const wstring & dir, Dir_handle & out); // cached per thread, do not close
+struct Dir_entry
+{
+    wstring name;
+    bool is_dir;
+    FileSize size; // files only
+    uint64_t inode; // 0 if unknown (Win32)
+    unsigned links; // number of hard links to a file, 1 if unknown (Win32)
+};
+bool enumerate_dir (const Dir_handle & dir, function<void(const Dir_entry & e)> f);
+bool get_dir_device (const Dir_handle & dir, uint64_t & out); // false if unknown (Win32)
+bool get_file_size (const Dir_handle & dir, const wstring & name, FileSize & out);
+
+// digests are kept in binary and truncated to first DIGEST_SIZE bytes of hash (see hash_engine.hpp):
+// 128 bits are still plenty for telling files apart, take 8 times less memory than hex string,
+// and are compared with one memcmp(). hex is made only for output and caches
+#define DIGEST_SIZE 16
+struct Digest
+{
+    uint8_t bytes[DIGEST_SIZE];
+
+    bool operator== (const Digest & o) const { return memcmp (bytes, o.bytes, DIGEST_SIZE)==0; };
+    bool operator!= (const Digest & o) const { return memcmp (bytes, o.bytes, DIGEST_SIZE)!=0; };
+    bool operator< (const Digest & o) const { return memcmp (bytes, o.bytes, DIGEST_SIZE)<0; };
+};
+// for unordered containers: digest bits are random already
+struct Digest_hash
+{
+    size_t operator() (const Digest & d) const { size_t rt; memcpy (&rt, d.bytes, sizeof(rt)); return rt; };
+};
+string digest_to_hex (const Digest & d);
+bool digest_from_hex (const string & s, Digest & out); // first DIGEST_SIZE*2 digits, so full SHA512 in hex is OK
+
 void SHA512_process (struct sha512_ctx *ctx, set<string> s);
-string SHA512_process (multiset<string> s);
-string SHA512_process (list<string> s);
-string SHA512_process (set<string> s);
-string SHA512_process (set<wstring> s);
-string SHA512_finish_and_get_result (struct sha512_ctx *ctx);
-bool SHA512_of_file (wstring fname, string & out);
-bool partial_SHA512_of_file (wstring name, string & out);
+Digest SHA512_process (multiset<Digest> s);
+Digest SHA512_process (list<string> s);
+Digest SHA512_process (set<string> s);
+Digest SHA512_process (set<wstring> s);
+string SHA512_finish_and_get_result (struct sha512_ctx *ctx); // full SHA512 in hex
+Digest SHA512_finish_and_get_digest (struct sha512_ctx *ctx);
+// names of these are historical: files are hashed by engine chosen for this run (see hash_engine.hpp)
+bool SHA512_of_file (const Dir_handle & dir, const wstring & fname, Digest & out);
+
+// Partial hash is hash of samples of file: first and last 512 bytes, and for big files, a few blocks
+// at pseudo-random offsets, one in each of equal parts of file, more of them for bigger files
+// (these offsets depend on size only, so equal files give equal samples).
+// That's level 1. Level 2 is 8 times as many blocks: it's read only for files level 1 couldn't
+// tell apart from others, so big files with equal headers and padding are split before stage 3.
+#define PARTIAL_HASH_BUFSIZE 512 // head and tail
+#define PARTIAL_SAMPLE_SIZE 4096
+#define PARTIAL_SAMPLED_MIN (16*1024*1024) // smaller files are sampled at head and tail only
+#define PARTIAL_SAMPLES_MAX 8 // at level 1, for files of 2 GiB and more
+#define PARTIAL_LEVEL2_FACTOR 8
+
+struct Partial_sample
+{
+    FileSize offset;
+    size_t len;
+};
+vector<Partial_sample> partial_hash_samples (FileSize size, int level); // in order of offsets
+bool partial_SHA512_of_file (const Dir_handle & dir, const wstring & name, Digest & out, int level=1);
+
+// stage 2 for many files at once
+struct Hash_job
+{
+    const wstring* dir_name; // full path, ending with PATH_SEPARATOR. the same pointer for all files of a directory
+    const wstring* file_name;
+    FileSize size; // as seen in stage 1
+    uint64_t inode; // as seen in stage 1, 0 if unknown
+};
+// done() is called once for each job, in any order and possibly from other threads
+void partial_SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, int level=1);
+void partial_SHA512_of_files_one_by_one (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, int level=1);
+// stage 3, the same way
+void SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done);
+void SHA512_of_files_one_by_one (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done);
+// stage 3 by comparing files of each group (same size and partial hash) in lockstep: all of them
+// are read at once, range by range, and group is split as soon as ranges differ, so files which
+// differ early are not read to the end. done() gives files which are equal to others the same digest
+// SHA512_of_files() would. unique() is called (from this thread) for files found unlike any other:
+// it returns false if digest of file is still wanted (hard links), then file is read to the end anyway
+void compare_files (const vector<Hash_job> & jobs, const vector<vector<size_t>> & groups,
+        function<void(size_t job, bool ok, const Digest & hash)> done, function<bool(size_t job)> unique);
 
 void sha512_test();
 void sha1_test();
 wstring size_to_string (FileSize i);
+#ifdef _WIN32
 bool NTFS_stream_get_info_if_exist (wstring fname, FILETIME & ft_out, string & hash_out);
 void NTFS_stream_save_info (wstring fname, FILETIME ft, string info);
+#endif
 
 /* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,814 @@
+// Stage 3 reader/hasher pipeline (POSIX).
+// Reader threads only read, hasher threads only hash, so the disk is never idle while CPU hashes
+// and vice versa. Buffers are taken from a fixed pool of aligned buffers and returned there after
+// hashing: while a hasher is busy with one buffer of a file, reader is filling the next one.
+// Chunks of a file are always hashed by the same hasher (job % hashers), so they are processed in order.
+// Each device has its own readers (see io_scheduler.hpp): one for spinning disk, many for SSD,
+// and all devices are read at once.
+// Pages we read are dropped from page cache right away (POSIX_FADV_DONTNEED), or not cached at all
+// with --direct-io, so scanning terabytes doesn't evict everything else from memory.
+// Holes of sparse files are not read at all: reader sends their lengths, and hasher feeds zeros.
+// Big files are tree hashed (see hash_engine.hpp): each leaf is one chunk, and leaves go to all
+// hashers in turn, so a huge file is hashed by all of them at once. Whoever hashes the last leaf of
+// tree chunk hashes that chunk, and whoever finishes the last chunk (or reader) hashes the root.
+// compare_files() runs pipeline again and again, each time on next range of leaves of files it
+// compares (see there): their state is kept from one run to another.
+// Files having digest in cache (see hash_cache.hpp) are not read at all: it's taken right after open.
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "utils.hpp"
+#include "hash_engine.hpp"
+#include "hash_cache.hpp"
+#include "blocking_queue.hpp"
+#include "io_scheduler.hpp"
+
+using namespace std;
+
+#define PIPELINE_BUFSIZE (1024*1024) // multiple of any sane block size, as O_DIRECT requires
+#define PIPELINE_BUF_ALIGN 4096
+#define PIPELINE_BUFFERS_PER_HASHER 2 // plus one for each reader
+#define PIPELINE_SMALL_FILE (64*1024) // files up to this size are hashed together, see hash_messages()
+
+static_assert (TREE_HASH_LEAF==PIPELINE_BUFSIZE, "leaf of tree hash is one buffer");
+
+// chunk of tree hash, while its leaves are being hashed
+struct Pipeline_tree_chunk
+{
+    Digest leaves[TREE_HASH_LEAVES_PER_CHUNK];
+    size_t n; // leaves in it, all chunks except the last one are full
+    atomic<size_t> left; // not hashed yet
+};
+
+struct Pipeline_file
+{
+    size_t job;
+    Hash_ctx ctx; // not for tree hashed files
+    atomic<bool> failed;
+    bool started; // hasher got some of it already
+    bool tree;
+    struct stat st; // as it was opened (the first time), for cache
+    // tree hashed file only:
+    vector<Pipeline_tree_chunk*> chunks; // only ones being hashed
+    vector<Digest> chunk_digests;
+    atomic<size_t> refs; // reader and chunks being hashed
+    // for checkpoint, which is at the end of the last whole leaf (see hash_engine.hpp)
+    size_t whole_leaves;
+    Digest last_leaf;
+    vector<Digest> checkpoint_leaves; // whole leaves of the last chunk, if it's not whole
+    // tree hashed file compared in lockstep: each run of pipeline reads its leaves [first_leaf, end_leaf),
+    // and compare_files() finishes it
+    bool lockstep;
+    size_t first_leaf, end_leaf;
+    bool cached; // digest is found in cache by the first run, nothing is read
+    Digest cached_digest;
+    bool resumed; // the first run has read it from checkpoint to the end, and it's taken as cached
+};
+
+struct Pipeline_chunk
+{
+    Pipeline_file* file;
+    uint8_t* buf; // NULL if nothing was read: then there are len zeros (hole), or nothing
+    size_t len;
+    bool last;
+    size_t leaf; // of tree hashed file
+};
+
+// whole small files, copied out of pipeline buffers (so these go back to readers right away)
+struct Pipeline_small_files
+{
+    vector<size_t> jobs;
+    vector<struct stat> sts;
+    vector<uint8_t> data;
+    vector<size_t> starts;
+};
+
+// digest of tree hashed file, which is read to the end, cached along with its checkpoint
+static Digest finish_tree (const Hash_job & job, const Pipeline_file* f)
+{
+    Digest d=tree_hash_node (f->chunk_digests.data(), f->chunk_digests.size());
+    File_hash_checkpoint cp;
+    cp.size=f->st.st_size;
+    cp.offset=(FileSize)f->whole_leaves*TREE_HASH_LEAF;
+    cp.last_leaf=f->last_leaf;
+    cp.chunks.assign (f->chunk_digests.begin(), f->chunk_digests.begin()+f->whole_leaves/TREE_HASH_LEAVES_PER_CHUNK);
+    cp.leaves=f->checkpoint_leaves;
+    hash_cache_put (job, f->st, HASH_CACHE_FULL, d, &cp);
+    return d;
+};
+
+class Pipeline : boost::noncopyable
+{
+    private:
+        const vector<Hash_job> & jobs;
+        function<void(size_t job, bool ok, const Digest & hash)> done;
+        vector<Device_queue> devices;
+        size_t readers_total;
+        Blocking_queue<uint8_t*> free_buffers;
+        vector<uint8_t*> all_buffers;
+        vector<unique_ptr<Blocking_queue<Pipeline_chunk>>> to_hash; // one queue per hasher
+        const vector<Pipeline_file*>* lockstep; // state of each job compared in lockstep, NULL for others
+
+        void send (const Pipeline_chunk & c)
+        {
+            size_t leaf=c.file->tree ? c.leaf : 0;
+            to_hash[(c.file->job+leaf) % to_hash.size()]->push (c);
+        };
+
+        void release (Pipeline_file* f)
+        {
+            if (--f->refs>0)
+                return;
+            if (f->failed)
+                done (f->job, false, Digest());
+            else
+                done (f->job, true, finish_tree (jobs[f->job], f));
+            delete f;
+        };
+
+        void leaf_done (Pipeline_file* f, size_t leaf, const Digest & d)
+        {
+            size_t idx=leaf/TREE_HASH_LEAVES_PER_CHUNK;
+            Pipeline_tree_chunk* chunk=f->chunks[idx];
+            chunk->leaves[leaf%TREE_HASH_LEAVES_PER_CHUNK]=d;
+            if (leaf+1==f->whole_leaves)
+                f->last_leaf=d;
+            if (--chunk->left>0)
+                return;
+            if (idx==f->whole_leaves/TREE_HASH_LEAVES_PER_CHUNK && f->whole_leaves%TREE_HASH_LEAVES_PER_CHUNK!=0)
+                f->checkpoint_leaves.assign (chunk->leaves, chunk->leaves+f->whole_leaves%TREE_HASH_LEAVES_PER_CHUNK);
+            f->chunk_digests[idx]=tree_hash_node (chunk->leaves, chunk->n);
+            f->chunks[idx]=NULL;
+            delete chunk;
+            if (f->lockstep==false)
+                release (f);
+        };
+
+        int open_file (const Hash_job & job)
+        {
+            Dir_handle dir;
+            if (get_dir_handle (*job.dir_name, dir)==false)
+                return -1;
+
+            string name=to_native (*job.file_name);
+            int fd=-1;
+            if (options.direct_io)
+                fd=openat (dir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECT);
+            if (fd==-1) // not asked, or filesystem can't do O_DIRECT (EINVAL)
+                fd=openat (dir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd==-1)
+                wcerr << WFUNCTION << L"() can't open file " << *job.dir_name << *job.file_name << L" (" << strerror (errno) << L")" << endl;
+            return fd;
+        };
+
+        // read up to len bytes at offset, short count is returned only at EOF
+        ssize_t read_chunk (int fd, uint8_t* buf, size_t len, off_t offset)
+        {
+            size_t got=0;
+            while (got<len)
+            {
+                ssize_t r=pread (fd, buf+got, len-got, offset+got);
+                if (r==-1 && errno==EINTR)
+                    continue;
+                if (r==-1 && errno==EINVAL && (fcntl (fd, F_GETFL) & O_DIRECT))
+                {
+                    // some filesystems accept O_DIRECT at open(), but not at read()
+                    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_DIRECT);
+                    continue;
+                };
+                if (r==-1)
+                    return -1;
+                if (r==0)
+                    break;
+                got+=r;
+            };
+            return got;
+        };
+
+        // [offset, offset+want) into pipeline buffer: not more, even if file has grown while we read it,
+        // and less only if it's truncated. -1 if it can't be read
+        ssize_t read_range (int fd, const Hash_job & job, uint8_t* buf, FileSize offset, size_t want)
+        {
+            // O_DIRECT wants whole blocks, even at the end of file
+            size_t ask=(want + PIPELINE_BUF_ALIGN-1) & ~(size_t)(PIPELINE_BUF_ALIGN-1);
+            ssize_t got=read_chunk (fd, buf, ask, offset);
+            if (got==-1)
+            {
+                wcerr << WFUNCTION << L"() can't read file " << *job.dir_name << *job.file_name << L" (" << strerror (errno) << L")" << endl;
+                return -1;
+            };
+            if ((size_t)got>want)
+                got=want;
+            posix_fadvise (fd, offset, got, POSIX_FADV_DONTNEED); // we will not need these pages again
+            return got;
+        };
+
+        // one leaf of tree hashed file goes to hasher, unless it's all hole
+        void read_leaf (Pipeline_file* f, int fd, size_t leaf, FileSize size, bool holes, FileSize & data_start, FileSize & data_end)
+        {
+            const Hash_job & job=jobs[f->job];
+            FileSize offset=(FileSize)leaf*TREE_HASH_LEAF;
+            size_t want=(size_t)min ((FileSize)TREE_HASH_LEAF, size-offset);
+
+            if (holes && want==TREE_HASH_LEAF)
+            {
+                if (offset>=data_end) // next allocated range
+                    find_data_range (fd, offset, size, data_start, data_end);
+                if (data_start>=offset+want)
+                {
+                    leaf_done (f, leaf, tree_hash_zero_leaf());
+                    return;
+                };
+            };
+
+            Pipeline_chunk c;
+            c.file=f;
+            c.buf=NULL;
+            c.last=false;
+            c.leaf=leaf;
+            free_buffers.pop (c.buf);
+            ssize_t got=read_range (fd, job, c.buf, offset, want);
+            if (got==-1 || (size_t)got<want)
+            {
+                // leaves of truncated file are not where they were, so there is no tree to finish
+                if (got!=-1)
+                    wcerr << WFUNCTION << L"() file " << *job.dir_name << *job.file_name << L" was truncated while read" << endl;
+                f->failed=true;
+                free_buffers.push (c.buf);
+                leaf_done (f, leaf, Digest());
+                return;
+            };
+            c.len=want;
+            send (c);
+        };
+
+        // leaves [first, end) of tree hashed file. state of chunk is made at its first leaf,
+        // and it's gone as soon as its last leaf is hashed
+        void read_leaves (Pipeline_file* f, int fd, FileSize size, bool holes, size_t first, size_t end)
+        {
+            size_t leaves=(size_t)((size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+            FileSize data_start=0, data_end=0;
+            for (size_t leaf=first; leaf<end; leaf++)
+            {
+                if (f->failed && (f->lockstep || leaf%TREE_HASH_LEAVES_PER_CHUNK==0))
+                    break; // compare_files() drops what's left of lockstep file
+                if (leaf%TREE_HASH_LEAVES_PER_CHUNK==0)
+                {
+                    Pipeline_tree_chunk* chunk=new Pipeline_tree_chunk;
+                    chunk->n=min ((size_t)TREE_HASH_LEAVES_PER_CHUNK, leaves-leaf);
+                    chunk->left=chunk->n;
+                    f->chunks[leaf/TREE_HASH_LEAVES_PER_CHUNK]=chunk;
+                    f->refs++;
+                };
+                if (f->failed)
+                    leaf_done (f, leaf, Digest()); // rest of chunk is not read
+                else
+                    read_leaf (f, fd, leaf, size, holes, data_start, data_end);
+            };
+        };
+
+        // file which has grown since it was hashed goes on from its checkpoint, if the leaf just before
+        // it is still the same: digests before it are taken from there, and the chunk it's in is made
+        // with leaves it has already. returns the first leaf to read, 0 if there is no checkpoint of use
+        size_t resume_tree (Pipeline_file* f, int fd, FileSize size)
+        {
+            File_hash_checkpoint cp;
+            if (hash_cache_get_checkpoint (fd, f->st, cp)==false)
+                return 0;
+
+            uint8_t* buf=NULL;
+            free_buffers.pop (buf);
+            ssize_t got=read_range (fd, jobs[f->job], buf, cp.offset-TREE_HASH_LEAF, TREE_HASH_LEAF);
+            Digest leaf;
+            if (got==TREE_HASH_LEAF)
+            {
+                Hash_ctx ctx;
+                hash_init (&ctx);
+                hash_process_bytes (&ctx, buf, got);
+                leaf=hash_finish (&ctx);
+            };
+            free_buffers.push (buf);
+            if (got!=TREE_HASH_LEAF || leaf!=cp.last_leaf)
+                return 0;
+
+            size_t leaves=(size_t)((size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+            size_t first=(size_t)(cp.offset/TREE_HASH_LEAF);
+            copy (cp.chunks.begin(), cp.chunks.end(), f->chunk_digests.begin());
+            if (cp.leaves.empty()==false)
+            {
+                Pipeline_tree_chunk* chunk=new Pipeline_tree_chunk;
+                chunk->n=min ((size_t)TREE_HASH_LEAVES_PER_CHUNK, leaves-cp.chunks.size()*TREE_HASH_LEAVES_PER_CHUNK);
+                chunk->left=chunk->n-cp.leaves.size();
+                copy (cp.leaves.begin(), cp.leaves.end(), chunk->leaves);
+                f->chunks[cp.chunks.size()]=chunk;
+                f->refs++;
+            };
+            f->last_leaf=cp.last_leaf;
+            return first;
+        };
+
+        // all leaves of big file, or the ones after its checkpoint
+        void read_tree (Pipeline_file* f, int fd, FileSize size, bool holes)
+        {
+            size_t leaves=(size_t)((size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+            size_t chunks=(leaves+TREE_HASH_LEAVES_PER_CHUNK-1)/TREE_HASH_LEAVES_PER_CHUNK;
+            f->chunks.assign (chunks, NULL);
+            f->chunk_digests.resize (chunks);
+            f->whole_leaves=(size_t)(size/TREE_HASH_LEAF);
+            read_leaves (f, fd, size, holes, resume_tree (f, fd, size), leaves);
+            release (f);
+        };
+
+        // lockstep file is not sent to hasher, compare_files() sees it failed
+        void fail (Pipeline_file* f, const Pipeline_chunk & c)
+        {
+            f->failed=true;
+            if (f->lockstep==false)
+                send (c);
+        };
+
+        void reader (Device_queue* dev)
+        {
+            size_t i;
+            while ((i=dev->next++) < dev->jobs.size())
+            {
+                size_t job=dev->jobs[i];
+                Pipeline_file* f=lockstep!=NULL ? (*lockstep)[job] : NULL;
+                if (f==NULL)
+                {
+                    f=new Pipeline_file;
+                    f->failed=false;
+                    f->started=false;
+                    f->tree=false;
+                    f->refs=1;
+                    f->lockstep=false;
+                    f->cached=false;
+                    f->resumed=false;
+                    hash_init (&f->ctx);
+                };
+                f->job=job;
+
+                Pipeline_chunk c;
+                c.file=f;
+                c.buf=NULL;
+                c.len=0;
+                c.last=true;
+                c.leaf=0;
+
+                int fd=open_file (jobs[job]);
+                if (fd==-1)
+                {
+                    fail (f, c);
+                    continue;
+                };
+
+                struct stat st;
+                if (fstat (fd, &st)!=0)
+                {
+                    wcerr << WFUNCTION << L"() can't stat file " << *jobs[job].dir_name << *jobs[job].file_name << L" (" << strerror (errno) << L")" << endl;
+                    fail (f, c);
+                    close (fd);
+                    continue;
+                };
+                FileSize size=st.st_size;
+                bool holes=may_have_holes (st);
+
+                if (f->lockstep==false || f->first_leaf==0)
+                {
+                    f->st=st;
+                    Digest d;
+                    if (hash_cache_get (fd, st, HASH_CACHE_FULL, d))
+                    {
+                        close (fd);
+                        if (f->lockstep)
+                        {
+                            f->cached=true;
+                            f->cached_digest=d;
+                            continue;
+                        };
+                        done (job, true, d);
+                        delete f;
+                        continue;
+                    };
+                };
+
+                posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+                if (f->lockstep)
+                {
+                    // leaves read before are not where they were, if it's not the same file
+                    if (size!=jobs[job].size)
+                    {
+                        wcerr << WFUNCTION << L"() file " << *jobs[job].dir_name << *jobs[job].file_name << L" was changed while compared" << endl;
+                        f->failed=true;
+                        close (fd);
+                        continue;
+                    };
+                    // file which has grown since it was hashed is read to the end by the first run,
+                    // from its checkpoint, then it's taken as cached
+                    size_t first=f->first_leaf==0 ? resume_tree (f, fd, size) : 0;
+                    f->resumed=first>0;
+                    if (f->resumed)
+                        read_leaves (f, fd, size, holes, first, (size_t)((size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF));
+                    else
+                        read_leaves (f, fd, size, holes, f->first_leaf, f->end_leaf);
+                    close (fd);
+                    continue;
+                };
+
+                if (tree_hashed (size))
+                {
+                    f->tree=true;
+                    read_tree (f, fd, size, holes);
+                    close (fd);
+                    continue;
+                };
+
+                FileSize offset=0, data_end=0;
+                c.last=false;
+                while (offset<size && f->failed==false)
+                {
+                    if (offset==data_end) // next allocated range
+                    {
+                        FileSize data_start=offset;
+                        data_end=size;
+                        if (holes)
+                            find_data_range (fd, offset, size, data_start, data_end);
+                        if (data_start>offset)
+                        {
+                            c.buf=NULL;
+                            c.len=data_start-offset;
+                            offset=data_start;
+                            data_end=offset; // SEEK_HOLE again there, if it's not the end
+                            send (c);
+                            continue;
+                        };
+                    };
+
+                    free_buffers.pop (c.buf);
+                    size_t want=(size_t)min ((FileSize)PIPELINE_BUFSIZE, data_end-offset);
+                    ssize_t got=read_range (fd, jobs[job], c.buf, offset, want);
+                    if (got==-1)
+                    {
+                        f->failed=true;
+                        got=0;
+                    }
+                    else if ((size_t)got<want) // truncated while we read it
+                        size=offset+got;
+                    c.len=got;
+                    offset+=got;
+                    c.last=offset>=size; // so whole small file is one chunk
+                    send (c);
+                };
+
+                if (c.last==false)
+                {
+                    c.buf=NULL;
+                    c.len=0;
+                    c.last=true;
+                    send (c);
+                };
+                close (fd);
+            };
+        };
+
+        void hash_small_files (Pipeline_small_files & small)
+        {
+            size_t n=small.jobs.size();
+            vector<const uint8_t*> msgs (n);
+            vector<size_t> lens (n);
+            vector<Digest> digests (n);
+            for (size_t i=0; i<n; i++)
+            {
+                msgs[i]=small.data.data()+small.starts[i];
+                lens[i]=(i+1<n ? small.starts[i+1] : small.data.size())-small.starts[i];
+            };
+            hash_messages (n, msgs.data(), lens.data(), digests.data());
+            for (size_t i=0; i<n; i++)
+            {
+                hash_cache_put (jobs[small.jobs[i]], small.sts[i], HASH_CACHE_FULL, digests[i]);
+                done (small.jobs[i], true, digests[i]);
+            };
+
+            small.jobs.clear();
+            small.sts.clear();
+            small.data.clear();
+            small.starts.clear();
+        };
+
+        void hasher (size_t idx)
+        {
+            size_t batch_max=hash_messages_batch();
+            Pipeline_small_files small;
+            Pipeline_chunk c;
+            for (;;)
+            {
+                // small files wait for company only while there are other chunks to hash
+                if (small.jobs.empty() ? to_hash[idx]->pop (c)==false : to_hash[idx]->try_pop (c)==false)
+                {
+                    if (small.jobs.empty())
+                        break;
+                    hash_small_files (small);
+                    continue;
+                };
+
+                Pipeline_file* f=c.file;
+                if (f->tree)
+                {
+                    Digest d;
+                    if (f->failed==false)
+                    {
+                        Hash_ctx ctx;
+                        hash_init (&ctx);
+                        hash_process_bytes (&ctx, c.buf, c.len);
+                        d=hash_finish (&ctx);
+                    };
+                    free_buffers.push (c.buf);
+                    leaf_done (f, c.leaf, d);
+                    continue;
+                };
+
+                if (batch_max>1 && c.last && c.buf!=NULL && f->started==false && f->failed==false && c.len<=PIPELINE_SMALL_FILE)
+                {
+                    small.jobs.push_back (f->job);
+                    small.sts.push_back (f->st);
+                    small.starts.push_back (small.data.size());
+                    small.data.insert (small.data.end(), c.buf, c.buf+c.len);
+                    free_buffers.push (c.buf);
+                    delete f;
+                    if (small.jobs.size()>=batch_max)
+                        hash_small_files (small);
+                    continue;
+                };
+                f->started=true;
+
+                if (c.buf!=NULL)
+                {
+                    if (f->failed==false)
+                        hash_process_bytes (&f->ctx, c.buf, c.len);
+                    free_buffers.push (c.buf);
+                }
+                else if (f->failed==false)
+                    hash_process_zeros (&f->ctx, c.len);
+
+                if (c.last)
+                {
+                    if (f->failed)
+                        done (f->job, false, Digest());
+                    else
+                    {
+                        Digest d=hash_finish (&f->ctx);
+                        hash_cache_put (jobs[f->job], f->st, HASH_CACHE_FULL, d);
+                        done (f->job, true, d);
+                    };
+                    delete f;
+                };
+            };
+        };
+
+    public:
+        Pipeline (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, size_t hashers,
+                const vector<Pipeline_file*>* lockstep=NULL)
+            : jobs(jobs), done(done), devices(group_jobs_by_device (jobs)), readers_total(0),
+            free_buffers(SIZE_MAX), // never holds more than all_buffers anyway
+            lockstep(lockstep)
+        {
+            for (auto &d : devices)
+                readers_total+=min ((size_t)d.streams, d.jobs.size());
+
+            size_t buffers=readers_total + hashers*PIPELINE_BUFFERS_PER_HASHER;
+            for (size_t i=0; i<buffers; i++)
+            {
+                void* p;
+                if (posix_memalign (&p, PIPELINE_BUF_ALIGN, PIPELINE_BUFSIZE)!=0)
+                    throw bad_alloc();
+                all_buffers.push_back ((uint8_t*)p);
+                free_buffers.push ((uint8_t*)p);
+            };
+
+            // hasher queue holds not more chunks than there are buffers, so readers never block on it
+            for (size_t i=0; i<hashers; i++)
+                to_hash.push_back (unique_ptr<Blocking_queue<Pipeline_chunk>>(new Blocking_queue<Pipeline_chunk>(all_buffers.size()+readers_total)));
+        };
+
+        ~Pipeline()
+        {
+            for (auto &b : all_buffers)
+                free (b);
+        };
+
+        void run()
+        {
+            vector<thread> readers, hashers;
+
+            for (size_t i=0; i<to_hash.size(); i++)
+                hashers.push_back (thread (&Pipeline::hasher, this, i));
+            for (auto &d : devices)
+                for (size_t i=0; i<min ((size_t)d.streams, d.jobs.size()); i++)
+                    readers.push_back (thread (&Pipeline::reader, this, &d));
+
+            for (auto &t : readers)
+                t.join();
+            for (auto &q : to_hash)
+                q->close();
+            for (auto &t : hashers)
+                t.join();
+        };
+};
+
+void SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done)
+{
+    Pipeline p (jobs, done, max (thread::hardware_concurrency(), 1U));
+    p.run();
+};
+
+// group of files compared in lockstep, all of them are equal up to next_leaf
+struct Lockstep_group
+{
+    vector<size_t> jobs;
+    size_t next_leaf;
+    bool whole; // none of it failed, so file left alone is unlike any other
+};
+
+static Pipeline_file* new_lockstep_file (FileSize size)
+{
+    size_t leaves=(size_t)((size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+    Pipeline_file* f=new Pipeline_file;
+    f->failed=false;
+    f->started=false;
+    f->tree=true;
+    f->refs=1;
+    f->lockstep=true;
+    f->cached=false;
+    f->resumed=false;
+    f->whole_leaves=(size_t)(size/TREE_HASH_LEAF);
+    f->chunks.assign ((leaves+TREE_HASH_LEAVES_PER_CHUNK-1)/TREE_HASH_LEAVES_PER_CHUNK, NULL);
+    f->chunk_digests.resize (f->chunks.size());
+    return f;
+};
+
+static void delete_lockstep_file (Pipeline_file* f)
+{
+    for (auto &c : f->chunks)
+        delete c; // chunk of failed file may be left unfinished
+    delete f;
+};
+
+// what was read of lockstep file by the last run: digests of chunks it finished,
+// and leaves of the chunk it left unfinished (only the first one can be, see compare_files())
+static Digest lockstep_key (const Pipeline_file* f, size_t first, size_t end)
+{
+    vector<Digest> read;
+    for (size_t c=first/TREE_HASH_LEAVES_PER_CHUNK; c<=(end-1)/TREE_HASH_LEAVES_PER_CHUNK; c++)
+        if (f->chunks[c]==NULL)
+            read.push_back (f->chunk_digests[c]);
+        else
+            read.insert (read.end(), f->chunks[c]->leaves, f->chunks[c]->leaves+(end-c*TREE_HASH_LEAVES_PER_CHUNK));
+    return tree_hash_node (read.data(), read.size());
+};
+
+// Each run of pipeline reads next range of leaves of all files being compared: the first leaf,
+// then as many leaves as were read before (1 MiB, 1 MiB, 2 MiB, 4 MiB...), so files which differ
+// early are not read much further, and equal ones are read in a few runs. After 64 MiB ranges are
+// whole tree chunks, so only the first chunk is ever left unfinished by a run.
+// Small (not tree hashed) files are read whole by the first run.
+void compare_files (const vector<Hash_job> & jobs, const vector<vector<size_t>> & groups,
+        function<void(size_t job, bool ok, const Digest & hash)> done, function<bool(size_t job)> unique)
+{
+    vector<Pipeline_file*> state (jobs.size(), NULL);
+    vector<Digest> whole (jobs.size()); // digests of small files
+    vector<uint8_t> whole_ok (jobs.size(), 0);
+
+    vector<Lockstep_group> active;
+    for (auto &g : groups)
+    {
+        if (g.size()<2 && unique (g[0]))
+            continue;
+        for (auto &j : g)
+            if (tree_hashed (jobs[j].size))
+                state[j]=new_lockstep_file (jobs[j].size);
+        active.push_back (Lockstep_group{g, 0, g.size()>1});
+    };
+
+    size_t hashers=max (thread::hardware_concurrency(), 1U);
+    while (active.empty()==false)
+    {
+        vector<Hash_job> run_jobs;
+        vector<size_t> run_to_job;
+        vector<Pipeline_file*> run_state;
+        for (auto &g : active)
+        {
+            size_t leaves=(size_t)((jobs[g.jobs[0]].size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+            size_t end=min (leaves, max (g.next_leaf*2, (size_t)1));
+            for (auto &j : g.jobs)
+            {
+                if (state[j]!=NULL)
+                {
+                    state[j]->first_leaf=g.next_leaf;
+                    state[j]->end_leaf=end;
+                };
+                run_jobs.push_back (jobs[j]);
+                run_to_job.push_back (j);
+                run_state.push_back (state[j]);
+            };
+        };
+
+        // may be called from several threads at once, but each one writes to its own element
+        Pipeline p (run_jobs, [&](size_t job, bool ok, const Digest & hash)
+        {
+            whole[run_to_job[job]]=hash;
+            whole_ok[run_to_job[job]]=ok;
+        }, hashers, &run_state);
+        p.run();
+
+        // groups are split by what was read by this run, files left alone are unique
+        vector<Lockstep_group> next;
+        for (auto &g : active)
+        {
+            bool tree=tree_hashed (jobs[g.jobs[0]].size);
+            size_t leaves=(size_t)((jobs[g.jobs[0]].size+TREE_HASH_LEAF-1)/TREE_HASH_LEAF);
+            size_t end=min (leaves, max (g.next_leaf*2, (size_t)1));
+
+            // files found in cache (or resumed from checkpoint) are not compared any further,
+            // so others can't be unique
+            vector<pair<Digest, size_t>> keyed;
+            for (auto &j : g.jobs)
+            {
+                if (tree && (state[j]->cached || (state[j]->resumed && state[j]->failed==false)))
+                {
+                    done (j, true, state[j]->cached ? state[j]->cached_digest : finish_tree (jobs[j], state[j]));
+                    g.whole=false;
+                    delete_lockstep_file (state[j]);
+                    state[j]=NULL;
+                    continue;
+                };
+                if (tree ? state[j]->failed==false : whole_ok[j]!=0)
+                {
+                    keyed.push_back (make_pair (tree ? lockstep_key (state[j], g.next_leaf, end) : whole[j], j));
+                    continue;
+                };
+                done (j, false, Digest());
+                g.whole=false;
+                if (tree)
+                {
+                    delete_lockstep_file (state[j]);
+                    state[j]=NULL;
+                };
+            };
+            sort (keyed.begin(), keyed.end());
+
+            size_t last;
+            for (size_t first=0; first<keyed.size(); first=last)
+            {
+                vector<size_t> equal;
+                for (last=first; last<keyed.size() && keyed[last].first==keyed[first].first; last++)
+                    equal.push_back (keyed[last].second);
+
+                // file left alone may be still wanted, then it's read to the end alone.
+                // it's not read to the end just to be cached: the next run finds it unique as early
+                bool alone=equal.size()==1 && g.whole && unique (equal[0]);
+                if (alone==false && tree && end<leaves)
+                {
+                    next.push_back (Lockstep_group{equal, end, g.whole && equal.size()>1});
+                    continue;
+                };
+
+                for (auto &j : equal)
+                {
+                    if (alone==false && tree)
+                        done (j, true, finish_tree (jobs[j], state[j]));
+                    else if (alone==false)
+                        done (j, true, whole[j]);
+                    if (tree)
+                    {
+                        delete_lockstep_file (state[j]);
+                        state[j]=NULL;
+                    };
+                };
+            };
+        };
+        active.swap (next);
+    };
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
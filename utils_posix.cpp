@@ -0,0 +1,704 @@
+// POSIX counterparts of Win32 functions from utils.cpp.
+// Current directory is never changed: directories are held as descriptors
+// and files are opened/stat'ed relative to them (openat()/fstatat()/fdopendir()).
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+#include <assert.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "utils.hpp"
+#include "hash_engine.hpp"
+#include "hash_cache.hpp"
+#include "uring.hpp"
+
+using namespace std;
+
+wstring wstrfmt (const wchar_t * szFormat, ...)
+{
+    va_list va;
+    vector<wchar_t> buf (128);
+
+    while (true)
+    {
+        va_start (va, szFormat);
+        int sz=vswprintf (&buf[0], buf.size(), szFormat, va);
+        va_end (va);
+
+        if (sz>=0 && (size_t)sz<buf.size())
+            return wstring (&buf[0], sz);
+
+        buf.resize (buf.size()*2); // vswprintf() doesn't tell how much is needed
+    };
+};
+
+// file names are just bytes on POSIX. we decode them as UTF-8, but bytes which are not valid UTF-8
+// become U+DC80..U+DCFF (like Python's "surrogateescape"), so to_native(from_native(x))==x always
+wstring from_native (const string & s)
+{
+    wstring rt;
+    size_t i=0;
+
+    while (i<s.size())
+    {
+        unsigned char c=s[i];
+        size_t len;
+        uint32_t cp;
+
+        if (c<0x80)
+        {
+            rt+=(wchar_t)c;
+            i++;
+            continue;
+        }
+        else if ((c & 0xE0)==0xC0)
+        {
+            len=2;
+            cp=c & 0x1F;
+        }
+        else if ((c & 0xF0)==0xE0)
+        {
+            len=3;
+            cp=c & 0x0F;
+        }
+        else if ((c & 0xF8)==0xF0)
+        {
+            len=4;
+            cp=c & 0x07;
+        }
+        else
+            len=0;
+
+        bool valid=len>0 && i+len<=s.size();
+        for (size_t j=1; valid && j<len; j++)
+        {
+            unsigned char cc=s[i+j];
+            if ((cc & 0xC0)!=0x80)
+                valid=false;
+            else
+                cp=(cp<<6) | (cc & 0x3F);
+        };
+
+        // reject overlong forms, surrogates and out of range code points
+        if (valid)
+        {
+            static const uint32_t min_cp[5]={ 0, 0, 0x80, 0x800, 0x10000 };
+            if (cp<min_cp[len] || cp>0x10FFFF || (cp>=0xD800 && cp<=0xDFFF))
+                valid=false;
+        };
+
+        if (valid)
+        {
+            rt+=(wchar_t)cp;
+            i+=len;
+        }
+        else
+        {
+            rt+=(wchar_t)(0xDC00 | c);
+            i++;
+        };
+    };
+    return rt;
+};
+
+string to_native (const wstring & s)
+{
+    string rt;
+
+    for (wchar_t wc : s)
+    {
+        uint32_t cp=(uint32_t)wc;
+
+        if (cp>=0xDC80 && cp<=0xDCFF) // escaped byte, see from_native()
+            rt+=(char)(cp & 0xFF);
+        else if (cp<0x80)
+            rt+=(char)cp;
+        else if (cp<0x800)
+        {
+            rt+=(char)(0xC0 | (cp>>6));
+            rt+=(char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp<0x10000)
+        {
+            rt+=(char)(0xE0 | (cp>>12));
+            rt+=(char)(0x80 | ((cp>>6) & 0x3F));
+            rt+=(char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            rt+=(char)(0xF0 | (cp>>18));
+            rt+=(char)(0x80 | ((cp>>12) & 0x3F));
+            rt+=(char)(0x80 | ((cp>>6) & 0x3F));
+            rt+=(char)(0x80 | (cp & 0x3F));
+        };
+    };
+    return rt;
+};
+
+bool open_dir (const wstring & dir, Dir_handle & out)
+{
+    out=open (to_native (dir).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (out==-1)
+    {
+        wcerr << WFUNCTION << L"(): can't open directory [" << dir << L"] (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+    return true;
+};
+
+bool open_subdir (const Dir_handle & parent, const wstring & name, Dir_handle & out)
+{
+    out=openat (parent, to_native (name).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    return out!=-1;
+};
+
+void close_dir (const Dir_handle & dir)
+{
+    close (dir);
+};
+
+// last directory opened for hashing. files of one directory are usually hashed one after another,
+// so each directory is opened once and then each file is opened with single openat()
+class Dir_handle_cache
+{
+    private:
+        wstring path;
+        int fd;
+    public:
+        Dir_handle_cache() { fd=-1; };
+        ~Dir_handle_cache() { if (fd!=-1) close (fd); };
+
+        bool get (const wstring & dir, Dir_handle & out)
+        {
+            if (fd!=-1 && path==dir)
+            {
+                out=fd;
+                return true;
+            };
+
+            if (fd!=-1)
+            {
+                close (fd);
+                fd=-1;
+            };
+
+            if (open_dir (dir, fd)==false)
+                return false;
+            path=dir;
+            out=fd;
+            return true;
+        };
+};
+
+static thread_local Dir_handle_cache dir_handle_cache;
+
+bool get_dir_handle (const wstring & dir, Dir_handle & out)
+{
+    return dir_handle_cache.get (dir, out);
+};
+
+static void report_entry (function<void(const Dir_entry & e)> & f, const char* name, bool is_dir, FileSize size, uint64_t inode, unsigned links)
+{
+    Dir_entry e;
+    e.name=from_native (name);
+    e.is_dir=is_dir;
+    e.size=size;
+    e.inode=inode;
+    e.links=links;
+    f (e);
+};
+
+#ifdef __linux__
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+#define DIRENTS_BUFSIZE (1024*1024)
+
+// one syscall per file, no open(). ask only for what we need, so network filesystems
+// don't have to fetch the rest. type is needed only if getdents64() haven't reported it
+static bool stat_entry (int dir, const char* name, bool need_type, mode_t & type, FileSize & size, uint64_t & inode, unsigned & links)
+{
+#ifdef STATX_SIZE
+    struct statx stx;
+    unsigned mask=STATX_SIZE | STATX_INO | STATX_NLINK | (need_type ? STATX_TYPE : 0);
+
+    if (statx (dir, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC, mask, &stx)==0)
+    {
+        type=need_type ? (stx.stx_mode & S_IFMT) : S_IFREG;
+        size=stx.stx_size;
+        if (stx.stx_mask & STATX_INO)
+            inode=stx.stx_ino;
+        if (stx.stx_mask & STATX_NLINK)
+            links=stx.stx_nlink;
+        return true;
+    };
+    if (errno!=ENOSYS) // kernels before 4.11
+        return false;
+#endif
+    struct stat st;
+    if (fstatat (dir, name, &st, AT_SYMLINK_NOFOLLOW)!=0)
+        return false;
+    type=st.st_mode & S_IFMT;
+    size=st.st_size;
+    inode=st.st_ino;
+    links=st.st_nlink;
+    return true;
+};
+
+struct Pending_stat
+{
+    const char* name; // points into getdents64() buffer
+    bool need_type;
+    bool ok;
+    mode_t type;
+    FileSize size;
+    uint64_t inode; // from getdents64(), overwritten by statx() result, they differ on some union filesystems
+    unsigned links;
+#ifdef STATX_SIZE
+    struct statx stx;
+#endif
+};
+
+#define STAT_RING_ENTRIES 4096
+#define STAT_BATCH_MIN 16 // for smaller directories, round trip to io_uring worker costs more than statx() itself
+
+// stat all entries at once through io_uring: up to STAT_RING_ENTRIES requests are in flight,
+// kernel runs them in parallel, which matters when each one waits for disk or network.
+// each thread has its own ring. returns false if io_uring can't be used, then caller will do it one by one
+static bool stat_entries_batched (int dir, vector<Pending_stat> & entries)
+{
+#ifdef STATX_SIZE
+    static thread_local unique_ptr<Uring> ring;
+    static thread_local bool unusable=false;
+
+    if (unusable || entries.size()<STAT_BATCH_MIN)
+        return false;
+    if (!ring)
+    {
+        ring.reset (new Uring (STAT_RING_ENTRIES));
+        if (ring->ok()==false)
+        {
+            unusable=true;
+            return false;
+        };
+    };
+
+    size_t next=0, done=0;
+    while (done<entries.size())
+    {
+        struct io_uring_sqe* sqe;
+        while (next<entries.size() && (sqe=ring->get_sqe())!=NULL)
+        {
+            Pending_stat & e=entries[next];
+            sqe->opcode=IORING_OP_STATX;
+            sqe->fd=dir;
+            sqe->addr=(uintptr_t)e.name;
+            sqe->len=STATX_SIZE | STATX_INO | STATX_NLINK | (e.need_type ? STATX_TYPE : 0);
+            sqe->off=(uintptr_t)&e.stx;
+            sqe->statx_flags=AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC;
+            sqe->user_data=next;
+            next++;
+        };
+
+        if (ring->submit (1)==false)
+        {
+            wcerr << WFUNCTION << L"(): io_uring_enter() failed (" << strerror (errno) << L"), not using io_uring anymore" << endl;
+            ring->drain(); // requests in flight still write into entries, which caller stats again
+            ring.reset();
+            unusable=true;
+            return false;
+        };
+
+        struct io_uring_cqe cqe;
+        while (ring->get_cqe (cqe))
+        {
+            Pending_stat & e=entries[cqe.user_data];
+            if (cqe.res==0)
+            {
+                e.ok=true;
+                e.type=e.need_type ? (e.stx.stx_mode & S_IFMT) : S_IFREG;
+                e.size=e.stx.stx_size;
+                if (e.stx.stx_mask & STATX_INO)
+                    e.inode=e.stx.stx_ino;
+                if (e.stx.stx_mask & STATX_NLINK)
+                    e.links=e.stx.stx_nlink;
+            }
+            else if (cqe.res==-EINVAL) // kernels before 5.6 don't know IORING_OP_STATX
+            {
+                unusable=true;
+                e.ok=stat_entry (dir, e.name, e.need_type, e.type, e.size, e.inode, e.links);
+            }
+            else
+                e.ok=false; // deleted since getdents64()?
+            done++;
+        };
+    };
+    return true;
+#else
+    return false;
+#endif
+};
+
+// directory is read by big chunks with raw getdents64(), d_type tells directories from files,
+// so only files are stat'ed (just for size), in batches through io_uring if possible.
+// symlinks are not followed. sockets, FIFOs and devices are skipped too: we can't (or shouldn't) read them
+bool enumerate_dir (const Dir_handle & dir, function<void(const Dir_entry & e)> f)
+{
+    static thread_local vector<char> buf;
+    static thread_local vector<Pending_stat> pending;
+    if (buf.empty())
+        buf.resize (DIRENTS_BUFSIZE);
+
+    if (lseek (dir, 0, SEEK_SET)==-1)
+    {
+        wcerr << WFUNCTION << L"(): lseek() failed (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+
+    while (true)
+    {
+        long got=syscall (SYS_getdents64, dir, &buf[0], buf.size());
+        if (got==-1 && errno==EINTR)
+            continue;
+        if (got==-1)
+        {
+            wcerr << WFUNCTION << L"(): getdents64() failed (" << strerror (errno) << L")" << endl;
+            return false;
+        };
+        if (got==0)
+            return true;
+
+        pending.clear();
+        for (long pos=0; pos<got; )
+        {
+            const linux_dirent64* e=(const linux_dirent64*)&buf[pos];
+            pos+=e->d_reclen;
+
+            if (strcmp (e->d_name, ".")==0 || strcmp (e->d_name, "..")==0)
+                continue;
+
+            Pending_stat p;
+            p.name=e->d_name;
+            p.ok=false;
+            p.inode=e->d_ino;
+            p.links=1;
+
+            switch (e->d_type)
+            {
+                case DT_DIR:
+                    report_entry (f, e->d_name, true, 0, e->d_ino, 1);
+                    continue;
+                case DT_REG:
+                    p.need_type=false;
+                    break;
+                case DT_UNKNOWN: // some filesystems don't fill d_type
+                    p.need_type=true;
+                    break;
+                default:
+                    continue;
+            };
+            pending.push_back (p);
+        };
+
+        if (stat_entries_batched (dir, pending)==false)
+            for (auto &p : pending)
+                p.ok=stat_entry (dir, p.name, p.need_type, p.type, p.size, p.inode, p.links);
+
+        for (auto &p : pending)
+        {
+            if (p.ok==false)
+                continue;
+            if (p.type==S_IFDIR)
+                report_entry (f, p.name, true, 0, p.inode, 1);
+            else if (p.type==S_IFREG)
+                report_entry (f, p.name, false, p.size, p.inode, p.links);
+        };
+    };
+};
+#else
+// symlinks are not followed. sockets, FIFOs and devices are skipped too: we can't (or shouldn't) read them
+bool enumerate_dir (const Dir_handle & dir, function<void(const Dir_entry & e)> f)
+{
+    // fdopendir() takes ownership of descriptor, but caller still needs its own
+    int fd=dup (dir);
+    if (fd==-1)
+    {
+        wcerr << WFUNCTION << L"(): dup() failed (" << strerror (errno) << L")" << endl;
+        return false;
+    };
+
+    DIR* d=fdopendir (fd);
+    if (d==NULL)
+    {
+        wcerr << WFUNCTION << L"(): fdopendir() failed (" << strerror (errno) << L")" << endl;
+        close (fd);
+        return false;
+    };
+
+    struct dirent* e;
+    while (errno=0, (e=readdir (d))!=NULL)
+    {
+        if (strcmp (e->d_name, ".")==0 || strcmp (e->d_name, "..")==0)
+            continue;
+
+        struct stat st;
+        if (fstatat (dir, e->d_name, &st, AT_SYMLINK_NOFOLLOW)!=0)
+            continue; // deleted since readdir()?
+
+        if (S_ISDIR (st.st_mode))
+            report_entry (f, e->d_name, true, 0, st.st_ino, 1);
+        else if (S_ISREG (st.st_mode))
+            report_entry (f, e->d_name, false, st.st_size, st.st_ino, st.st_nlink);
+    };
+
+    bool rt=(errno==0);
+    if (rt==false)
+        wcerr << WFUNCTION << L"(): readdir() failed (" << strerror (errno) << L")" << endl;
+
+    closedir (d);
+    return rt;
+};
+#endif
+
+bool get_file_size (const Dir_handle & dir, const wstring & name, FileSize & out)
+{
+    struct stat st;
+    if (fstatat (dir, to_native (name).c_str(), &st, AT_SYMLINK_NOFOLLOW)!=0)
+        return false;
+    out=st.st_size;
+    return true;
+};
+
+bool get_dir_device (const Dir_handle & dir, uint64_t & out)
+{
+    struct stat st;
+    if (fstat (dir, &st)!=0)
+        return false;
+    out=st.st_dev;
+    return true;
+};
+
+static int open_file (const Dir_handle & dir, const wstring & name, const char* func)
+{
+    int fd=openat (dir, to_native (name).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd==-1)
+        wcerr << func << L"() can't open file " << name << L" (" << strerror (errno) << L")" << endl;
+    return fd;
+};
+
+// read up to len bytes at offset, short count is returned only at EOF
+static ssize_t pread_full (int fd, void* buf, size_t len, off_t offset)
+{
+    size_t got=0;
+    while (got<len)
+    {
+        ssize_t r=pread (fd, (char*)buf+got, len-got, offset+got);
+        if (r==-1 && errno==EINTR)
+            continue;
+        if (r==-1)
+            return -1;
+        if (r==0)
+            break;
+        got+=r;
+    };
+    return got;
+};
+
+#define FULL_HASH_BUFSIZE 1024000
+
+void find_data_range (int fd, FileSize offset, FileSize size, FileSize & data_start, FileSize & data_end)
+{
+    data_start=offset;
+    data_end=size;
+#ifdef SEEK_DATA
+    off_t d=lseek (fd, offset, SEEK_DATA);
+    if (d==-1)
+    {
+        if (errno==ENXIO) // hole till the end
+            data_start=size;
+        return; // otherwise, filesystem can't tell
+    };
+    data_start=min ((FileSize)d, size);
+
+    off_t h=lseek (fd, d, SEEK_HOLE);
+    if (h!=-1)
+        data_end=min ((FileSize)h, size);
+#endif
+};
+
+// it's sparse, if there are less blocks than the size needs. compressed files look so too,
+// but for them SEEK_DATA just says it's all data
+bool may_have_holes (const struct stat & st)
+{
+    return (FileSize)st.st_blocks*512 < (FileSize)st.st_size;
+};
+
+// leaf just before checkpoint, as it's in file now
+static bool hash_leaf_before (int fd, FileSize offset, uint8_t* buf, Digest & out)
+{
+    Hash_ctx ctx;
+    hash_init (&ctx);
+    for (size_t done=0; done<TREE_HASH_LEAF; )
+    {
+        size_t want=min ((size_t)FULL_HASH_BUFSIZE, TREE_HASH_LEAF-done);
+        if (pread_full (fd, buf, want, offset-TREE_HASH_LEAF+done)!=(ssize_t)want)
+            return false;
+        hash_process_bytes (&ctx, buf, want);
+        done+=want;
+    };
+    out=hash_finish (&ctx);
+    return true;
+};
+
+bool SHA512_of_file (const Dir_handle & dir, const wstring & name, Digest & rt)
+{
+    int fd=open_file (dir, name, WFUNCTION);
+    if (fd==-1)
+        return false;
+
+    struct stat st;
+    if (fstat (fd, &st)!=0)
+    {
+        wcerr << WFUNCTION << L"() can't stat file " << name << L" (" << strerror (errno) << L")" << endl;
+        close (fd);
+        return false;
+    };
+    FileSize size=st.st_size;
+    bool holes=may_have_holes (st);
+
+    if (hash_cache_get (fd, st, HASH_CACHE_FULL, rt))
+    {
+        close (fd);
+        return true;
+    };
+
+    uint8_t* buf=(uint8_t*)malloc(FULL_HASH_BUFSIZE);
+
+    assert (buf!=NULL);
+
+    // file which has grown since it was hashed is hashed from its checkpoint,
+    // if the leaf just before it is still the same
+    File_hash_ctx ctx;
+    File_hash_checkpoint cp;
+    FileSize offset=0;
+    Digest leaf;
+    if (tree_hashed (size) && hash_cache_get_checkpoint (fd, st, cp) && file_hash_resume (&ctx, size, cp) &&
+            hash_leaf_before (fd, cp.offset, buf, leaf) && leaf==cp.last_leaf)
+        offset=cp.offset;
+    else
+        file_hash_init (&ctx, size);
+
+    // only allocated ranges are read, holes are hashed as zeros
+    while (offset<size)
+    {
+        FileSize data_start=offset, data_end=size;
+        if (holes)
+            find_data_range (fd, offset, size, data_start, data_end);
+        file_hash_process_zeros (&ctx, data_start-offset);
+        offset=data_start;
+
+        while (offset<data_end)
+        {
+            size_t want=(size_t)min ((FileSize)FULL_HASH_BUFSIZE, data_end-offset);
+            ssize_t actually_read=pread_full (fd, buf, want, offset);
+            if (actually_read==-1)
+            {
+                wcerr << WFUNCTION << L"() can't read file " << name << L" (" << strerror (errno) << L")" << endl;
+                free (buf);
+                close (fd);
+                return false;
+            };
+            file_hash_process_bytes (&ctx, buf, actually_read);
+            offset+=actually_read;
+            if ((size_t)actually_read<want) // truncated while we read it
+            {
+                size=offset;
+                break;
+            };
+        };
+    };
+
+    free (buf);
+    bool has_checkpoint=file_hash_checkpoint (&ctx, size, cp);
+    rt=file_hash_finish (&ctx);
+    hash_cache_put (fd, st, HASH_CACHE_FULL, rt, has_checkpoint ? &cp : NULL);
+    close (fd);
+    return true;
+};
+
+// hash of samples of file, see partial_hash_samples()
+bool partial_SHA512_of_file (const Dir_handle & dir, const wstring & name, Digest & out, int level)
+{
+    int fd=open_file (dir, name, WFUNCTION);
+    if (fd==-1)
+        return false;
+
+    struct stat st;
+    if (fstat (fd, &st)!=0)
+    {
+        wcerr << WFUNCTION << L"(): fstat() failed for " << name << L" (" << strerror (errno) << L")" << endl;
+        close (fd);
+        return false;
+    };
+    FileSize filesize=st.st_size;
+
+    if (level==1 && hash_cache_get (fd, st, HASH_CACHE_PARTIAL, out))
+    {
+        close (fd);
+        return true;
+    };
+
+    Hash_ctx ctx;
+    hash_init (&ctx);
+
+    uint8_t buf[PARTIAL_SAMPLE_SIZE];
+    ssize_t actually_read;
+
+    for (auto &sample : partial_hash_samples (filesize, level))
+    {
+        actually_read=pread_full (fd, buf, sample.len, sample.offset);
+        if (actually_read==-1)
+        {
+            wcerr << WFUNCTION << L"() can't read file " << name << L" (" << strerror (errno) << L")" << endl;
+            close (fd);
+            return false;
+        };
+        hash_process_bytes (&ctx, buf, actually_read);
+    };
+
+    out=hash_finish (&ctx);
+    if (level==1)
+        hash_cache_put (fd, st, HASH_CACHE_PARTIAL, out);
+    close (fd);
+    return true;
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,382 @@
+// Batched I/O through io_uring (Linux only).
+// Stage 2 is nothing but random access latency: open, read 512 bytes, read another 512 bytes
+// (and a few more blocks of big files, see partial_hash_samples()).
+// Here opens and reads of many files are in flight at once, reads are positioned (no seeks),
+// and completed buffers are hashed by a pool of threads while I/O goes on.
+// Files of each device are limited by device's own queue depth (see io_scheduler.hpp),
+// so one slow spinning disk doesn't take all slots, and all devices are busy at once.
+// Files having partial hash in cache (see hash_cache.hpp) are not read at all: it's taken right after open.
+// If io_uring fails in the middle, what's in flight is completed, and files not done yet are read one by one.
+
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <algorithm>
+
+#include "utils.hpp"
+#include "hash_engine.hpp"
+#include "hash_cache.hpp"
+#include "uring.hpp"
+#include "blocking_queue.hpp"
+#include "io_scheduler.hpp"
+
+using namespace std;
+
+#define PARTIAL_RING_ENTRIES 1024
+#define PARTIAL_FILES_IN_FLIGHT 256
+// requests of files in flight (open and all reads) never take more than the whole ring
+
+struct Partial_slot;
+
+// one read of sample. low 2 bits of user_data are operation, the rest is pointer to this (or to slot, for open)
+struct Partial_read
+{
+    Partial_slot* slot;
+    size_t sample;
+};
+
+// what is going on with one file
+struct Partial_slot
+{
+    enum { OP_OPEN=0, OP_READ=1 };
+
+    size_t job;
+    Device_queue* dev;
+    string native_name; // must live until OPENAT completes
+    int fd;
+    int reads_pending;
+    bool failed;
+    bool cacheable;
+    struct stat st; // as it was opened, if it's cacheable
+    vector<Partial_sample> samples;
+    vector<Partial_read> reads;
+    vector<size_t> starts; // of samples in data
+    vector<uint8_t> data;
+    vector<size_t> got; // bytes read of each sample, read goes on from there (only 0 is end of file)
+};
+
+// directories are opened once for all their files in flight
+class Dir_fds
+{
+    private:
+        map<const wstring*, pair<int, size_t>> dirs; // directory name address -> (fd, files in flight)
+    public:
+        int acquire (const wstring* dir)
+        {
+            auto i=dirs.find (dir);
+            if (i!=dirs.end())
+            {
+                i->second.second++;
+                return i->second.first;
+            };
+
+            int fd;
+            if (open_dir (*dir, fd)==false)
+                return -1;
+            dirs[dir]=make_pair (fd, 1);
+            return fd;
+        };
+
+        void release (const wstring* dir)
+        {
+            auto i=dirs.find (dir);
+            assert (i!=dirs.end());
+            if (--i->second.second==0)
+            {
+                close (i->second.first);
+                dirs.erase (i);
+            };
+        };
+};
+
+static void partial_slot_submit_read (Uring & ring, Partial_slot* s, size_t sample)
+{
+    struct io_uring_sqe* sqe=ring.get_sqe();
+    assert (sqe!=NULL);
+    sqe->opcode=IORING_OP_READ;
+    sqe->fd=s->fd;
+    sqe->addr=(uintptr_t)(s->data.data()+s->starts[sample]+s->got[sample]);
+    sqe->len=s->samples[sample].len-s->got[sample];
+    sqe->off=s->samples[sample].offset+s->got[sample];
+    sqe->user_data=(uintptr_t)&s->reads[sample] | Partial_slot::OP_READ;
+    s->reads_pending++;
+};
+
+void partial_SHA512_of_files (const vector<Hash_job> & jobs, function<void(size_t job, bool ok, const Digest & hash)> done, int level)
+{
+    Uring ring (PARTIAL_RING_ENTRIES);
+    if (ring.ok()==false || ring.supports (IORING_OP_OPENAT)==false || ring.supports (IORING_OP_READ)==false)
+    {
+        partial_SHA512_of_files_one_by_one (jobs, done, level);
+        return;
+    };
+
+    // hashers get slots with all reads completed, and free them.
+    // whatever is ready is hashed together (see hash_messages()), but nothing waits for more
+    Blocking_queue<Partial_slot*> to_hash (PARTIAL_FILES_IN_FLIGHT);
+    vector<thread> hashers;
+    for (unsigned i=0; i<max (thread::hardware_concurrency(), 1U); i++)
+        hashers.push_back (thread ([&]()
+        {
+            size_t batch_max=hash_messages_batch();
+            vector<Partial_slot*> batch;
+            vector<const uint8_t*> msgs;
+            vector<size_t> lens;
+            vector<Digest> digests (batch_max);
+
+            Partial_slot* s;
+            while (to_hash.pop (s))
+            {
+                batch.clear();
+                do
+                {
+                    if (s->failed)
+                    {
+                        done (s->job, false, Digest());
+                        delete s;
+                    }
+                    else
+                        batch.push_back (s);
+                }
+                while (batch.size()<batch_max && to_hash.try_pop (s));
+
+                // samples read short (file truncated) are closed up in place
+                msgs.clear();
+                lens.clear();
+                for (size_t b=0; b<batch.size(); b++)
+                {
+                    Partial_slot* p=batch[b];
+                    size_t len=0;
+                    for (size_t i=0; i<p->samples.size(); i++)
+                    {
+                        if (p->got[i]>0) // data is empty (and NULL) for empty file
+                            memmove (p->data.data()+len, p->data.data()+p->starts[i], p->got[i]);
+                        len+=p->got[i];
+                    };
+                    msgs.push_back (p->data.data());
+                    lens.push_back (len);
+                };
+                hash_messages (batch.size(), msgs.data(), lens.data(), digests.data());
+
+                for (size_t b=0; b<batch.size(); b++)
+                {
+                    if (batch[b]->cacheable)
+                        hash_cache_put (jobs[batch[b]->job], batch[b]->st, HASH_CACHE_PARTIAL, digests[b]);
+                    done (batch[b]->job, true, digests[b]);
+                    delete batch[b];
+                };
+            };
+        }));
+
+    Dir_fds dirs;
+    vector<Device_queue> devices=group_jobs_by_device (jobs);
+    size_t left=jobs.size(), in_flight=0, requests=0; // requests of files in flight, done or not
+    bool broken=false; // io_uring failed, nothing is submitted anymore
+    vector<size_t> unfinished; // files in flight when it failed
+
+    // file in flight is not done here, its fd is closed and it's left for partial_SHA512_of_files_one_by_one()
+    auto give_up=[&](Partial_slot* s)
+    {
+        if (s->fd!=-1)
+            close (s->fd);
+        in_flight--;
+        requests-=1+s->samples.size();
+        s->dev->in_flight--;
+        unfinished.push_back (s->job);
+        delete s;
+    };
+
+    while ((left>0 && broken==false) || in_flight>0)
+    {
+        // round robin over devices, each one is filled up to its own depth
+        bool added=broken==false;
+        while (added && in_flight<PARTIAL_FILES_IN_FLIGHT)
+        {
+            added=false;
+            for (auto &d : devices)
+            {
+                if (d.next==d.jobs.size() || d.in_flight>=d.depth || in_flight>=PARTIAL_FILES_IN_FLIGHT)
+                    continue;
+                vector<Partial_sample> samples=partial_hash_samples (jobs[d.jobs[d.next]].size, level);
+                if (requests+1+samples.size()>ring.entries())
+                    continue;
+                added=true;
+                size_t job=d.jobs[d.next++];
+                left--;
+                int dir_fd=dirs.acquire (jobs[job].dir_name);
+                if (dir_fd==-1)
+                {
+                    done (job, false, Digest());
+                    continue;
+                };
+
+                Partial_slot* s=new Partial_slot;
+                s->job=job;
+                s->dev=&d;
+                s->native_name=to_native (*jobs[job].file_name);
+                s->fd=-1;
+                s->reads_pending=0;
+                s->failed=false;
+                s->cacheable=false;
+                s->samples=samples;
+                s->got.assign (samples.size(), 0);
+                size_t total=0;
+                for (size_t i=0; i<samples.size(); i++)
+                {
+                    s->reads.push_back (Partial_read{s, i});
+                    s->starts.push_back (total);
+                    total+=samples[i].len;
+                };
+                s->data.resize (total);
+                requests+=1+samples.size();
+
+                struct io_uring_sqe* sqe=ring.get_sqe();
+                assert (sqe!=NULL);
+                sqe->opcode=IORING_OP_OPENAT;
+                sqe->fd=dir_fd;
+                sqe->addr=(uintptr_t)s->native_name.c_str();
+                sqe->open_flags=O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+                sqe->user_data=(uintptr_t)s | Partial_slot::OP_OPEN;
+                in_flight++;
+                d.in_flight++;
+            };
+        };
+
+        if (in_flight==0)
+            break; // the rest of directories can't be opened
+
+        if (broken==false && ring.submit (1)==false)
+        {
+            wcerr << WFUNCTION << L"(): io_uring_enter() failed (" << strerror (errno) << L"), the rest of files are read one by one" << endl;
+            ring.drain(); // buffers and names of files in flight are in use until then
+            broken=true;
+        };
+
+        struct io_uring_cqe cqe;
+        while (ring.get_cqe (cqe))
+        {
+            Partial_slot* s;
+            Partial_read* r=NULL;
+            if ((cqe.user_data & 3)==Partial_slot::OP_OPEN)
+                s=(Partial_slot*)(uintptr_t)cqe.user_data;
+            else
+            {
+                r=(Partial_read*)(uintptr_t)(cqe.user_data & ~(uint64_t)3);
+                s=r->slot;
+            };
+            const Hash_job & job=jobs[s->job];
+
+            switch (cqe.user_data & 3)
+            {
+                case Partial_slot::OP_OPEN:
+                    dirs.release (job.dir_name);
+                    if (broken)
+                    {
+                        if (cqe.res>=0)
+                            s->fd=cqe.res;
+                        give_up (s);
+                        break;
+                    };
+                    if (cqe.res<0)
+                    {
+                        wcerr << WFUNCTION << L"() can't open file " << *job.dir_name << *job.file_name << L" (" << strerror (-cqe.res) << L")" << endl;
+                        s->failed=true;
+                        in_flight--;
+                        requests-=1+s->samples.size();
+                        s->dev->in_flight--;
+                        to_hash.push (s);
+                        break;
+                    };
+                    s->fd=cqe.res;
+                    remember_extent (*s->dev, job.inode, s->fd);
+                    if (level==1 && options.cache!=Options::CACHE_NONE && fstat (s->fd, &s->st)==0)
+                    {
+                        Digest d;
+                        if (hash_cache_get (s->fd, s->st, HASH_CACHE_PARTIAL, d))
+                        {
+                            close (s->fd);
+                            in_flight--;
+                            requests-=1+s->samples.size();
+                            s->dev->in_flight--;
+                            done (s->job, true, d);
+                            delete s;
+                            break;
+                        };
+                        s->cacheable=true;
+                    };
+                    for (size_t i=0; i<s->samples.size(); i++)
+                        partial_slot_submit_read (ring, s, i);
+                    break;
+
+                case Partial_slot::OP_READ:
+                    s->reads_pending--;
+                    if (broken)
+                    {
+                        if (s->reads_pending==0)
+                            give_up (s);
+                        break;
+                    };
+                    if (cqe.res<0)
+                    {
+                        if (s->failed==false)
+                            wcerr << WFUNCTION << L"() can't read file " << *job.dir_name << *job.file_name << L" (" << strerror (-cqe.res) << L")" << endl;
+                        s->failed=true;
+                    }
+                    else if (cqe.res>0)
+                    {
+                        s->got[r->sample]+=cqe.res;
+                        // short read isn't end of file yet: the rest is read again, in place of this request
+                        if (s->got[r->sample]<s->samples[r->sample].len)
+                        {
+                            partial_slot_submit_read (ring, s, r->sample);
+                            break;
+                        };
+                    };
+
+                    if (s->reads_pending==0)
+                    {
+                        close (s->fd);
+                        in_flight--;
+                        requests-=1+s->samples.size();
+                        s->dev->in_flight--;
+                        to_hash.push (s);
+                    };
+                    break;
+
+                default:
+                    assert (0);
+            };
+        };
+    };
+
+    to_hash.close();
+    for (auto &h : hashers)
+        h.join();
+
+    if (broken==false)
+        return;
+    for (auto &d : devices)
+        unfinished.insert (unfinished.end(), d.jobs.begin()+d.next, d.jobs.end());
+    vector<Hash_job> rest;
+    for (size_t job : unfinished)
+        rest.push_back (jobs[job]);
+    partial_SHA512_of_files_one_by_one (rest, [&](size_t i, bool ok, const Digest & hash) { done (unfinished[i], ok, hash); }, level);
+};
+
+#endif
+
+/* vim: set expandtab ts=4 sw=4 : */
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <assert.h>
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+#include <boost/utility.hpp>
+
+using namespace std;
+
+// Pool of worker threads, each having its own deque of tasks.
+// Worker pushes and pops its own tasks at the back (depth-first, so it stays within
+// recently touched directories), idle workers steal from the front of other deques
+// (oldest tasks, which are usually the biggest subtrees).
+// Tasks may push new tasks while running, run() returns when all of them are done.
+// Workers with nothing to take sleep until a task is pushed or the last one is done, so one
+// long directory being enumerated doesn't keep all other cores busy with nothing.
+template <typename Task>
+class Work_stealing_pool : boost::noncopyable
+{
+    private:
+        struct Worker_deque
+        {
+            mutex lock;
+            deque<Task> tasks;
+        };
+
+        vector<unique_ptr<Worker_deque>> deques;
+        atomic<size_t> unfinished; // pushed, but not yet completed
+        atomic<size_t> queued; // pushed, but not yet taken by any worker
+        atomic<bool> aborted;
+        mutex idle_lock;
+        condition_variable idle;
+        atomic<size_t> sleeping;
+        exception_ptr first_exception;
+        mutex first_exception_lock;
+
+        bool pop_own (size_t worker, Task & out)
+        {
+            Worker_deque & d=*deques[worker];
+            lock_guard<mutex> l(d.lock);
+            if (d.tasks.empty())
+                return false;
+            out=d.tasks.back();
+            d.tasks.pop_back();
+            queued--;
+            return true;
+        };
+
+        bool steal (size_t thief, Task & out)
+        {
+            for (size_t i=1; i<deques.size(); i++)
+            {
+                Worker_deque & d=*deques[(thief+i) % deques.size()];
+                lock_guard<mutex> l(d.lock);
+                if (d.tasks.empty())
+                    continue;
+                out=d.tasks.front();
+                d.tasks.pop_front();
+                queued--;
+                return true;
+            };
+            return false;
+        };
+
+        // sleeping is counted before queued is checked, and push() counts queued before it checks
+        // sleeping, so either this one sees the task, or push() sees the sleeper and wakes it
+        void wait_for_work()
+        {
+            unique_lock<mutex> l(idle_lock);
+            sleeping++;
+            while (queued==0 && unfinished>0 && !aborted)
+                idle.wait (l);
+            sleeping--;
+        };
+
+        void wake_all()
+        {
+            lock_guard<mutex> l(idle_lock);
+            idle.notify_all();
+        };
+
+        void worker_loop (size_t worker, const function<void(size_t, Task)> & f)
+        {
+            while (unfinished>0 && !aborted)
+            {
+                Task t;
+                if (pop_own (worker, t)==false && steal (worker, t)==false)
+                {
+                    // someone is still working and may push more tasks
+                    wait_for_work();
+                    continue;
+                };
+
+                try
+                {
+                    f (worker, t);
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> l(first_exception_lock);
+                    if (!first_exception)
+                        first_exception=current_exception();
+                    aborted=true;
+                    wake_all();
+                };
+                if (--unfinished==0)
+                    wake_all();
+            };
+        };
+
+    public:
+        Work_stealing_pool (size_t threads)
+        {
+            if (threads==0)
+                threads=1;
+            for (size_t i=0; i<threads; i++)
+                deques.push_back (unique_ptr<Worker_deque>(new Worker_deque));
+            unfinished=0;
+            queued=0;
+            aborted=false;
+            sleeping=0;
+        };
+
+        size_t threads() const { return deques.size(); };
+
+        // may be called before run() or from inside of task being run by 'worker'
+        void push (size_t worker, Task t)
+        {
+            assert (worker<deques.size());
+            unfinished++;
+            queued++; // before it can be taken, so queued doesn't go below 0
+            Worker_deque & d=*deques[worker];
+            {
+                lock_guard<mutex> l(d.lock);
+                d.tasks.push_back (t);
+            };
+            if (sleeping>0)
+            {
+                lock_guard<mutex> l(idle_lock);
+                idle.notify_one();
+            };
+        };
+
+        // f(worker, task) is called for each task on one of the pool threads.
+        // the first exception thrown by f stops all workers and rethrown here.
+        void run (function<void(size_t worker, Task t)> f)
+        {
+            vector<thread> workers;
+            for (size_t i=1; i<deques.size(); i++)
+                workers.push_back (thread (&Work_stealing_pool::worker_loop, this, i, cref(f)));
+            worker_loop (0, f);
+            for (auto &w : workers)
+                w.join();
+
+            if (first_exception)
+                rethrow_exception (first_exception);
+        };
+};
+
+/* vim: set expandtab ts=4 sw=4 : */